@@ -0,0 +1,97 @@
+/*
+** Bump arena of image-tagger
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/** Define the size of a chunk, larger requests get a chunk of their own */
+#define CHUNK_SIZE 4096
+
+/** Define the alignment of every allocation */
+#define ALIGNMENT 16
+
+/**
+ * Take memory from an arena
+ * @param arena the arena
+ * @param size the number of bytes
+ * @return void* the memory, valid until the arena is reset, NULL on failure
+ */
+void* arena_alloc(Arena *arena, size_t size){
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    Arena_chunk *chunk = arena->current;
+    if (chunk != NULL && chunk->size - arena->used >= size){
+        void *memory = chunk->data + arena->used;
+        arena->used += size;
+        return memory;
+    }
+    // move on to the next chunk kept from earlier requests, if it is large
+    // enough, otherwise put a new one in front of it
+    Arena_chunk *next = chunk != NULL ? chunk->next : arena->first;
+    if (next == NULL || next->size < size){
+        size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        Arena_chunk *fresh = malloc(sizeof(Arena_chunk) + chunk_size);
+        if (fresh == NULL){ return NULL; }
+        fresh->size = chunk_size;
+        fresh->next = next;
+        if (chunk != NULL){
+            chunk->next = fresh;
+        }else{
+            arena->first = fresh;
+        }
+        next = fresh;
+    }
+    arena->current = next;
+    arena->used = size;
+    return next->data;
+}
+
+/**
+ * Format a string into an arena
+ * @param arena the arena
+ * @param format the printf format
+ * @return Slice the string, NUL terminated, text is NULL on failure
+ */
+Slice arena_printf(Arena *arena, char const *format, ...){
+    Slice text = {NULL, 0};
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0){ return text; }
+    char *out = arena_alloc(arena, length + 1);
+    if (out == NULL){ return text; }
+    va_start(args, format);
+    vsnprintf(out, length + 1, format, args);
+    va_end(args);
+    text.text = out;
+    text.length = length;
+    return text;
+}
+
+/**
+ * Give back everything taken from an arena, the chunks are kept
+ * @param arena the arena
+ */
+void arena_reset(Arena *arena){
+    arena->current = NULL;
+    arena->used = 0;
+}
+
+/**
+ * Release the chunks of an arena, it is empty afterwards
+ * @param arena the arena
+ */
+void arena_free(Arena *arena){
+    Arena_chunk *chunk = arena->first;
+    while (chunk != NULL){
+        Arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = NULL;
+    arena_reset(arena);
+}
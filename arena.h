@@ -0,0 +1,45 @@
+/*
+** Bump arena of image-tagger
+ * The scratch memory of one request (response headers, inserted text,
+ * iovec lists) is carved from chunks owned by the connection and given
+ * back all at once when the request is served. Chunks are kept for the
+ * next request, so a connection stops allocating once it has seen its
+ * largest response.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include "slice.h"
+
+/** A block of arena memory
+ *  @param Arena_chunk *next The chunk used after this one
+ *  @param size_t size The number of bytes in data
+ *  @param char data[] The memory
+ */
+typedef struct Arena_chunk {
+    struct Arena_chunk *next;
+    size_t size;
+    char data[];
+} Arena_chunk;
+
+/** An arena, zeroed is empty and valid
+ *  @param Arena_chunk *first The first chunk
+ *  @param Arena_chunk *current The chunk allocations are taken from
+ *  @param size_t used The bytes of current handed out
+ */
+typedef struct {
+    Arena_chunk *first;
+    Arena_chunk *current;
+    size_t used;
+} Arena;
+
+/** Prototypes */
+void* arena_alloc(Arena *arena, size_t size);
+Slice arena_printf(Arena *arena, char const *format, ...);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,281 @@
+/*
+** Microbenchmark of image-tagger
+ * Replays scripted games through the socket-free game core in memory, on
+ * one shard and without the event loop: two players register, start and
+ * get paired, exchange guesses until they agree on a keyword, quit and are
+ * released as if their sessions expired. Only the call to the core is
+ * timed, the requests are parsed beforehand, and the nanoseconds per
+ * request of each phase are reported. Run it from the
+ * directory holding images.txt and the pages, the tags agreed go to a
+ * temporary directory that is removed afterwards.
+ * usage: bench [-n games] [-g guesses] [-z]
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "game.h"
+
+/** Define the size of a scripted request */
+#define REQUEST_SIZE 512
+
+/** Define the target of every request after the registration */
+#define START "/?start=Start"
+
+/** Define the file of the images played */
+#define IMAGE_MANIFEST "images.txt"
+
+/** Define the directory of the images served locally */
+#define IMAGE_DIR "images"
+
+/** Represents the phases measured */
+typedef enum
+{
+    PHASE_REGISTER,
+    PHASE_PAIR,
+    PHASE_GUESS,
+    PHASE_ENDGAME,
+    PHASE_QUIT,
+    NUM_PHASES
+} PHASE;
+
+static char const * const PHASE_NAMES[NUM_PHASES] = {
+    "register", "pair", "guess", "endgame", "quit"
+};
+
+/** The time spent in the core and the requests of every phase */
+static uint64_t phase_ns[NUM_PHASES];
+static uint64_t phase_ops[NUM_PHASES];
+
+/** The scripted requests ask for gzip pages */
+static bool gzip;
+
+/** The memory the responses are built in */
+static Arena arena;
+
+/**
+ * The monotonic clock
+ * @return uint64_t the current time in nanoseconds
+ */
+static uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Deliver a message at once, the benchmark runs a single shard
+ * @param shard_id the receiving shard
+ * @param message the message, freed once handled
+ */
+void send_message(int shard_id, Message *message){
+    game_message(&shards[shard_id], message);
+    message_free(message);
+}
+
+/**
+ * Nothing is ever parked, the scripted players do not poll
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player
+ */
+void answer_poll(Shard *shard, int cookie_id){
+    (void)shard;
+    (void)cookie_id;
+}
+
+/**
+ * Read the cookie a response sets
+ * @param response the response
+ * @return int the cookie, -1 if it sets none
+ */
+static int response_cookie(Response const *response){
+    if (response->iovcnt == 0){ return -1; }
+    char const *header = response->iov[0].iov_base;
+    char const *id = memmem(header, response->iov[0].iov_len, "id= ", 4);
+    return id != NULL ? atoi(id + 4) : -1;
+}
+
+/**
+ * Run one scripted request through the core and time it
+ * @param shard the shard
+ * @param phase the phase the time is added to
+ * @param method "GET" or "POST"
+ * @param target the request target
+ * @param cookie the cookie sent, -1 for none
+ * @param body the form posted, NULL for none
+ * @return int the cookie the response sets, -1 if none or on failure
+ */
+static int replay(Shard *shard, PHASE phase, char const *method,
+                  char const *target, int cookie, char const *body){
+    char text[REQUEST_SIZE];
+    int length = snprintf(text, sizeof(text), "%s %s HTTP/1.1\r\n"
+                          "Host: bench\r\n%s", method, target,
+                          gzip ? "Accept-Encoding: gzip\r\n" : "");
+    if (cookie >= 0){
+        length += snprintf(text + length, sizeof(text) - length,
+                           "Cookie: id=%d\r\n", cookie);
+    }
+    if (body != NULL){
+        length += snprintf(text + length, sizeof(text) - length,
+                           "Content-Length: %zu\r\n\r\n%s", strlen(body),
+                           body);
+    }else{
+        length += snprintf(text + length, sizeof(text) - length, "\r\n");
+    }
+    Http_request request;
+    size_t scanned = 0;
+    if (http_parse_head(text, length, &scanned, &request) <= 0){
+        return -1;
+    }
+
+    Response response = {.arena = &arena};
+    uint64_t start = now_ns();
+    bool handled = game_request(shard, &request, &response);
+    phase_ns[phase] += now_ns() - start;
+    phase_ops[phase]++;
+    int set = handled ? response_cookie(&response) : -1;
+    if (response.file != NULL){
+        file_release(response.file);
+    }
+    if (response.stream.fill != NULL){
+        response.stream.release(response.stream.state);
+    }
+    arena_reset(&arena);
+    return set;
+}
+
+/**
+ * Play one game between two new players and release them
+ * @param shard the shard
+ * @param game the number of the game, keeps the guesses apart
+ * @param guesses the guesses of each player before they agree
+ * @return Boolean true if the players were paired and agreed
+ */
+static bool play(Shard *shard, int game, int guesses){
+    char body[64];
+    int cookies[2];
+    for (int i = 0; i < 2; i++){
+        snprintf(body, sizeof(body), "user=player%d", i);
+        cookies[i] = replay(shard, PHASE_REGISTER, "POST", "/", -1, body);
+        if (cookies[i] < 0){ return false; }
+    }
+    for (int i = 0; i < 2; i++){
+        replay(shard, PHASE_PAIR, "GET", START, cookies[i], NULL);
+    }
+    int slots[2];
+    for (int i = 0; i < 2; i++){
+        slots[i] = (cookies[i] & COOKIE_MASK) / num_shards;
+    }
+    if (session_get(&shard->sessions, slots[0])->other_index != slots[1]){
+        return false;
+    }
+    // the guesses of the two players never meet until the last one
+    for (int g = 0; g < guesses; g++){
+        for (int i = 0; i < 2; i++){
+            snprintf(body, sizeof(body), "keyword=word%d_%d_%d", i, g, game);
+            replay(shard, PHASE_GUESS, "POST", START, cookies[i], body);
+        }
+    }
+    snprintf(body, sizeof(body), "keyword=agreed%d", game);
+    replay(shard, PHASE_GUESS, "POST", START, cookies[0], body);
+    replay(shard, PHASE_ENDGAME, "POST", START, cookies[1], body);
+    bool agreed = session_get(&shard->sessions, slots[1])->stage ==
+                  PAGE_ENDGAME;
+
+    for (int i = 0; i < 2; i++){
+        snprintf(body, sizeof(body), "quit=Quit");
+        replay(shard, PHASE_QUIT, "POST", START, cookies[i], body);
+        matchmaker_cancel(&shard->matchmaker, &shard->sessions, slots[i]);
+        session_release(&shard->sessions, slots[i]);
+    }
+    return agreed;
+}
+
+int main(int argc, char * argv[])
+{
+    int games = 100000;
+    int guesses = 4;
+    int option;
+    while ((option = getopt(argc, argv, "n:g:z")) != -1)
+    {
+        switch (option)
+        {
+            case 'n': games = atoi(optarg); break;
+            case 'g': guesses = atoi(optarg); break;
+            case 'z': gzip = true; break;
+            default: optind = argc + 1; break;
+        }
+    }
+    if (optind != argc || games < 1 || guesses < 0)
+    {
+        fprintf(stderr, "usage: %s [-n games] [-g guesses] [-z]\n", argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/image_tagger_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    char tag_log[64], tag_index[64], event_log[64];
+    snprintf(tag_log, sizeof(tag_log), "%s/tags.log", dir);
+    snprintf(tag_index, sizeof(tag_index), "%s/tags.idx", dir);
+    snprintf(event_log, sizeof(event_log), "%s/events.log", dir);
+
+    num_shards = 1;
+    shards = calloc(num_shards, sizeof(Shard));
+    Shard *shard = shards;
+    if (shards == NULL || tag_store_open(&tags, tag_log, tag_index) < 0 ||
+        event_log_open(&events, event_log, num_shards) < 0 ||
+        catalog_load(&catalog, IMAGE_MANIFEST, &tags) < 0 ||
+        matchmaker_init(&shard->matchmaker, catalog.count) < 0 ||
+        templates_load(&shard->templates) < 0)
+    {
+        perror("bench");
+        return 1;
+    }
+    file_cache_init(&shard->files, IMAGE_DIR);
+    shard->log = &events.rings[0];
+    session_store_init(&shard->sessions, COOKIE_MASK + 1);
+    shard->parked_head = -1;
+    shard->parked_tail = -1;
+    timer_wheel_init(&shard->session_timers, session_now(), expire_session,
+                     shard);
+
+    int failed = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < games; i++)
+    {
+        failed += !play(shard, i, guesses);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%d games, %d guesses each, %s pages, %.2f s\n", games, guesses,
+           gzip ? "gzip" : "plain", seconds);
+    printf("%-10s %12s %10s\n", "phase", "requests", "ns/op");
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        printf("%-10s %12llu %10.0f\n", PHASE_NAMES[i],
+               (unsigned long long)phase_ops[i],
+               phase_ops[i] ? (double)phase_ns[i] / phase_ops[i] : 0.0);
+    }
+    if (failed > 0)
+    {
+        printf("%d games did not end in an agreement\n", failed);
+    }
+
+    tag_store_flush(&tags);
+    event_log_close(&events);
+    unlink(tag_log);
+    unlink(tag_index);
+    unlink(event_log);
+    rmdir(dir);
+    return failed > 0;
+}
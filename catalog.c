@@ -0,0 +1,290 @@
+/*
+** Image catalog of image-tagger
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog.h"
+
+/**
+ * Read a whole file
+ * @param path the file name
+ * @param size set to the number of bytes read
+ * @return char* the content, NULL on failure
+ */
+static char* read_manifest(char const *path, size_t *size){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){ return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        close(fd);
+        return NULL;
+    }
+    char *content = malloc(st.st_size + 1);
+    size_t n = 0;
+    while (content != NULL && n < (size_t)st.st_size){
+        ssize_t r = read(fd, content + n, st.st_size - n);
+        if (r < 0 && errno == EINTR){ continue; }
+        if (r <= 0){ break; }
+        n += r;
+    }
+    close(fd);
+    *size = n;
+    return content;
+}
+
+/**
+ * Order two (tags, id) keys
+ * @param a the first key
+ * @param b the second key
+ * @return int negative, zero or positive as for qsort
+ */
+static int compare_keys(void const *a, void const *b){
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Load the manifest, one URL per line, blank lines and lines starting with
+ * '#' are skipped, and rank the images by the tags the store holds
+ * @param catalog the catalog
+ * @param path the manifest
+ * @param store the tag store, already open
+ * @return int 0 on success, -1 otherwise
+ */
+int catalog_load(Image_catalog *catalog, char const *path, Tag_store *store){
+    memset(catalog, 0, sizeof(Image_catalog));
+    size_t size;
+    catalog->text = read_manifest(path, &size);
+    if (catalog->text == NULL){ return -1; }
+
+    // count the lines first, every array is sized once
+    int lines = 1;
+    for (size_t i = 0; i < size; i++){
+        lines += catalog->text[i] == '\n';
+    }
+    catalog->urls = malloc(lines * sizeof(Slice));
+    if (catalog->urls == NULL){ return -1; }
+    char *line = catalog->text;
+    char *end = catalog->text + size;
+    while (line < end){
+        char *stop = memchr(line, '\n', end - line);
+        char *next = stop != NULL ? stop + 1 : end;
+        if (stop == NULL){ stop = end; }
+        while (line < stop && (*line == ' ' || *line == '\t')){ line++; }
+        while (stop > line && (stop[-1] == ' ' || stop[-1] == '\t' ||
+                               stop[-1] == '\r')){
+            stop--;
+        }
+        if (line < stop && *line != '#'){
+            if (catalog->count == TAG_IMAGES){
+                fprintf(stderr, "%s: more than %d images\n", path,
+                        TAG_IMAGES);
+                errno = EINVAL;
+                return -1;
+            }
+            catalog->urls[catalog->count].text = line;
+            catalog->urls[catalog->count].length = stop - line;
+            catalog->count++;
+        }
+        line = next;
+    }
+    if (catalog->count == 0){
+        fprintf(stderr, "%s: no image\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int count = catalog->count;
+    uint64_t *keys = malloc(count * sizeof(uint64_t));
+    catalog->tags = malloc(count * sizeof(uint32_t));
+    catalog->order = malloc(count * sizeof(int));
+    catalog->position = malloc(count * sizeof(int));
+    catalog->open = malloc(count * sizeof(int));
+    if (keys == NULL || catalog->tags == NULL || catalog->order == NULL ||
+        catalog->position == NULL || catalog->open == NULL){
+        free(keys);
+        return -1;
+    }
+    for (int i = 0; i < count; i++){
+        catalog->tags[i] = tag_store_total(store, i);
+        keys[i] = (uint64_t)catalog->tags[i] << 32 | i;
+    }
+    qsort(keys, count, sizeof(uint64_t), compare_keys);
+    for (int i = 0; i < count; i++){
+        catalog->order[i] = (int)(keys[i] & 0xffffffff);
+        catalog->position[catalog->order[i]] = i;
+    }
+    free(keys);
+    pthread_mutex_init(&catalog->lock, NULL);
+    return 0;
+}
+
+/**
+ * Serve the images a local directory holds from this server, an image is
+ * found by the last part of its URL, which becomes prefix followed by it
+ * @param catalog the catalog, loaded
+ * @param dir the directory
+ * @param prefix the path the directory is served under
+ * @return int the number of images served locally
+ */
+int catalog_localize(Image_catalog *catalog, char const *dir,
+                     char const *prefix){
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0){ return 0; }
+    size_t prefix_length = strlen(prefix);
+    size_t size = 0;
+    for (int i = 0; i < catalog->count; i++){
+        size += prefix_length + catalog->urls[i].length;
+    }
+    catalog->local = malloc(size);
+    int found = 0;
+    char *out = catalog->local;
+    for (int i = 0; out != NULL && i < catalog->count; i++){
+        Slice url = catalog->urls[i];
+        char const *slash = memrchr(url.text, '/', url.length);
+        char const *name = slash != NULL ? slash + 1 : url.text;
+        size_t length = url.text + url.length - name;
+        if (!file_name_valid(name, length)){ continue; }
+        char path[FILE_NAME_MAX];
+        memcpy(path, name, length);
+        path[length] = '\0';
+        struct stat st;
+        if (fstatat(dirfd, path, &st, 0) < 0 || !S_ISREG(st.st_mode)){
+            continue;
+        }
+        memcpy(out, prefix, prefix_length);
+        memcpy(out + prefix_length, name, length);
+        catalog->urls[i].text = out;
+        catalog->urls[i].length = prefix_length + length;
+        out += prefix_length + length;
+        found++;
+    }
+    close(dirfd);
+    return found;
+}
+
+/**
+ * Choose the image of a new game
+ * @param catalog the catalog
+ * @param waiting counts the players waiting for an image
+ * @return int the image id
+ */
+int catalog_schedule(Image_catalog *catalog, int (*waiting)(int image)){
+    pthread_mutex_lock(&catalog->lock);
+    while (catalog->open_length > 0){
+        int image = catalog->open[catalog->open_head];
+        catalog->open_head = (catalog->open_head + 1) % catalog->count;
+        catalog->open_length--;
+        // somebody still waits on it, the new player becomes the partner
+        if (waiting(image) > 0){
+            pthread_mutex_unlock(&catalog->lock);
+            return image;
+        }
+    }
+    // take turns among the images with the fewest tags
+    uint32_t fewest = catalog->tags[catalog->order[0]];
+    if (catalog->next >= catalog->count ||
+        catalog->tags[catalog->order[catalog->next]] != fewest){
+        catalog->next = 0;
+    }
+    int image = catalog->order[catalog->next++];
+    pthread_mutex_unlock(&catalog->lock);
+    return image;
+}
+
+/**
+ * Note that a player waits on an image without anybody to pair with, the
+ * next game scheduled gets it
+ * @param catalog the catalog
+ * @param image the image id
+ */
+void catalog_open(Image_catalog *catalog, int image){
+    if (image < 0 || image >= catalog->count){ return; }
+    pthread_mutex_lock(&catalog->lock);
+    // a full ring gives up its oldest image, the likeliest nobody waits on
+    if (catalog->open_length == catalog->count){
+        catalog->open_head = (catalog->open_head + 1) % catalog->count;
+        catalog->open_length--;
+    }
+    catalog->open[(catalog->open_head + catalog->open_length) %
+                  catalog->count] = image;
+    catalog->open_length++;
+    pthread_mutex_unlock(&catalog->lock);
+}
+
+/**
+ * Count one more tag agreed on for an image, it moves to the end of the
+ * images tied with it so order stays sorted
+ * @param catalog the catalog
+ * @param image the image id
+ */
+void catalog_tagged(Image_catalog *catalog, int image){
+    if (image < 0 || image >= catalog->count){ return; }
+    pthread_mutex_lock(&catalog->lock);
+    uint32_t tags = catalog->tags[image];
+    // the last index of order holding an image with as many tags
+    int low = catalog->position[image];
+    int high = catalog->count;
+    while (low < high){
+        int middle = low + (high - low) / 2;
+        if (catalog->tags[catalog->order[middle]] > tags){
+            high = middle;
+        }else{
+            low = middle + 1;
+        }
+    }
+    int last = low - 1;
+    int other = catalog->order[last];
+    catalog->order[last] = image;
+    catalog->order[catalog->position[image]] = other;
+    catalog->position[other] = catalog->position[image];
+    catalog->position[image] = last;
+    catalog->tags[image]++;
+    pthread_mutex_unlock(&catalog->lock);
+}
+
+/**
+ * Count several tags agreed on for an image at once, as another node
+ * reports them; the count stops at the largest one a tag count holds
+ * @param catalog the catalog
+ * @param image the image id
+ * @param count the number of tags
+ */
+void catalog_tagged_n(Image_catalog *catalog, int image, uint32_t count){
+    if (image < 0 || image >= catalog->count || count == 0){ return; }
+    pthread_mutex_lock(&catalog->lock);
+    uint32_t tags = catalog->tags[image];
+    if (count > UINT32_MAX - tags){ count = UINT32_MAX - tags; }
+    tags += count;
+    // the last index of order holding an image with at most as many tags
+    int from = catalog->position[image];
+    int low = from;
+    int high = catalog->count;
+    while (low < high){
+        int middle = low + (high - low) / 2;
+        if (catalog->tags[catalog->order[middle]] <= tags){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    int last = low - 1;
+    // the images it passes move one place towards the front
+    for (int i = from; i < last; i++){
+        catalog->order[i] = catalog->order[i + 1];
+        catalog->position[catalog->order[i]] = i;
+    }
+    catalog->order[last] = image;
+    catalog->position[image] = last;
+    catalog->tags[image] = tags;
+    pthread_mutex_unlock(&catalog->lock);
+}
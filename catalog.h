@@ -0,0 +1,71 @@
+/*
+** Image catalog of image-tagger
+ * The images are listed in a manifest, one URL per line, and known by the
+ * position of their line, a compact integer id. A new game is given an
+ * image a player already waits on alone, so the two meet, or otherwise the
+ * image with the fewest agreed tags, taking turns among those tied. The
+ * images found in a local directory are served by the server itself, their
+ * URLs are replaced by the path they are served under.
+*/
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "file_cache.h"
+#include "slice.h"
+#include "tag_store.h"
+
+/** The images and the scheduler shared by every shard
+ *  @param char *text The content of the manifest, urls point into it
+ *  @param Slice *urls The URL of each image
+ *  @param char *local The URLs of the images served locally
+ *  @param int count The number of images
+ *  @param pthread_mutex_t lock Guards everything below
+ *  @param uint32_t *tags The agreed tags of each image
+ *  @param int *order The ids sorted by their tags, fewest first
+ *  @param int *position The index of each id in order
+ *  @param int next The next index of order to hand out
+ *  @param int *open A ring of images a player waits on alone, oldest first
+ *  @param int open_head The index of the oldest entry of open
+ *  @param int open_length The number of entries in open, at most count
+ */
+typedef struct {
+    char *text;
+    Slice *urls;
+    char *local;
+    int count;
+    pthread_mutex_t lock;
+    uint32_t *tags;
+    int *order;
+    int *position;
+    int next;
+    int *open;
+    int open_head;
+    int open_length;
+} Image_catalog;
+
+/** Prototypes */
+int catalog_load(Image_catalog *catalog, char const *path, Tag_store *store);
+int catalog_localize(Image_catalog *catalog, char const *dir,
+                     char const *prefix);
+int catalog_schedule(Image_catalog *catalog, int (*waiting)(int image));
+void catalog_open(Image_catalog *catalog, int image);
+void catalog_tagged(Image_catalog *catalog, int image);
+void catalog_tagged_n(Image_catalog *catalog, int image, uint32_t count);
+
+/**
+ * The URL of an image
+ * @param catalog the catalog
+ * @param image the image id
+ * @return Slice the URL, empty for an unknown id
+ */
+static inline Slice catalog_url(Image_catalog const *catalog, int image){
+    Slice none = {"", 0};
+    return image >= 0 && image < catalog->count ? catalog->urls[image] : none;
+}
+
+#endif
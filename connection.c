@@ -0,0 +1,461 @@
+/*
+** Client connections of image-tagger
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "connection.h"
+
+/** Define the initial size of a send queue */
+#define QUEUE_SIZE 1024
+
+/** Define the most bytes of a file handed to one sendfile() */
+#define SENDFILE_CHUNK (1 << 20)
+
+/** Define the most bytes of body in one chunk of a stream */
+#define STREAM_CHUNK 16384
+
+/** Define the room left in front of a chunk for its size line */
+#define STREAM_HEAD 16
+
+/** Define the # chunks of a stream sent per wakeup, the other connections
+ *  of the shard are served in between */
+#define STREAM_BURST 8
+
+/** Define the default buff size, the least free space offered to read() */
+#define BUFF_SIZE 2048
+
+/** Define the most input buffered for one connection */
+#define INPUT_LIMIT (MAX_HEAD + MAX_BODY + BUFF_SIZE)
+
+/**
+ * Create the state of a client socket
+ * @param fd the socket, already non-blocking
+ * @param owner the shard serving the connection
+ * @return Connection* the connection, NULL on failure
+ */
+Connection* connection_create(int fd, void *owner){
+    Connection *connection = calloc(1, sizeof(Connection));
+    if (connection == NULL){ return NULL; }
+    connection->fd = fd;
+    connection->owner = owner;
+    connection->parked = -1;
+    return connection;
+}
+
+/**
+ * Report a failed system call on a connection to the event log, or to
+ * stderr without one
+ * @param connection the connection
+ * @param origin the call that failed
+ * @param call the name of the call
+ */
+static void report_error(Connection const *connection, ORIGIN origin,
+                         char const *call){
+    if (connection->log != NULL){
+        log_event(connection->log, LOG_ERROR, connection->fd, errno, origin,
+                  0, 0);
+    }else{
+        perror(call);
+    }
+}
+
+/**
+ * Unregister, disarm, close and release a connection
+ * @param loop the event loop it is registered with, NULL if none
+ * @param connection the connection
+ */
+void connection_close(Event_loop *loop, Connection *connection){
+    if (loop != NULL){
+        event_loop_remove(loop, connection->fd);
+    }
+    timer_cancel(&connection->timer);
+    if (connection->metrics != NULL){
+        metric_add(&connection->metrics->connections_closed, 1);
+    }
+    if (connection->log != NULL){
+        log_event(connection->log, LOG_CLOSE, connection->fd, 0, 0, 0, 0);
+    }
+    if (connection->file != NULL){
+        file_release(connection->file);
+    }
+    if (connection->stream.fill != NULL){
+        connection->stream.release(connection->stream.state);
+    }
+    close(connection->fd);
+    free(connection->queue);
+    free(connection->input);
+    arena_free(&connection->arena);
+    free(connection);
+}
+
+/**
+ * Append bytes to the send queue
+ * @param connection the connection
+ * @param data the bytes
+ * @param length the number of bytes
+ * @return int 0 on success, -1 otherwise
+ */
+static int enqueue(Connection *connection, char const *data, size_t length){
+    // move the unsent bytes to the front before growing
+    if (connection->queue_head > 0){
+        memmove(connection->queue, connection->queue + connection->queue_head,
+                connection->queue_length - connection->queue_head);
+        connection->queue_length -= connection->queue_head;
+        connection->queue_head = 0;
+    }
+    size_t needed = connection->queue_length + length;
+    if (needed > connection->queue_capacity){
+        size_t capacity = connection->queue_capacity ?
+                          connection->queue_capacity : QUEUE_SIZE;
+        while (capacity < needed){
+            capacity *= 2;
+        }
+        char *queue = realloc(connection->queue, capacity);
+        if (queue == NULL){ return -1; }
+        connection->queue = queue;
+        connection->queue_capacity = capacity;
+    }
+    memcpy(connection->queue + connection->queue_length, data, length);
+    connection->queue_length += length;
+    return 0;
+}
+
+/**
+ * Send a response given as an iovec list, the iovecs only need to stay
+ * valid for the duration of the call
+ * @param loop the event loop the connection is registered with
+ * @param connection the connection
+ * @param iov the pieces of the response
+ * @param iovcnt the number of pieces
+ * @return int 0 if sent or queued, -1 if the connection is broken
+ */
+int connection_send(Event_loop *loop, Connection *connection,
+                    struct iovec *iov, int iovcnt){
+    size_t sent = 0;
+    bool was_pending = connection_pending(connection);
+    // keep the order, nothing can be written before the queue is drained
+    if (!was_pending){
+        for (int done = 0; done < iovcnt; done += IOV_MAX){
+            int count = iovcnt - done < IOV_MAX ? iovcnt - done : IOV_MAX;
+            ssize_t n = writev(connection->fd, iov + done, count);
+            if (n < 0 && errno != EAGAIN && errno != EINTR){
+                report_error(connection, ORIGIN_WRITE, "writev");
+                return -1;
+            }
+            size_t asked = 0;
+            for (int i = done; i < done + count; i++){
+                asked += iov[i].iov_len;
+            }
+            if (n > 0){ sent += n; }
+            if (n < 0 || (size_t)n < asked){ break; }
+        }
+    }
+    if (sent > 0 && connection->metrics != NULL){
+        metric_add(&connection->metrics->bytes_written, sent);
+    }
+    // queue the unsent tail
+    for (int i = 0; i < iovcnt; i++){
+        if (sent >= iov[i].iov_len){
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        if (enqueue(connection, (char const *)iov[i].iov_base + sent,
+                    iov[i].iov_len - sent) < 0){
+            return -1;
+        }
+        sent = 0;
+    }
+    if (!was_pending && connection_pending(connection)){
+        return event_loop_modify(loop, connection->fd, EVENT_WRITE);
+    }
+    return 0;
+}
+
+/**
+ * Send as much of the pending file as the socket takes, it is released once
+ * sent
+ * @param connection the connection
+ * @return int 0 on success, -1 if the connection is broken
+ */
+static int send_file(Connection *connection){
+    while (connection->file_remaining > 0){
+        size_t chunk = connection->file_remaining < SENDFILE_CHUNK ?
+                       connection->file_remaining : SENDFILE_CHUNK;
+        ssize_t n = sendfile(connection->fd, connection->file->fd,
+                             &connection->file_offset, chunk);
+        if (n < 0){
+            if (errno == EAGAIN){ return 0; }
+            if (errno == EINTR){ continue; }
+            report_error(connection, ORIGIN_WRITE, "sendfile");
+            return -1;
+        }
+        // the file shrank, the promised length can not be sent
+        if (n == 0){
+            errno = EIO;
+            report_error(connection, ORIGIN_WRITE, "sendfile");
+            return -1;
+        }
+        connection->file_remaining -= n;
+        if (connection->metrics != NULL){
+            metric_add(&connection->metrics->bytes_written, n);
+        }
+    }
+    file_release(connection->file);
+    connection->file = NULL;
+    return 0;
+}
+
+/**
+ * Send part of a file after what was sent before, straight from the page
+ * cache
+ * @param loop the event loop the connection is registered with
+ * @param connection the connection
+ * @param file the file, its reference is taken over
+ * @param offset the offset of the first byte
+ * @param length the number of bytes
+ * @return int 0 if sent or pending, -1 if the connection is broken
+ */
+int connection_send_file(Event_loop *loop, Connection *connection,
+                         File *file, off_t offset, size_t length){
+    bool was_pending = connection_pending(connection);
+    connection->file = file;
+    connection->file_offset = offset;
+    connection->file_remaining = length;
+    if (was_pending){ return 0; }
+    if (send_file(connection) < 0){ return -1; }
+    if (connection_pending(connection)){
+        return event_loop_modify(loop, connection->fd, EVENT_WRITE);
+    }
+    return 0;
+}
+
+/**
+ * Produce and send the next chunks of the stream, a burst at most, until
+ * the socket stops taking them, the stream is released once its last
+ * chunk is out
+ * @param connection the connection
+ * @return int 0 on success, -1 if the connection is broken
+ */
+static int send_stream(Connection *connection){
+    char buffer[STREAM_HEAD + STREAM_CHUNK + 2];
+    char *body = buffer + STREAM_HEAD;
+    for (int i = 0; i < STREAM_BURST && connection->stream.fill != NULL;
+         i++){
+        Stream *stream = &connection->stream;
+        long n = stream->fill(stream->state, body, STREAM_CHUNK);
+        if (n < 0){
+            // the body is cut short, only closing tells the client
+            report_error(connection, ORIGIN_WRITE, "stream");
+            return -1;
+        }
+        char *start = body;
+        size_t length = n;
+        if (stream->chunked){
+            // the size line goes in front of the data, the last is empty
+            char head[STREAM_HEAD];
+            int head_length = snprintf(head, sizeof(head), "%lx\r\n", n);
+            start -= head_length;
+            memcpy(start, head, head_length);
+            memcpy(body + n, "\r\n", 2);
+            length += head_length + 2;
+        }
+        if (n == 0){
+            stream->release(stream->state);
+            memset(stream, 0, sizeof(Stream));
+        }
+        ssize_t sent = length > 0 ? write(connection->fd, start, length) : 0;
+        if (sent < 0){
+            if (errno != EAGAIN && errno != EINTR){
+                report_error(connection, ORIGIN_WRITE, "write");
+                return -1;
+            }
+            sent = 0;
+        }
+        if (sent > 0 && connection->metrics != NULL){
+            metric_add(&connection->metrics->bytes_written, sent);
+        }
+        // the socket is full, the rest waits in the queue
+        if ((size_t)sent < length){
+            return enqueue(connection, start + sent, length - sent);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Stream a body after what was sent before, it is pulled from its producer
+ * only as fast as the socket takes it
+ * @param loop the event loop the connection is registered with
+ * @param connection the connection
+ * @param stream the producer, taken over
+ * @return int 0 if sent or pending, -1 if the connection is broken
+ */
+int connection_send_stream(Event_loop *loop, Connection *connection,
+                           Stream const *stream){
+    bool was_pending = connection_pending(connection);
+    connection->stream = *stream;
+    // without chunks the end of the body is the end of the connection
+    if (!stream->chunked){
+        connection->closing = true;
+    }
+    if (was_pending){ return 0; }
+    if (send_stream(connection) < 0){ return -1; }
+    if (connection_pending(connection)){
+        return event_loop_modify(loop, connection->fd, EVENT_WRITE);
+    }
+    return 0;
+}
+
+/**
+ * Write as much of the send queue and the file or stream after it as the
+ * socket takes, called when it is writable
+ * @param loop the event loop the connection is registered with
+ * @param connection the connection
+ * @return int 0 on success, -1 if the connection is broken
+ */
+int connection_flush(Event_loop *loop, Connection *connection){
+    while (connection->queue_head < connection->queue_length){
+        ssize_t n = write(connection->fd,
+                          connection->queue + connection->queue_head,
+                          connection->queue_length - connection->queue_head);
+        if (n < 0){
+            if (errno == EAGAIN){ return 0; }
+            if (errno == EINTR){ continue; }
+            report_error(connection, ORIGIN_WRITE, "write");
+            return -1;
+        }
+        connection->queue_head += n;
+        if (connection->metrics != NULL){
+            metric_add(&connection->metrics->bytes_written, n);
+        }
+    }
+    connection->queue_head = 0;
+    connection->queue_length = 0;
+    if (connection->file != NULL){
+        if (send_file(connection) < 0){ return -1; }
+        // the socket is full again, wait until it is writable
+        if (connection->file != NULL){ return 0; }
+    }
+    if (connection->stream.fill != NULL){
+        if (send_stream(connection) < 0){ return -1; }
+        // more chunks follow the next time the socket is writable
+        if (connection_pending(connection)){ return 0; }
+    }
+    // drained, read the next request
+    return event_loop_modify(loop, connection->fd, EVENT_READ);
+}
+
+/**
+ * Check whether a connection still has bytes to send
+ * @param connection the connection
+ * @return Boolean true if the queue is not empty or a file or stream is
+ *                 being sent
+ */
+bool connection_pending(Connection const *connection){
+    return connection->queue_head < connection->queue_length ||
+           connection->file != NULL || connection->stream.fill != NULL;
+}
+
+/**
+ * Check whether a connection has input not served yet, the start of a
+ * request or requests pipelined behind the one being answered
+ * @param connection the connection
+ * @return Boolean true if unserved bytes are buffered
+ */
+bool connection_buffered(Connection const *connection){
+    return connection->input_head < connection->input_length;
+}
+
+/**
+ * Make room for one more read, the parsed request follows its buffer
+ * @param connection the connection
+ * @return int 0 on success, -1 if the input limit is reached
+ */
+static int reserve_input(Connection *connection){
+    char const *old = connection->input + connection->input_head;
+    // move the unserved bytes to the front first
+    if (connection->input_head > 0 &&
+        connection->input_capacity - connection->input_length < BUFF_SIZE){
+        memmove(connection->input, connection->input + connection->input_head,
+                connection->input_length - connection->input_head);
+        connection->input_length -= connection->input_head;
+        connection->input_head = 0;
+    }
+    if (connection->input_capacity - connection->input_length < BUFF_SIZE){
+        size_t capacity = connection->input_capacity ?
+                          connection->input_capacity * 2 : BUFF_SIZE;
+        if (capacity > INPUT_LIMIT){ capacity = INPUT_LIMIT; }
+        if (capacity <= connection->input_length){
+            errno = ENOBUFS;
+            return -1;
+        }
+        char *input = realloc(connection->input, capacity);
+        if (input == NULL){ return -1; }
+        connection->input = input;
+        connection->input_capacity = capacity;
+    }
+    char const *now = connection->input + connection->input_head;
+    if (connection->parsed && now != old){
+        http_rebase(&connection->request, old, now);
+    }
+    return 0;
+}
+
+/**
+ * Read what the socket has into the input buffer
+ * @param connection the connection
+ * @return int the number of bytes read, 0 if the peer closed, -1 on error
+ *             (errno is EAGAIN if there was nothing to read)
+ */
+int connection_read(Connection *connection){
+    if (reserve_input(connection) < 0){ return -1; }
+    ssize_t n = read(connection->fd,
+                     connection->input + connection->input_length,
+                     connection->input_capacity - connection->input_length);
+    if (n > 0){
+        connection->input_length += n;
+    }
+    return n;
+}
+
+/**
+ * Parse the next buffered request
+ * @param connection the connection
+ * @return int 1 when connection->request is complete, HTTP_INCOMPLETE if
+ *             more input is needed, HTTP_BAD or HTTP_TOO_LARGE otherwise
+ */
+int connection_next_request(Connection *connection){
+    char const *data = connection->input + connection->input_head;
+    size_t length = connection->input_length - connection->input_head;
+    if (!connection->parsed){
+        if (length == 0){ return HTTP_INCOMPLETE; }
+        int result = http_parse_head(data, length, &connection->scanned,
+                                     &connection->request);
+        if (result <= 0){ return result; }
+        connection->parsed = true;
+    }
+    return length >= connection->request.length ? 1 : HTTP_INCOMPLETE;
+}
+
+/**
+ * Drop the request that was just served and its scratch memory
+ * @param connection the connection
+ */
+void connection_consume(Connection *connection){
+    arena_reset(&connection->arena);
+    connection->input_head += connection->request.length;
+    connection->parsed = false;
+    connection->scanned = 0;
+    if (connection->input_head == connection->input_length){
+        connection->input_head = 0;
+        connection->input_length = 0;
+    }
+}
@@ -0,0 +1,110 @@
+/*
+** Client connections of image-tagger
+ * A response is handed over as an iovec list and sent with one writev().
+ * Sockets are non-blocking, whatever the kernel does not take is copied to
+ * a per-connection queue that is drained when the socket is writable, and
+ * no new request is read from the connection until it is empty. The body
+ * of a file response follows the queue with sendfile(), never copied, and
+ * a streamed body is produced a burst of chunks at a time once the queue
+ * is empty.
+ * Input is buffered per connection, a request may arrive over several reads
+ * and several pipelined requests may arrive in one.
+*/
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "event.h"
+#include "event_log.h"
+#include "file_cache.h"
+#include "http.h"
+#include "metrics.h"
+#include "stream.h"
+#include "timer_wheel.h"
+
+/** The state of one client socket
+ *  @param int fd The socket
+ *  @param void *owner The shard serving the connection
+ *  @param uint32_t address The IPv4 address of the client, network order
+ *  @param char *queue The bytes not sent yet
+ *  @param size_t queue_head The offset of the first unsent byte
+ *  @param size_t queue_length The end of the unsent bytes
+ *  @param size_t queue_capacity The allocated size of queue
+ *  @param File *file The file sent after the queue, NULL if none
+ *  @param off_t file_offset The offset of the next byte of file to send
+ *  @param size_t file_remaining The bytes of file not sent yet
+ *  @param Stream stream The body produced after the queue, its fill is NULL
+ *  if none
+ *  @param char *input The bytes read and not served yet
+ *  @param size_t input_head The offset of the first unserved byte
+ *  @param size_t input_length The end of the bytes read
+ *  @param size_t input_capacity The allocated size of input
+ *  @param size_t scanned How much of the next request head was searched
+ *  @param bool parsed The head of request is parsed, its body may still be
+ *  arriving
+ *  @param Http_request request The request being served, its slices point
+ *  into input
+ *  @param bool closing The connection is closed once the queue is drained
+ *  @param Arena arena The scratch memory of the request being served
+ *  @param Metrics *metrics The metrics of the shard serving the connection,
+ *  may be NULL
+ *  @param Log_ring *log The event log ring of the shard serving the
+ *  connection, may be NULL
+ *  @param int parked The slot of the player whose next event the connection
+ *  waits for, no request is served meanwhile, -1 if not parked
+ *  @param Timer timer Closes the connection once idle or too slow
+ *  @param uint32_t active_at The second bytes were last read or written
+ *  @param uint32_t request_at The second the unserved input began to arrive
+ */
+typedef struct {
+    int fd;
+    void *owner;
+    uint32_t address;
+    char *queue;
+    size_t queue_head;
+    size_t queue_length;
+    size_t queue_capacity;
+    File *file;
+    off_t file_offset;
+    size_t file_remaining;
+    Stream stream;
+    char *input;
+    size_t input_head;
+    size_t input_length;
+    size_t input_capacity;
+    size_t scanned;
+    bool parsed;
+    Http_request request;
+    bool closing;
+    Arena arena;
+    Metrics *metrics;
+    Log_ring *log;
+    int parked;
+    Timer timer;
+    uint32_t active_at;
+    uint32_t request_at;
+} Connection;
+
+/** Prototypes */
+Connection* connection_create(int fd, void *owner);
+void connection_close(Event_loop *loop, Connection *connection);
+int connection_send(Event_loop *loop, Connection *connection,
+                    struct iovec *iov, int iovcnt);
+int connection_send_file(Event_loop *loop, Connection *connection,
+                         File *file, off_t offset, size_t length);
+int connection_send_stream(Event_loop *loop, Connection *connection,
+                           Stream const *stream);
+int connection_flush(Event_loop *loop, Connection *connection);
+bool connection_pending(Connection const *connection);
+bool connection_buffered(Connection const *connection);
+int connection_read(Connection *connection);
+int connection_next_request(Connection *connection);
+void connection_consume(Connection *connection);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+** Event engine of image-tagger
+ * The registry is a flat array indexed by fd which doubles on demand, the
+ * kernel only ever tells us the fd and the handler is looked up from it.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef EVENT_USE_SELECT
+#include <sys/select.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+#include "event.h"
+
+/** Define the initial size of the fd registry */
+#define REGISTRY_SIZE 64
+
+/** Define the max # events fetched by one epoll_wait */
+#define MAX_EVENTS 256
+
+/** The registration of one fd
+ *  @param Event_handler handler The callback, NULL when the slot is free
+ *  @param void *data The pointer passed back to the callback
+ *  @param unsigned events The mask of events the fd is watched for
+ */
+typedef struct {
+    Event_handler handler;
+    void *data;
+    unsigned events;
+} Event_slot;
+
+struct Event_loop {
+    Event_slot *slots;
+    int capacity;
+    bool running;
+#ifdef EVENT_USE_SELECT
+    fd_set readfds;
+    fd_set writefds;
+    int maxfd;
+#else
+    int epfd;
+#endif
+};
+
+/**
+ * Make sure the registry can hold a given fd
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @return int 0 on success, -1 otherwise
+ */
+static int registry_reserve(Event_loop *loop, int fd){
+    if (fd < loop->capacity){ return 0; }
+    int capacity = loop->capacity;
+    while (capacity <= fd){
+        capacity *= 2;
+    }
+    Event_slot *slots = realloc(loop->slots, capacity * sizeof(Event_slot));
+    if (slots == NULL){ return -1; }
+    memset(slots + loop->capacity, 0,
+           (capacity - loop->capacity) * sizeof(Event_slot));
+    loop->slots = slots;
+    loop->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Create an empty event loop
+ * @return Event_loop* the loop, NULL on failure
+ */
+Event_loop* event_loop_create(void){
+    Event_loop *loop = calloc(1, sizeof(Event_loop));
+    if (loop == NULL){ return NULL; }
+    loop->slots = calloc(REGISTRY_SIZE, sizeof(Event_slot));
+    loop->capacity = REGISTRY_SIZE;
+    if (loop->slots == NULL){
+        free(loop);
+        return NULL;
+    }
+#ifdef EVENT_USE_SELECT
+    FD_ZERO(&loop->readfds);
+    FD_ZERO(&loop->writefds);
+    loop->maxfd = -1;
+#else
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0){
+        free(loop->slots);
+        free(loop);
+        return NULL;
+    }
+#endif
+    return loop;
+}
+
+/**
+ * Release the loop, registered fds are left open
+ * @param loop the event loop
+ */
+void event_loop_destroy(Event_loop *loop){
+    if (loop == NULL){ return; }
+#ifndef EVENT_USE_SELECT
+    close(loop->epfd);
+#endif
+    free(loop->slots);
+    free(loop);
+}
+
+#ifdef EVENT_USE_SELECT
+/**
+ * Mirror the mask of a fd into the select sets
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param events the mask of events
+ */
+static void select_update(Event_loop *loop, int fd, unsigned events){
+    if (events & EVENT_READ){ FD_SET(fd, &loop->readfds); }
+    else{ FD_CLR(fd, &loop->readfds); }
+    if (events & EVENT_WRITE){ FD_SET(fd, &loop->writefds); }
+    else{ FD_CLR(fd, &loop->writefds); }
+}
+#else
+/**
+ * Translate a loop mask into an epoll mask
+ * @param events the mask of events
+ * @return uint32_t the epoll mask
+ */
+static uint32_t epoll_mask(unsigned events){
+    uint32_t mask = 0;
+    if (events & EVENT_READ){ mask |= EPOLLIN | EPOLLRDHUP; }
+    if (events & EVENT_WRITE){ mask |= EPOLLOUT; }
+    return mask;
+}
+#endif
+
+/**
+ * Register a fd with its handler
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param events the mask of events to watch
+ * @param handler the callback
+ * @param data the pointer passed back to the callback
+ * @return int 0 on success, -1 otherwise (errno is set)
+ */
+int event_loop_add(Event_loop *loop, int fd, unsigned events,
+                   Event_handler handler, void *data){
+#ifdef EVENT_USE_SELECT
+    // select() can not watch anything at or beyond FD_SETSIZE
+    if (fd >= FD_SETSIZE){
+        errno = EMFILE;
+        return -1;
+    }
+#endif
+    if (fd < 0 || registry_reserve(loop, fd) < 0){
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+#ifdef EVENT_USE_SELECT
+    select_update(loop, fd, events);
+    if (fd > loop->maxfd){ loop->maxfd = fd; }
+#else
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_mask(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){ return -1; }
+#endif
+    loop->slots[fd].handler = handler;
+    loop->slots[fd].data = data;
+    loop->slots[fd].events = events;
+    return 0;
+}
+
+/**
+ * Change the mask of events a registered fd is watched for
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param events the new mask of events
+ * @return int 0 on success, -1 otherwise
+ */
+int event_loop_modify(Event_loop *loop, int fd, unsigned events){
+    if (fd < 0 || fd >= loop->capacity || !loop->slots[fd].handler){
+        errno = EBADF;
+        return -1;
+    }
+    if (loop->slots[fd].events == events){ return 0; }
+#ifdef EVENT_USE_SELECT
+    select_update(loop, fd, events);
+#else
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_mask(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0){ return -1; }
+#endif
+    loop->slots[fd].events = events;
+    return 0;
+}
+
+/**
+ * Unregister a fd, the caller still owns (and closes) it
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @return int 0 on success, -1 otherwise
+ */
+int event_loop_remove(Event_loop *loop, int fd){
+    if (fd < 0 || fd >= loop->capacity || !loop->slots[fd].handler){
+        errno = EBADF;
+        return -1;
+    }
+    memset(&loop->slots[fd], 0, sizeof(Event_slot));
+#ifdef EVENT_USE_SELECT
+    select_update(loop, fd, 0);
+    // shrink the maximum tracker past any trailing free slots
+    while (loop->maxfd >= 0 && !loop->slots[loop->maxfd].handler){
+        --loop->maxfd;
+    }
+#else
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    return 0;
+}
+
+/**
+ * Call the handler of a ready fd if it is still registered
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param events the mask of events that fired
+ */
+static void dispatch(Event_loop *loop, int fd, unsigned events){
+    // an earlier handler of the same batch may have removed this fd
+    if (fd >= loop->capacity || !loop->slots[fd].handler){ return; }
+    Event_slot slot = loop->slots[fd];
+    slot.handler(loop, fd, events, slot.data);
+}
+
+/**
+ * Run the loop until event_loop_stop is called
+ * @param loop the event loop
+ * @return int 0 when stopped, -1 on a fatal wait error
+ */
+int event_loop_run(Event_loop *loop){
+    loop->running = true;
+    while (loop->running)
+    {
+#ifdef EVENT_USE_SELECT
+        // monitor file descriptors
+        fd_set readfds = loop->readfds;
+        fd_set writefds = loop->writefds;
+        if (select(loop->maxfd + 1, &readfds, &writefds, NULL, NULL) < 0)
+        {
+            if (errno == EINTR){ continue; }
+            perror("select");
+            return -1;
+        }
+        // loop all possible descriptor
+        int maxfd = loop->maxfd;
+        for (int i = 0; i <= maxfd; ++i){
+            unsigned events = 0;
+            if (FD_ISSET(i, &readfds)){ events |= EVENT_READ; }
+            if (FD_ISSET(i, &writefds)){ events |= EVENT_WRITE; }
+            if (events){
+                dispatch(loop, i, events);
+            }
+        }
+#else
+        struct epoll_event ready[MAX_EVENTS];
+        int n = epoll_wait(loop->epfd, ready, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR){ continue; }
+            perror("epoll_wait");
+            return -1;
+        }
+        // only the ready descriptors are visited
+        for (int i = 0; i < n; ++i){
+            unsigned events = 0;
+            if (ready[i].events & (EPOLLIN | EPOLLRDHUP)){ events |= EVENT_READ; }
+            if (ready[i].events & EPOLLOUT){ events |= EVENT_WRITE; }
+            if (ready[i].events & (EPOLLERR | EPOLLHUP)){
+                events |= EVENT_ERROR | EVENT_READ;
+            }
+            dispatch(loop, ready[i].data.fd, events);
+        }
+#endif
+    }
+    return 0;
+}
+
+/**
+ * Make event_loop_run return after the current batch
+ * @param loop the event loop
+ */
+void event_loop_stop(Event_loop *loop){
+    loop->running = false;
+}
+
+/**
+ * The name of the compiled-in backend
+ * @return char const* "epoll" or "select"
+ */
+char const* event_loop_backend(void){
+#ifdef EVENT_USE_SELECT
+    return "select";
+#else
+    return "epoll";
+#endif
+}
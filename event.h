@@ -0,0 +1,39 @@
+/*
+** Event engine of image-tagger
+ * A small readiness loop with a per-fd handler registry. The default backend
+ * is epoll, so a wakeup costs O(ready fds) and there is no FD_SETSIZE
+ * ceiling; building with -DEVENT_USE_SELECT falls back to select() so both
+ * can be compared.
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+/** Event mask bits passed to and from the loop */
+#define EVENT_READ  0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4
+
+typedef struct Event_loop Event_loop;
+
+/** Callback of a registered fd
+ *  @param loop the loop that dispatched the event
+ *  @param fd the ready file descriptor
+ *  @param events mask of EVENT_READ/EVENT_WRITE/EVENT_ERROR that fired
+ *  @param data the pointer given at registration
+ */
+typedef void (*Event_handler)(Event_loop *loop, int fd, unsigned events,
+                              void *data);
+
+/** Prototypes */
+Event_loop* event_loop_create(void);
+void event_loop_destroy(Event_loop *loop);
+int event_loop_add(Event_loop *loop, int fd, unsigned events,
+                   Event_handler handler, void *data);
+int event_loop_modify(Event_loop *loop, int fd, unsigned events);
+int event_loop_remove(Event_loop *loop, int fd);
+int event_loop_run(Event_loop *loop);
+void event_loop_stop(Event_loop *loop);
+char const* event_loop_backend(void);
+
+#endif
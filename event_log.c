@@ -0,0 +1,195 @@
+/*
+** Event log of image-tagger
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "event_log.h"
+
+/** Define the size of a cache line, the rings are aligned to it */
+#define CACHE_LINE 64
+
+/**
+ * Open the log file for appending and start it with a LOG_OPEN record
+ * @param log the event log
+ * @return int 0 on success, -1 otherwise
+ */
+static int open_file(Event_log *log){
+    log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0644);
+    struct stat st;
+    if (log->fd < 0 || fstat(log->fd, &st) < 0){
+        return -1;
+    }
+    log->size = st.st_size;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    Log_record open = {
+        .time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000,
+        .type = LOG_OPEN,
+        .fd = -1,
+        .a = sizeof(Log_record),
+        .c = LOG_MAGIC
+    };
+    if (write(log->fd, &open, sizeof(open)) == sizeof(open)){
+        log->size += sizeof(open);
+    }
+    return 0;
+}
+
+/**
+ * Move a full log aside to path.1, replacing the previous one, and start a
+ * new file. A log that can not be moved is kept and tried again once it has
+ * grown as much again, one that can not be reopened is no longer written
+ * @param log the event log
+ */
+static void rotate(Event_log *log){
+    size_t length = strlen(log->path);
+    char old[length + 3];
+    memcpy(old, log->path, length);
+    memcpy(old + length, ".1", 3);
+    if (rename(log->path, old) < 0){
+        perror(log->path);
+        log->size = 0;
+        return;
+    }
+    close(log->fd);
+    log->fd = -1;
+    if (open_file(log) < 0){
+        perror(log->path);
+        if (log->fd >= 0){
+            close(log->fd);
+        }
+        log->fd = -1;
+    }
+}
+
+/**
+ * Write the records a ring holds, they are released even if the write
+ * fails, a shard never waits for the disk
+ * @param log the event log
+ * @param ring the ring
+ * @return bool true if there were records
+ */
+static bool drain(Event_log *log, Log_ring *ring){
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (head == tail && dropped == ring->dropped_seen){
+        return false;
+    }
+    // the records wrap around the end of the ring at most once
+    struct iovec iov[3];
+    int iovcnt = 0;
+    uint64_t start = tail & (LOG_RING_SIZE - 1);
+    uint64_t count = head - tail;
+    uint64_t first = count < LOG_RING_SIZE - start ?
+                     count : LOG_RING_SIZE - start;
+    iov[iovcnt].iov_base = &ring->records[start];
+    iov[iovcnt++].iov_len = first * sizeof(Log_record);
+    if (count > first){
+        iov[iovcnt].iov_base = ring->records;
+        iov[iovcnt++].iov_len = (count - first) * sizeof(Log_record);
+    }
+    Log_record lost = {0};
+    if (dropped != ring->dropped_seen){
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        lost.time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        lost.type = LOG_DROPPED;
+        lost.shard = ring->shard;
+        lost.fd = -1;
+        lost.c = dropped - ring->dropped_seen;
+        ring->dropped_seen = dropped;
+        iov[iovcnt].iov_base = &lost;
+        iov[iovcnt++].iov_len = sizeof(lost);
+    }
+    if (log->fd >= 0){
+        ssize_t n = writev(log->fd, iov, iovcnt);
+        if (n < 0){
+            perror(log->path);
+        }else{
+            log->size += n;
+        }
+    }
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * The writer thread, drains every ring in turn and sleeps once all are
+ * empty
+ * @param arg the event log
+ * @return NULL
+ */
+static void* writer_main(void *arg){
+    Event_log *log = arg;
+    struct timespec pause = {0, LOG_DRAIN_INTERVAL * 1000000L};
+    for (;;){
+        // whatever was written before stopping is drained once more
+        bool stopping = __atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE);
+        bool written = false;
+        for (int i = 0; i < log->num_rings; i++){
+            written |= drain(log, &log->rings[i]);
+        }
+        if (log->fd >= 0 && log->size >= LOG_ROTATE_SIZE){
+            rotate(log);
+        }
+        if (stopping){
+            return NULL;
+        }
+        if (!written){
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+/**
+ * Open the log file, create a ring per shard and start the writer thread
+ * @param log the event log
+ * @param path the log file
+ * @param num_rings the number of shards
+ * @return int 0 on success, -1 otherwise
+ */
+int event_log_open(Event_log *log, char const *path, int num_rings){
+    memset(log, 0, sizeof(Event_log));
+    log->path = strdup(path);
+    log->num_rings = num_rings;
+    if (log->path == NULL ||
+        posix_memalign((void **)&log->rings, CACHE_LINE,
+                       num_rings * sizeof(Log_ring)) != 0){
+        return -1;
+    }
+    memset(log->rings, 0, num_rings * sizeof(Log_ring));
+    for (int i = 0; i < num_rings; i++){
+        log->rings[i].shard = i;
+    }
+    // without a file the records are still drained, and lost
+    if (open_file(log) < 0){
+        perror(path);
+    }
+    if (pthread_create(&log->writer, NULL, writer_main, log)){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop the writer thread once it has drained every ring, the shards must
+ * not write any more
+ * @param log the event log
+ */
+void event_log_close(Event_log *log){
+    __atomic_store_n(&log->stopping, true, __ATOMIC_RELEASE);
+    pthread_join(log->writer, NULL);
+    if (log->fd >= 0){
+        close(log->fd);
+    }
+}
@@ -0,0 +1,172 @@
+/*
+** Event log of image-tagger
+ * A trace of what the server does, kept off the request path: every shard
+ * writes fixed size binary records into its own single-producer ring, with
+ * no lock and no system call, and a writer thread drains the rings to a
+ * file that is rotated once it grows past a limit. A record that finds its
+ * ring full is dropped and counted, the shards never wait for the disk.
+ * Every file starts with a LOG_OPEN record, logdump turns it into text.
+*/
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pthread.h>
+
+/** Define the # records of a ring, a power of two */
+#define LOG_RING_SIZE (1 << 14)
+
+/** Define the size a log grows to before it is rotated */
+#define LOG_ROTATE_SIZE (64 << 20)
+
+/** Define the milliseconds the writer sleeps once the rings are empty */
+#define LOG_DRAIN_INTERVAL 50
+
+/** Define the value of c in LOG_OPEN, "ITLOG" and the format version */
+#define LOG_MAGIC 0x49544c4f47000001ULL
+
+/** Represents the types of record */
+typedef enum
+{
+    LOG_OPEN,
+    LOG_CONNECT,
+    LOG_SHED,
+    LOG_CLOSE,
+    LOG_REQUEST,
+    LOG_PAIR,
+    LOG_MATCH,
+    LOG_ERROR,
+    LOG_DROPPED,
+    NUM_LOG_EVENTS
+} LOG_EVENT;
+
+/** Represents where a LOG_ERROR happened */
+typedef enum
+{
+    ORIGIN_ACCEPT,
+    ORIGIN_READ,
+    ORIGIN_WRITE,
+    ORIGIN_EVENT_LOOP,
+    ORIGIN_TAG_STORE,
+    ORIGIN_KEYWORD_SET,
+    NUM_ORIGINS
+} ORIGIN;
+
+/** One record, the meaning of code, a, b and c depends on the type:
+ *  LOG_OPEN     a: sizeof(Log_record), c: LOG_MAGIC
+ *  LOG_CONNECT  fd, a: IPv4 address, b: port, both in network order
+ *  LOG_SHED     fd, a: IPv4 address, b: port, both in network order
+ *  LOG_CLOSE    fd
+ *  LOG_REQUEST  fd, code: ROUTE, a: METHOD, b: microseconds taken,
+ *               c: player id or all ones
+ *  LOG_PAIR     a: player id, b: partner id, c: image
+ *  LOG_MATCH    a: player id, b: partner id, c: image
+ *  LOG_ERROR    fd or -1, code: errno, a: ORIGIN
+ *  LOG_DROPPED  c: the records dropped since the last LOG_DROPPED
+ *  A player id is slot * workers + shard.
+ *  @param uint64_t time The unix time in microseconds
+ *  @param uint8_t type The LOG_EVENT
+ *  @param uint8_t shard The shard that wrote it
+ *  @param uint16_t code A small value
+ *  @param int32_t fd The client socket, -1 if none
+ *  @param uint32_t a A value
+ *  @param uint32_t b A value
+ *  @param uint64_t c A value
+ */
+typedef struct {
+    uint64_t time;
+    uint8_t type;
+    uint8_t shard;
+    uint16_t code;
+    int32_t fd;
+    uint32_t a;
+    uint32_t b;
+    uint64_t c;
+} Log_record;
+
+/** The ring of one shard, head and tail sit on cache lines of their own
+ *  @param uint64_t head The records written, only the shard stores it
+ *  @param uint64_t tail_seen The tail the shard read last
+ *  @param uint64_t dropped The records dropped as the ring was full
+ *  @param uint64_t tail The records drained, only the writer stores it
+ *  @param uint64_t dropped_seen The drops the writer has logged
+ *  @param int shard The shard writing to the ring
+ *  @param Log_record records[LOG_RING_SIZE] The records
+ */
+typedef struct {
+    uint64_t head;
+    uint64_t tail_seen;
+    uint64_t dropped;
+    char pad[40];
+    uint64_t tail;
+    uint64_t dropped_seen;
+    int shard;
+    char pad2[44];
+    Log_record records[LOG_RING_SIZE];
+} Log_ring;
+
+/** The event log shared by every shard
+ *  @param char *path The file written
+ *  @param int fd The file, -1 if it could not be opened
+ *  @param uint64_t size The bytes in the file
+ *  @param Log_ring *rings The ring of every shard
+ *  @param int num_rings The number of rings
+ *  @param bool stopping Set to make the writer drain once more and return
+ *  @param pthread_t writer The thread draining the rings
+ */
+typedef struct {
+    char *path;
+    int fd;
+    uint64_t size;
+    Log_ring *rings;
+    int num_rings;
+    bool stopping;
+    pthread_t writer;
+} Event_log;
+
+/** Prototypes */
+int event_log_open(Event_log *log, char const *path, int num_rings);
+void event_log_close(Event_log *log);
+
+/**
+ * Write a record into the ring of the calling shard, dropped if it is full
+ * @param ring the ring, only ever written by one thread
+ * @param type the type of record
+ * @param fd the client socket, -1 if none
+ * @param code a small value
+ * @param a a value
+ * @param b a value
+ * @param c a value
+ */
+static inline void log_event(Log_ring *ring, LOG_EVENT type, int fd,
+                             unsigned code, uint32_t a, uint32_t b,
+                             uint64_t c){
+    uint64_t head = ring->head;
+    // the tail is read again only when the ring looks full
+    if (head - ring->tail_seen >= LOG_RING_SIZE){
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_seen >= LOG_RING_SIZE){
+            __atomic_store_n(&ring->dropped, ring->dropped + 1,
+                             __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    Log_record *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    record->type = type;
+    record->shard = ring->shard;
+    record->code = code;
+    record->fd = fd;
+    record->a = a;
+    record->b = b;
+    record->c = c;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
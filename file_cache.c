@@ -0,0 +1,206 @@
+/*
+** File cache of image-tagger
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+/** The content type of each file extension served */
+static char const * const EXTENSIONS[][2] = {
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"svg", "image/svg+xml"}
+};
+
+static char const * const DEFAULT_TYPE = "application/octet-stream";
+
+/**
+ * Open the directory served, without it every lookup fails
+ * @param cache the cache
+ * @param dir the directory
+ */
+void file_cache_init(File_cache *cache, char const *dir){
+    memset(cache, 0, sizeof(File_cache));
+    cache->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Check that a name stays inside the directory, only letters, digits and
+ * ".-_" are accepted and it may not start with a dot
+ * @param name the name
+ * @param length the length of the name
+ * @return Boolean true if it can be served
+ */
+bool file_name_valid(char const *name, size_t length){
+    if (length == 0 || length >= FILE_NAME_MAX || name[0] == '.'){
+        return false;
+    }
+    for (size_t i = 0; i < length; i++){
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_')){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The content type of a file name
+ * @param name the name
+ * @return char const* the type
+ */
+static char const* content_type(char const *name){
+    char const *dot = strrchr(name, '.');
+    if (dot == NULL){ return DEFAULT_TYPE; }
+    for (size_t i = 0; i < sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]); i++){
+        if (strcasecmp(dot + 1, EXTENSIONS[i][0]) == 0){
+            return EXTENSIONS[i][1];
+        }
+    }
+    return DEFAULT_TYPE;
+}
+
+/**
+ * Check whether the directory still holds the same file under its name
+ * @param file the file
+ * @param st the status of the name
+ * @return Boolean true if nothing changed
+ */
+static bool same_file(File const *file, struct stat const *st){
+    return file->device == st->st_dev && file->inode == st->st_ino &&
+           file->size == st->st_size && file->modified == st->st_mtime;
+}
+
+/**
+ * Drop a file, closed now unless a response still sends it
+ * @param file the file
+ */
+void file_release(File *file){
+    if (--file->refs > 0){ return; }
+    close(file->fd);
+    free(file);
+}
+
+/**
+ * Take a file out of the cache
+ * @param cache the cache
+ * @param index the index of the file in the cache
+ */
+static void evict(File_cache *cache, int index){
+    File *file = cache->files[index];
+    cache->files[index] = cache->files[--cache->count];
+    file_release(file);
+}
+
+/**
+ * Open a file and compute its validators
+ * @param cache the cache
+ * @param name the name, NUL terminated
+ * @param now the current second
+ * @return File* the file with one reference, NULL on failure
+ */
+static File* load(File_cache *cache, char const *name, uint32_t now){
+    int fd = openat(cache->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){ return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+    File *file = calloc(1, sizeof(File));
+    if (file == NULL){
+        close(fd);
+        return NULL;
+    }
+    strcpy(file->name, name);
+    file->fd = fd;
+    file->size = st.st_size;
+    file->device = st.st_dev;
+    file->inode = st.st_ino;
+    file->modified = st.st_mtime;
+    file->type = content_type(name);
+    snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx\"",
+             (unsigned long long)st.st_mtime, (unsigned long long)st.st_size);
+    struct tm tm;
+    strftime(file->last_modified, sizeof(file->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&st.st_mtime, &tm));
+    file->refs = 1;
+    file->checked_at = now;
+    return file;
+}
+
+/**
+ * Find a file of the directory, from the cache if it is open and has not
+ * changed, and hold it until file_release
+ * @param cache the cache
+ * @param name the name, not NUL terminated
+ * @param length the length of the name
+ * @param now the current second
+ * @return File* the file, NULL if it can not be served (errno is set)
+ */
+File* file_open(File_cache *cache, char const *name, size_t length,
+                uint32_t now){
+    if (cache->dirfd < 0 || !file_name_valid(name, length)){
+        errno = ENOENT;
+        return NULL;
+    }
+    char path[FILE_NAME_MAX];
+    memcpy(path, name, length);
+    path[length] = '\0';
+    cache->lookups++;
+    for (int i = 0; i < cache->count; i++){
+        File *file = cache->files[i];
+        if (strcmp(file->name, path)){ continue; }
+        if (now - file->checked_at >= FILE_CHECK_INTERVAL){
+            struct stat st;
+            if (fstatat(cache->dirfd, path, &st, 0) < 0 ||
+                !same_file(file, &st)){
+                // gone or replaced, a new copy is opened below
+                evict(cache, i);
+                break;
+            }
+            file->checked_at = now;
+        }
+        file->used_at = cache->lookups;
+        file->refs++;
+        return file;
+    }
+
+    File *file = load(cache, path, now);
+    if (file == NULL){ return NULL; }
+    file->used_at = cache->lookups;
+    int slot = cache->count;
+    if (slot == FILE_CACHE_SIZE){
+        // the least recently used file nobody sends makes room
+        slot = -1;
+        for (int i = 0; i < cache->count; i++){
+            if (cache->files[i]->refs == 1 &&
+                (slot < 0 ||
+                 cache->files[i]->used_at < cache->files[slot]->used_at)){
+                slot = i;
+            }
+        }
+        // every cached file is being sent, this one is not kept
+        if (slot < 0){ return file; }
+        evict(cache, slot);
+        slot = cache->count;
+    }
+    cache->files[slot] = file;
+    cache->count++;
+    file->refs++;
+    return file;
+}
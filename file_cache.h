@@ -0,0 +1,79 @@
+/*
+** File cache of image-tagger
+ * The images are served from a local directory. Every shard keeps the
+ * files it served last open, with what their responses need computed once:
+ * the size, the content type and the ETag and Last-Modified validators. A
+ * cached file is checked against the directory again after a few seconds,
+ * so a replaced image is picked up. The least recently used file that is
+ * not being sent makes room for a new one. A file being sent when it is
+ * evicted stays open until its last sender releases it.
+*/
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/** Define the # files a shard keeps open */
+#define FILE_CACHE_SIZE 32
+
+/** Define the seconds a cached file is trusted before it is checked again */
+#define FILE_CHECK_INTERVAL 2
+
+/** Define the longest file name served */
+#define FILE_NAME_MAX 64
+
+/** An open file and its validators
+ *  @param char name[FILE_NAME_MAX] The name in the directory
+ *  @param int fd The open file
+ *  @param off_t size The size of the file
+ *  @param dev_t device The device of the file, tells a replaced one
+ *  @param ino_t inode The inode of the file, tells a replaced one
+ *  @param time_t modified The last modification
+ *  @param char const *type The content type
+ *  @param char etag[40] The ETag header value, quoted
+ *  @param char last_modified[32] The Last-Modified header value
+ *  @param int refs The holders, the cache and every response sending it
+ *  @param uint32_t checked_at The second it was last checked
+ *  @param uint64_t used_at The lookup that last returned it
+ */
+typedef struct {
+    char name[FILE_NAME_MAX];
+    int fd;
+    off_t size;
+    dev_t device;
+    ino_t inode;
+    time_t modified;
+    char const *type;
+    char etag[40];
+    char last_modified[32];
+    int refs;
+    uint32_t checked_at;
+    uint64_t used_at;
+} File;
+
+/** The open files of one shard, only used by its thread
+ *  @param int dirfd The directory served, -1 if it could not be opened
+ *  @param File *files[FILE_CACHE_SIZE] The cached files
+ *  @param int count The number of cached files
+ *  @param uint64_t lookups The number of lookups, the clock of used_at
+ */
+typedef struct {
+    int dirfd;
+    File *files[FILE_CACHE_SIZE];
+    int count;
+    uint64_t lookups;
+} File_cache;
+
+/** Prototypes */
+void file_cache_init(File_cache *cache, char const *dir);
+bool file_name_valid(char const *name, size_t length);
+File* file_open(File_cache *cache, char const *name, size_t length,
+                uint32_t now);
+void file_release(File *file);
+
+#endif
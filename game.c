@@ -0,0 +1,1535 @@
+/*
+** Game core of image-tagger
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "game.h"
+
+// constants
+static char const * const HTTP_200_FORMAT = "HTTP/1.1 200 OK\r\n\
+Set-Cookie: id= %d \r\n\
+Content-Type: text/html\r\n\
+Vary: Accept-Encoding\r\n\
+Content-Length: %ld\r\n\r\n";
+static char const * const HTTP_200_GZIP = "HTTP/1.1 200 OK\r\n\
+Set-Cookie: id= %d \r\n\
+Content-Type: text/html\r\n\
+Content-Encoding: gzip\r\n\
+Vary: Accept-Encoding\r\n\
+Content-Length: %ld\r\n\r\n";
+static char const * const HTTP_200_JSON = "HTTP/1.1 200 OK\r\n\
+Content-Type: application/json\r\n\
+Content-Length: %ld\r\n\r\n";
+static char const * const HTTP_200_TEXT = "HTTP/1.1 200 OK\r\n\
+Content-Type: text/plain; version=0.0.4\r\n\
+Content-Length: %ld\r\n\r\n";
+static char const * const HTTP_200_IMAGE = "HTTP/1.1 200 OK\r\n\
+Content-Type: %s\r\n\
+Content-Length: %lld\r\n\
+Accept-Ranges: bytes\r\n\
+ETag: %s\r\n\
+Last-Modified: %s\r\n\
+Cache-Control: public, max-age=31536000\r\n\r\n";
+static char const * const HTTP_206_IMAGE = "HTTP/1.1 206 Partial Content\r\n\
+Content-Type: %s\r\n\
+Content-Length: %lld\r\n\
+Content-Range: bytes %lld-%lld/%lld\r\n\
+ETag: %s\r\n\
+Last-Modified: %s\r\n\
+Cache-Control: public, max-age=31536000\r\n\r\n";
+static char const * const HTTP_304_IMAGE = "HTTP/1.1 304 Not Modified\r\n\
+ETag: %s\r\n\
+Last-Modified: %s\r\n\
+Cache-Control: public, max-age=31536000\r\n\r\n";
+static char const * const HTTP_416_IMAGE = "HTTP/1.1 416 Range Not Satisfiable\r\n\
+Content-Range: bytes */%lld\r\n\
+Content-Length: 0\r\n\r\n";
+static char const * const HTTP_200_EXPORT = "HTTP/1.1 200 OK\r\n\
+Content-Type: %s\r\n\
+%s\r\n\r\n";
+static char const * const HTTP_400 = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+static int const HTTP_400_LENGTH = 47;
+static char const * const HTTP_404 = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+static int const HTTP_404_LENGTH = 45;
+static char const * const HTTP_413 = "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\n\r\n";
+static int const HTTP_413_LENGTH = 53;
+static char const * const HTTP_503 = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+static int const HTTP_503_LENGTH = 55;
+static char const * const INSERT_TEXT = "\r\n<p>%s</p>\r\n";
+static char const * const INSERT_BEFORE = "\r\n<p>";
+static char const * const INSERT_AFTER = "</p>\r\n";
+
+/** Define the # tags returned by /tags by default and at most */
+#define TOP_DEFAULT 10
+#define TOP_MAX 100
+
+/** Define the # counts an export copies out of the index at a time */
+#define EXPORT_BATCH 128
+
+/** Define the longest record of an export */
+#define EXPORT_RECORD (64 + 6 * TAG_LENGTH)
+
+/** Define the first bytes of a binary export */
+#define EXPORT_MAGIC "ITX1"
+
+/** Define the seconds a player may stay idle before its session expires */
+#define SESSION_IDLE 1800
+
+/** Define the seconds a paired player may stay idle before its game ends */
+#define GAME_IDLE 120
+
+/** Define the seconds a waiting player may stay idle before it leaves the
+ *  queue, longer than the wait of GET /events so a player polling stays */
+#define WAIT_IDLE 60
+
+/** Represents the formats of GET /export */
+typedef enum
+{
+    EXPORT_NDJSON,
+    EXPORT_BINARY
+} EXPORT_FORMAT;
+
+/** The progress of an export, it holds one batch of counts at most
+ *  @param EXPORT_FORMAT format The format of the records
+ *  @param bool started The magic of a binary export is written
+ *  @param uint32_t cursor The next slot of the index scanned
+ *  @param int next The next count of batch written
+ *  @param int count The number of counts in batch
+ *  @param Tag_count batch[EXPORT_BATCH] The counts scanned last
+ */
+typedef struct {
+    EXPORT_FORMAT format;
+    bool started;
+    uint32_t cursor;
+    int next;
+    int count;
+    Tag_count batch[EXPORT_BATCH];
+} Export;
+
+static char const * const POLL_NAMES[NUM_POLL_STATES] = {
+    "waiting", "paired", "ended"
+};
+
+/** All shards, shared by every shard */
+Shard *shards;
+int num_shards = 1;
+
+/** The images played and the scheduler of new games, shared by every shard */
+Image_catalog catalog;
+
+/** The agreed keywords of every image, shared by every shard */
+Tag_store tags;
+
+/** The trace of connections, requests and games, shared by every shard */
+Event_log events;
+
+/** The links to the other nodes, shared by every shard */
+Peer_set peers;
+
+/** Prototypes */
+static int method_GET(Shard *shard, Response *response, int cookie_id,
+                      PAGE page);
+static bool method_POST(Shard *shard, Response *response,
+                        Http_request const *request, int cookie_id,
+                        PAGE page);
+static void store_keyword(Shard *shard, int cookie_id, char *keyword);
+static bool keyword_match(Shard *shard, int cookie_id, char *keyword);
+static void set_stage(Shard *shard, int cookie_id, PAGE page);
+static int respond_text(Response *response, char const *text, int length);
+static int respond_tags(Shard *shard, Response *response, Slice query);
+static int respond_metrics(Shard *shard, Response *response);
+static int respond_image(Shard *shard, Response *response, Slice name);
+static int respond_export(Response *response, Slice query);
+static bool same_text(Slice value, char const *text);
+static int wait_event(Shard *shard, Response *response, int cookie_id,
+                      Slice query);
+static int players_waiting(int image);
+
+/**
+ * Check whether a target names a route that takes a query
+ * @param text the target, sanitised
+ * @param length the length of the target
+ * @param name the name of the route
+ * @param query set to the query string if it does, empty if there is none
+ * @return Boolean true if it names the route
+ */
+static bool route_query(char const *text, size_t length, char const *name,
+                        Slice *query){
+    size_t n = strlen(name);
+    if (length < n || strncmp(text, name, n) ||
+        (length > n && text[n] != '?')){
+        return false;
+    }
+    query->text = text + n + (length > n);
+    query->length = length - n - (length > n);
+    return true;
+}
+
+/**
+ * The route of a request, from its method and target only so it is known
+ * before the request is served
+ * @param request the parsed request
+ * @param rest set to the query of /tags, /events and /export and to the
+ *             file name of /images/, empty otherwise
+ * @return ROUTE the route
+ */
+ROUTE game_route(Http_request const *request, Slice *rest){
+    char const *curr = request->target.text;
+    char const *end = curr + request->target.length;
+    METHOD method = request->method;
+    rest->text = "";
+    rest->length = 0;
+    // only GET and POST are supported
+    if (method == UNKNOWN){ return ROUTE_BAD; }
+    // sanitise the URI
+    while (curr < end && (*curr == '.' || *curr == '/' || *curr == '?'))
+        ++curr;
+    size_t length = end - curr;
+    if (length == 0){ return ROUTE_ROOT; }
+    if (method == GET && route_query(curr, length, "tags", rest)){
+        return ROUTE_TAGS;
+    }
+    if (method == GET && length == 7 && strncmp(curr, "metrics", 7) == 0){
+        return ROUTE_METRICS;
+    }
+    if (method == GET && route_query(curr, length, "events", rest)){
+        return ROUTE_EVENTS;
+    }
+    if (method == GET && route_query(curr, length, "export", rest)){
+        return ROUTE_EXPORT;
+    }
+    if (method == GET && length > 7 && strncmp(curr, "images/", 7) == 0){
+        rest->text = curr + 7;
+        rest->length = length - 7;
+        return ROUTE_IMAGE;
+    }
+    if (length >= 5 && strncmp(curr, "start", 5) == 0){
+        return ROUTE_START;
+    }
+    return ROUTE_NOT_FOUND;
+}
+
+/**
+ * The http request handle function
+ * @param shard the shard that owns the player of the request
+ * @param request the parsed request
+ * @param response the response built, its arena set by the caller
+ * @return Boolean true for the http request is properly handled
+ *                 false otherwise
+ */
+bool game_request(Shard *shard, Http_request const *request,
+                  Response *response)
+{
+    PAGE page;
+    response->request = request;
+    response->iov = NULL;
+    response->iovcnt = 0;
+    response->park = -1;
+    response->file = NULL;
+    memset(&response->stream, 0, sizeof(Stream));
+
+    int cookie_id = read_slot(shard, request);
+    Session *session = NULL;
+    if (cookie_id >= 0){
+        session = session_get(&shard->sessions, cookie_id);
+        session->last_active = session_now();
+        // a player back after its wait expired queues again
+        update_queue(shard, cookie_id);
+    }
+
+    METHOD method = request->method;
+    Slice rest;
+    response->route = game_route(request, &rest);
+    if (response->route == ROUTE_BAD)
+    {
+        return respond_text(response, HTTP_400, HTTP_400_LENGTH) == 0;
+    }
+    // assume the only valid request URI is "/" but it can be modified to accept more files
+    if (response->route == ROUTE_ROOT){
+        if(method == GET && cookie_id < 0){
+            page = PAGE_INTRO;
+        }else{
+            page = PAGE_START;
+        }
+    }
+    else if(response->route == ROUTE_TAGS){
+        // the most agreed keywords of an image
+        return respond_tags(shard, response, rest) == 0;
+    }
+    else if(response->route == ROUTE_METRICS){
+        return respond_metrics(shard, response) == 0;
+    }
+    else if(response->route == ROUTE_EVENTS){
+        // wait until the player is paired or its partner won or left
+        return wait_event(shard, response, cookie_id, rest) == 0;
+    }
+    else if(response->route == ROUTE_EXPORT){
+        // every agreed keyword, streamed as it is read from the index
+        return respond_export(response, rest) == 0;
+    }
+    else if(response->route == ROUTE_IMAGE){
+        // an image of the catalog, from the local directory
+        char const *query = memchr(rest.text, '?', rest.length);
+        if (query != NULL){
+            rest.length = query - rest.text;
+        }
+        return respond_image(shard, response, rest) == 0;
+    }
+    else if(response->route == ROUTE_START){
+        // an unknown player has to register first
+        if (cookie_id < 0){
+            return method_GET(shard, response, -1, PAGE_INTRO) == 0;
+        }
+        // game state
+        if (method == GET || session->stage == PAGE_ENDGAME){
+            page = PAGE_FIRST_TURN;
+            //start a game, try to pair other player, set image index to player
+            session->image_index = catalog_schedule(&catalog,
+                                                    players_waiting);
+            initialise_status(shard, cookie_id);
+            set_stage(shard, cookie_id, page);
+            pairing(shard, cookie_id);
+        }else{
+            page = session->stage;
+            //Try to pair other player
+            if (pairing(shard, cookie_id)){
+                //Successfully pair, input will be accepted
+                page = PAGE_ACCEPTED;
+            }
+            //If other player win/leave, direct player to end game
+            else if(session->stage == PAGE_ACCEPTED &&
+                    session->other_index < 0){
+                initialise_status(shard, cookie_id);
+                return method_GET(shard, response, cookie_id,
+                                  PAGE_ENDGAME) == 0;
+            }
+            // pairing failed, input discarded
+            else if(session->other_index < 0){
+                page = PAGE_DISCARDED;
+            }
+        }
+    }
+        // send 404
+    else
+    {
+        return respond_text(response, HTTP_404, HTTP_404_LENGTH) == 0;
+    }
+    if (method == GET) {
+        return method_GET(shard, response, cookie_id, page) == 0;
+    }
+    return method_POST(shard, response, request, cookie_id, page);
+}
+
+/**
+ * The cookie of a registered player
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player
+ * @return int the cookie, -1 if the player is unknown
+ */
+static int make_cookie(Shard *shard, int cookie_id){
+    if (cookie_id < 0){ return -1; }
+    Session *session = session_get(&shard->sessions, cookie_id);
+    return (session->generation & 0x7f) << COOKIE_BITS |
+           (cookie_id * num_shards + shard->id);
+}
+
+/**
+ * The shard that registered the player of a cookie
+ * @param cookie the cookie
+ * @return int the shard id
+ */
+int cookie_shard(int cookie){
+    return (cookie & COOKIE_MASK) % num_shards;
+}
+
+/**
+ * The id of a shard known to every node, the messages and partners name it
+ * @param shard the shard
+ * @return int node * NODE_SHARDS + the shard id
+ */
+int shard_address(Shard const *shard){
+    return peers.node * NODE_SHARDS + shard->id;
+}
+
+/**
+ * The id of a player known to every node, the tag log and the event log
+ * name players by it
+ * @param address the address of the shard that owns the player
+ * @param slot the slot of the player in the sessions of that shard
+ * @return uint32_t the node above COOKIE_BITS, below them the cookie the
+ *                  player has on its node without the generation
+ */
+static uint32_t player_id(int address, int slot){
+    int node = address / NODE_SHARDS;
+    int shards = node == peers.node ? num_shards :
+                 peers_shards(&peers, node);
+    return (uint32_t)node << COOKIE_BITS |
+           ((slot * shards + address % NODE_SHARDS) & COOKIE_MASK);
+}
+
+/**
+ * Answer with pieces allocated in the arena of the response
+ * @param response the response built
+ * @param iovcnt the number of pieces
+ * @return struct iovec* the pieces, NULL if out of memory
+ */
+static struct iovec* respond_pieces(Response *response, int iovcnt){
+    response->iov = arena_alloc(response->arena,
+                                iovcnt * sizeof(struct iovec));
+    response->iovcnt = response->iov != NULL ? iovcnt : 0;
+    return response->iov;
+}
+
+/**
+ * Render a compiled page with its header
+ * @param shard the shard that owns the player
+ * @param response the response built
+ * @param page the page is going to send
+ * @param cookie_id ID of the player, -1 if unknown
+ * @param added_text the text inserted into the page, may be empty
+ * @param image The URL of the image shown by the page
+ * @return int 0 for the page is successfully rendered, 1 otherwise
+ */
+static int respond_page(Shard *shard, Response *response, PAGE page,
+                        int cookie_id, Slice added_text, Slice image){
+    templates_refresh(&shard->templates);
+    Template const *html = &shard->templates.pages[page];
+    Slice values[NUM_SLOTS];
+    values[SLOT_TEXT] = added_text;
+    values[SLOT_IMAGE] = image;
+    long size = template_size(html, values);
+
+    // the header and every segment of the page go out in one writev
+    struct iovec *iov = respond_pieces(response, 3 + html->num_segments);
+    if (iov == NULL){ return 1; }
+    int iovcnt = 0;
+    if (response->request->gzip){
+        char *scratch = arena_alloc(response->arena,
+                                    template_gzip_size(html, values));
+        if (scratch == NULL){ return 1; }
+        iovcnt = template_gzip(&shard->templates, html, values, scratch,
+                               iov + 1);
+        long gzip_size = 0;
+        for (int i = 1; i <= iovcnt; i++){
+            gzip_size += iov[i].iov_len;
+        }
+        // a page too short to shrink goes out as it is
+        if (gzip_size < size){
+            size = gzip_size;
+        }else{
+            iovcnt = 0;
+        }
+    }
+    Slice header = arena_printf(response->arena,
+                                iovcnt > 0 ? HTTP_200_GZIP : HTTP_200_FORMAT,
+                                make_cookie(shard, cookie_id), size);
+    if (header.text == NULL){ return 1; }
+    iov[0].iov_base = (void *)header.text;
+    iov[0].iov_len = header.length;
+    if (iovcnt == 0){
+        iovcnt = template_iovec(html, values, iov + 1);
+    }
+    response->iovcnt = 1 + iovcnt;
+    return 0;
+}
+
+/**
+ * Answer with a canned response
+ * @param response the response built
+ * @param text the response
+ * @param length the length of the response
+ * @return int 0 for the response is successfully built, 1 otherwise
+ */
+static int respond_text(Response *response, char const *text, int length){
+    struct iovec *iov = respond_pieces(response, 1);
+    if (iov == NULL){ return 1; }
+    iov[0].iov_base = (void *)text;
+    iov[0].iov_len = length;
+    return 0;
+}
+
+/**
+ * Append a JSON string, escaped
+ * @param out the buffer
+ * @param text the string
+ * @param length the length of the string
+ * @return int the number of bytes written, at most 2 + 6 * length
+ */
+static int json_string(char *out, char const *text, size_t length){
+    int n = 0;
+    out[n++] = '"';
+    for (size_t i = 0; i < length; i++){
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\'){
+            out[n++] = '\\';
+            out[n++] = c;
+        }else if (c < 0x20){
+            n += sprintf(out + n, "\\u%04x", c);
+        }else{
+            out[n++] = c;
+        }
+    }
+    out[n++] = '"';
+    return n;
+}
+
+/**
+ * Read a decimal form value
+ * @param field the value
+ * @param max the largest number accepted
+ * @return int the number, -1 if it is not one or above max
+ */
+static int read_number(Slice field, int max){
+    int number = 0;
+    if (field.length == 0){ return -1; }
+    for (size_t i = 0; i < field.length; i++){
+        if (field.text[i] < '0' || field.text[i] > '9'){ return -1; }
+        number = number * 10 + field.text[i] - '0';
+        if (number > max){ return -1; }
+    }
+    return number;
+}
+
+/**
+ * Answer with the most agreed keywords of an image as JSON, for
+ * GET /tags?image=2&k=10
+ * @param shard the shard serving the request
+ * @param response the response built
+ * @param query the query string
+ * @return int 0 for the response is successfully built, 1 otherwise
+ */
+static int respond_tags(Shard *shard, Response *response, Slice query){
+    Slice field;
+    int image = -1;
+    if (http_form_value(query, "image", &field)){
+        image = read_number(field, catalog.count - 1);
+    }
+    int k = TOP_DEFAULT;
+    if (http_form_value(query, "k", &field)){
+        k = read_number(field, TOP_MAX);
+    }
+    if (image < 0 || k < 1){
+        return respond_text(response, HTTP_400, HTTP_400_LENGTH);
+    }
+    Tag_count top[TOP_MAX];
+    int count = tag_store_top(&tags, image, top, k);
+
+    char *body = arena_alloc(response->arena,
+                             64 + count * (32 + 6 * TAG_LENGTH));
+    if (body == NULL){ return 1; }
+    int n = sprintf(body, "{\"image\":%d,\"tags\":[", image);
+    for (int i = 0; i < count; i++){
+        n += sprintf(body + n, "%s{\"keyword\":", i ? "," : "");
+        n += json_string(body + n, top[i].keyword,
+                         strnlen(top[i].keyword, TAG_LENGTH));
+        n += sprintf(body + n, ",\"count\":%u}", top[i].count);
+    }
+    n += sprintf(body + n, "]}\n");
+
+    Slice header = arena_printf(response->arena, HTTP_200_JSON, (long)n);
+    struct iovec *iov = respond_pieces(response, 2);
+    if (header.text == NULL || iov == NULL){ return 1; }
+    iov[0].iov_base = (void *)header.text;
+    iov[0].iov_len = header.length;
+    iov[1].iov_base = body;
+    iov[1].iov_len = n;
+    return 0;
+}
+
+/**
+ * Answer with the metrics of every shard, for GET /metrics
+ * @param shard the shard serving the request
+ * @param response the response built
+ * @return int 0 for the response is successfully built, 1 otherwise
+ */
+static int respond_metrics(Shard *shard, Response *response){
+    Metrics *all[num_shards];
+    for (int i = 0; i < num_shards; i++){
+        all[i] = &shards[i].metrics;
+    }
+    Global_metrics global;
+    global.tag_commits = metric_get(&tags.commits);
+    global.tag_records = metric_get(&tags.records);
+    global.tag_failures = metric_get(&tags.failures);
+    global.tag_lost = metric_get(&tags.lost);
+    global.images = catalog.count;
+    Slice body = metrics_render(response->arena, all, num_shards, &global);
+    Slice header = arena_printf(response->arena, HTTP_200_TEXT,
+                                (long)body.length);
+    struct iovec *iov = respond_pieces(response, 2);
+    if (body.text == NULL || header.text == NULL || iov == NULL){ return 1; }
+    iov[0].iov_base = (void *)header.text;
+    iov[0].iov_len = header.length;
+    iov[1].iov_base = (void *)body.text;
+    iov[1].iov_len = body.length;
+    return 0;
+}
+
+/**
+ * Write one count of an export
+ * @param format the format of the export
+ * @param out the buffer, EXPORT_RECORD long at least
+ * @param tag the count
+ * @return int the number of bytes written
+ */
+static int export_record(EXPORT_FORMAT format, char *out,
+                         Tag_count const *tag){
+    size_t length = strnlen(tag->keyword, TAG_LENGTH);
+    if (format == EXPORT_NDJSON){
+        int n = sprintf(out, "{\"image\":%u,\"keyword\":", tag->image);
+        n += json_string(out + n, tag->keyword, length);
+        n += sprintf(out + n, ",\"count\":%u}\n", tag->count);
+        return n;
+    }
+    // image and count as 32 bit little endian, the keyword after its length
+    uint32_t fields[2] = {tag->image, tag->count};
+    int n = 0;
+    for (int f = 0; f < 2; f++){
+        for (int b = 0; b < 4; b++){
+            out[n++] = fields[f] >> (8 * b) & 0xff;
+        }
+    }
+    out[n++] = length;
+    memcpy(out + n, tag->keyword, length);
+    return n + length;
+}
+
+/**
+ * Produce the next piece of an export, the index is scanned a batch at a
+ * time as the client reads
+ * @param state the export
+ * @param out the buffer
+ * @param size the room in out
+ * @return long the bytes written, 0 once every slot was scanned
+ */
+static long export_fill(void *state, char *out, size_t size){
+    Export *export = state;
+    size_t n = 0;
+    if (export->format == EXPORT_BINARY && !export->started){
+        memcpy(out, EXPORT_MAGIC, 4);
+        n = 4;
+        export->started = true;
+    }
+    while (size - n >= EXPORT_RECORD){
+        if (export->next == export->count){
+            if (export->cursor >= TAG_SLOTS){ break; }
+            export->count = tag_store_scan(&tags, &export->cursor,
+                                           export->batch, EXPORT_BATCH);
+            export->next = 0;
+            continue;
+        }
+        n += export_record(export->format, out + n,
+                           &export->batch[export->next++]);
+    }
+    return n;
+}
+
+/**
+ * Answer with every agreed keyword of every image, for
+ * GET /export?format=ndjson|binary, the body is streamed in chunks to an
+ * HTTP/1.1 client and until the connection closes to an HTTP/1.0 one
+ * @param response the response built
+ * @param query the query string
+ * @return int 0 for the response is successfully built, 1 otherwise
+ */
+static int respond_export(Response *response, Slice query){
+    Slice field;
+    EXPORT_FORMAT format = EXPORT_NDJSON;
+    if (http_form_value(query, "format", &field)){
+        if (same_text(field, "binary")){
+            format = EXPORT_BINARY;
+        }else if (!same_text(field, "ndjson")){
+            return respond_text(response, HTTP_400, HTTP_400_LENGTH);
+        }
+    }
+    bool chunked = response->request->version >= 1;
+    Slice header = arena_printf(response->arena, HTTP_200_EXPORT,
+            format == EXPORT_NDJSON ? "application/x-ndjson" :
+                                      "application/octet-stream",
+            chunked ? "Transfer-Encoding: chunked" : "Connection: close");
+    struct iovec *iov = respond_pieces(response, 1);
+    if (header.text == NULL || iov == NULL){ return 1; }
+    Export *export = calloc(1, sizeof(Export));
+    if (export == NULL){ return 1; }
+    export->format = format;
+    iov[0].iov_base = (void *)header.text;
+    iov[0].iov_len = header.length;
+    response->stream.fill = export_fill;
+    response->stream.release = free;
+    response->stream.state = export;
+    response->stream.chunked = chunked;
+    return 0;
+}
+
+/**
+ * Check whether a header value is exactly a string
+ * @param value the header value
+ * @param text the string
+ * @return Boolean true if they are equal
+ */
+static bool same_text(Slice value, char const *text){
+    return value.length == strlen(text) &&
+           !memcmp(value.text, text, value.length);
+}
+
+/**
+ * Read a byte offset of a Range header
+ * @param from the first digit
+ * @param to the end of the digits
+ * @return long long the offset, -1 if there are no digits, -2 if invalid
+ */
+static long long read_offset(char const *from, char const *to){
+    if (from == to){ return -1; }
+    long long offset = 0;
+    for (char const *p = from; p < to; p++){
+        if (*p < '0' || *p > '9' || offset > (1LL << 50)){ return -2; }
+        offset = offset * 10 + *p - '0';
+    }
+    return offset;
+}
+
+/**
+ * Read the Range header of a request for a file, a single range is sent
+ * as asked, the whole file is sent for several ranges, a malformed one, or
+ * an If-Range naming another version of the file
+ * @param request the request
+ * @param file the file
+ * @param first set to the first byte sent
+ * @param last set to the last byte sent
+ * @return int 1 for a range, 0 for the whole file, -1 if unsatisfiable
+ */
+static int read_range(Http_request const *request, File const *file,
+                      long long *first, long long *last){
+    Slice value = http_header(request, "Range");
+    if (value.text == NULL || value.length < 6 ||
+        strncmp(value.text, "bytes=", 6)){
+        return 0;
+    }
+    Slice condition = http_header(request, "If-Range");
+    if (condition.text != NULL && !same_text(condition, file->etag) &&
+        !same_text(condition, file->last_modified)){
+        return 0;
+    }
+    char const *start = value.text + 6;
+    char const *end = value.text + value.length;
+    char const *dash = memchr(start, '-', end - start);
+    if (dash == NULL || memchr(start, ',', end - start) != NULL){
+        return 0;
+    }
+    long long from = read_offset(start, dash);
+    long long to = read_offset(dash + 1, end);
+    long long size = file->size;
+    if (from == -2 || to == -2 || (from == -1 && to == -1)){ return 0; }
+    if (from == -1){
+        // the last bytes of the file
+        if (to == 0 || size == 0){ return -1; }
+        from = to < size ? size - to : 0;
+        to = size - 1;
+    }else{
+        if (to != -1 && to < from){ return 0; }
+        if (from >= size){ return -1; }
+        if (to == -1 || to >= size){ to = size - 1; }
+    }
+    *first = from;
+    *last = to;
+    return 1;
+}
+
+/**
+ * Answer with an image of the local directory, sent from the file after
+ * the header, or with 304 when the client's copy is still current
+ * @param shard the shard serving the request
+ * @param response the response built
+ * @param name the name of the file
+ * @return int 0 for the response is successfully built, 1 otherwise
+ */
+static int respond_image(Shard *shard, Response *response, Slice name){
+    Http_request const *request = response->request;
+    File *file = file_open(&shard->files, name.text, name.length,
+                           session_now());
+    if (file == NULL){
+        return errno == EMFILE || errno == ENFILE || errno == ENOMEM ?
+               respond_text(response, HTTP_503, HTTP_503_LENGTH) :
+               respond_text(response, HTTP_404, HTTP_404_LENGTH);
+    }
+    // If-None-Match wins over If-Modified-Since, which has to match exactly
+    Slice match = http_header(request, "If-None-Match");
+    Slice since = http_header(request, "If-Modified-Since");
+    bool current = match.text != NULL ?
+                   same_text(match, "*") ||
+                   memmem(match.text, match.length, file->etag,
+                          strlen(file->etag)) != NULL :
+                   since.text != NULL && same_text(since, file->last_modified);
+    long long size = file->size;
+    long long first = 0;
+    long long last = size - 1;
+    int range = current ? 0 : read_range(request, file, &first, &last);
+    Slice header;
+    if (current){
+        header = arena_printf(response->arena, HTTP_304_IMAGE, file->etag,
+                              file->last_modified);
+    }else if (range < 0){
+        header = arena_printf(response->arena, HTTP_416_IMAGE, size);
+    }else if (range > 0){
+        header = arena_printf(response->arena, HTTP_206_IMAGE, file->type,
+                              last - first + 1, first, last, size,
+                              file->etag, file->last_modified);
+    }else{
+        header = arena_printf(response->arena, HTTP_200_IMAGE, file->type,
+                              size, file->etag, file->last_modified);
+    }
+    struct iovec *iov = respond_pieces(response, 1);
+    if (header.text == NULL || iov == NULL){
+        file_release(file);
+        return 1;
+    }
+    iov[0].iov_base = (void *)header.text;
+    iov[0].iov_len = header.length;
+    if (current || range < 0 || last < first){
+        file_release(file);
+        return 0;
+    }
+    response->file = file;
+    response->file_offset = first;
+    response->file_length = last - first + 1;
+    return 0;
+}
+
+/**
+ * The state of a player as GET /events reports it
+ * @param session the hot fields of the player
+ * @return POLL_STATE paired, ended once the partner won or left, or waiting
+ */
+static POLL_STATE poll_state(Session const *session){
+    if (session->other_index >= 0){
+        return POLL_PAIRED;
+    }
+    return session->stage == PAGE_ACCEPTED ? POLL_ENDED : POLL_WAITING;
+}
+
+/**
+ * Render the state of a player as a JSON response, the server answers a
+ * parked connection with it from the request of another one
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player
+ * @param out the buffer, EVENT_SIZE is enough
+ * @param size the size of out
+ * @return int the length of the response
+ */
+int game_state(Shard *shard, int cookie_id, char *out, size_t size){
+    char body[EVENT_SIZE];
+    int length = snprintf(body, sizeof(body), "{\"state\":\"%s\"}\n",
+            POLL_NAMES[poll_state(session_get(&shard->sessions, cookie_id))]);
+    int n = snprintf(out, size, HTTP_200_JSON, (long)length);
+    n += snprintf(out + n, size - n, "%s", body);
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/**
+ * Answer GET /events?state=waiting at once if the player is no longer in
+ * the state given, otherwise have the connection parked until it leaves it,
+ * a waiting player is tried for a partner first
+ * @param shard the shard that owns the player
+ * @param response the response built
+ * @param cookie_id ID of the player, -1 if unknown
+ * @param query the query string
+ * @return int 0 for the response is built or to be parked, 1 otherwise
+ */
+static int wait_event(Shard *shard, Response *response, int cookie_id,
+                      Slice query){
+    Slice field;
+    POLL_STATE known = POLL_WAITING;
+    if (http_form_value(query, "state", &field)){
+        for (known = 0; known < NUM_POLL_STATES; known++){
+            if (field.length == strlen(POLL_NAMES[known]) &&
+                !memcmp(field.text, POLL_NAMES[known], field.length)){
+                break;
+            }
+        }
+    }
+    if (cookie_id < 0 || known == NUM_POLL_STATES){
+        return respond_text(response, HTTP_400, HTTP_400_LENGTH);
+    }
+    // a waiting player is tried again, an offer or a nudge may have missed
+    // it
+    if (known == POLL_WAITING &&
+        is_waiting(session_get(&shard->sessions, cookie_id))){
+        pairing(shard, cookie_id);
+    }
+    POLL_STATE state = poll_state(session_get(&shard->sessions, cookie_id));
+    if (state != known){
+        char *text = arena_alloc(response->arena, EVENT_SIZE);
+        if (text == NULL){ return 1; }
+        return respond_text(response, text,
+                            game_state(shard, cookie_id, text, EVENT_SIZE));
+    }
+    // the player is notified once it leaves the state
+    session_data(&shard->sessions, cookie_id)->waiter_state = state;
+    response->park = cookie_id;
+    return 0;
+}
+
+/**
+ * Answer the parked connection of a player if its state changed
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player
+ */
+static void notify_player(Shard *shard, int cookie_id){
+    Session_data *data = session_data(&shard->sessions, cookie_id);
+    if (data->waiter != NULL && data->waiter_state !=
+        poll_state(session_get(&shard->sessions, cookie_id))){
+        answer_poll(shard, cookie_id);
+    }
+}
+
+/**
+ * The number of players of every shard and every other node waiting for an
+ * image
+ * @param image the image id
+ * @return int the sum of the depths of its queues
+ */
+static int players_waiting(int image){
+    int count = 0;
+    for (int s = 0; s < num_shards; s++){
+        count += matchmaker_depth(&shards[s].matchmaker, image);
+    }
+    for (int n = 0; n < peers.count; n++){
+        count += peers_waiting(&peers, n, image);
+    }
+    return count;
+}
+
+/**
+ * The URL of the image a player plays
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player, -1 if unknown
+ * @return Slice the URL, empty if the player has no image
+ */
+static Slice player_image(Shard *shard, int cookie_id){
+    Slice none = {"", 0};
+    if (cookie_id < 0){ return none; }
+    return catalog_url(&catalog,
+                       session_get(&shard->sessions, cookie_id)->image_index);
+}
+
+/**
+ * Get request handle function
+ * @param shard the shard that owns the player
+ * @param response the response built
+ * @param cookie_id ID of the player, -1 if unknown
+ * @param page the page is going to send
+ * @return int 0 for the html file is successfully sent, 1 otherwise
+ */
+static int method_GET(Shard *shard, Response *response, int cookie_id,
+                      PAGE page){
+    Slice added_text = {"", 0};
+    if(cookie_id >= 0){
+        set_stage(shard, cookie_id, page);
+    }
+    //username may need to be inserted to start.html
+    if(page == PAGE_START && cookie_id >= 0){
+        added_text = arena_printf(response->arena, INSERT_TEXT,
+                session_data(&shard->sessions, cookie_id)->username);
+        if (added_text.text == NULL){ return 1; }
+    }
+    return respond_page(shard, response, page, cookie_id, added_text,
+                     player_image(shard, cookie_id));
+}
+
+/**
+ * Copy a form value into a fixed size string, cutting it if too long
+ * @param dest the string, MAX_C long
+ * @param value the form value
+ */
+static void copy_field(char *dest, Slice value){
+    size_t length = value.length < MAX_C ? value.length : MAX_C - 1;
+    memcpy(dest, value.text, length);
+    dest[length] = '\0';
+}
+
+/**
+ * Post request handle function
+ * @param shard the shard that owns the player
+ * @param response the response built
+ * @param request the parsed request
+ * @param cookie_id ID of the player, -1 if unknown
+ * @param page the page is going to send
+ * @return Boolean true for the html file is successfully sent, false otherwise
+ */
+static bool method_POST(Shard *shard, Response *response,
+                        Http_request const *request, int cookie_id,
+                        PAGE page){
+    char *post_message = "";
+    char keyword[MAX_C];
+    Slice added_text = {NULL, 0};
+    Slice field;
+    //"user=" is an indicator of creating a new user
+    if(http_form_value(request->body, "user", &field)){
+        // add a new user and initialise data;
+        cookie_id = session_create(&shard->sessions);
+        if (cookie_id < 0){
+            return respond_text(response, HTTP_503, HTTP_503_LENGTH) == 0;
+        }
+        Session_data *data = session_data(&shard->sessions, cookie_id);
+        copy_field(data->username, field);
+        post_message = data->username;
+        initialise_status(shard, cookie_id);
+        watch_session(shard, cookie_id);
+    }
+    // an unknown player has to register first
+    else if (cookie_id < 0){
+        return method_GET(shard, response, -1, PAGE_INTRO) == 0;
+    }
+    // player inputs keyword
+    else if (http_form_value(request->body, "keyword", &field)){
+        copy_field(keyword, field);
+        post_message = keyword;
+        //keyword was submitted by other previously
+        if (keyword_match(shard, cookie_id, post_message)){
+            //keep the agreed keyword
+            Session *session = session_get(&shard->sessions, cookie_id);
+            uint32_t player = player_id(shard_address(shard), cookie_id);
+            uint32_t partner = player_id(session->other_shard,
+                                         session->other_index);
+            metric_add(&shard->metrics.matches, 1);
+            log_event(shard->log, LOG_MATCH, -1, 0, player,
+                      partner, session->image_index);
+            if (tag_store_append(&tags, session->image_index, keyword,
+                    strlen(keyword), player, partner) < 0){
+                log_event(shard->log, LOG_ERROR, -1, errno,
+                          ORIGIN_TAG_STORE, 0, 0);
+            }
+            //the image moves back among those with more tags
+            catalog_tagged(&catalog, session->image_index);
+            peers_tagged(&peers, session->image_index);
+            initialise_status(shard, cookie_id);
+            return method_GET(shard, response, cookie_id, PAGE_ENDGAME) == 0;
+        }else if(page == PAGE_DISCARDED){
+            return method_GET(shard, response, cookie_id,
+                              PAGE_DISCARDED) == 0;
+        }
+        //put keyword into list
+        store_keyword(shard, cookie_id, post_message);
+        //sting that contains all keyword input by a player
+        added_text = keyword_set_text(
+                &session_data(&shard->sessions, cookie_id)->keywords,
+                INSERT_BEFORE, INSERT_AFTER);
+    }
+    // qui game, send game over page and exit
+    else if(http_form_value(request->body, "quit", &field)){
+        initialise_status(shard, cookie_id);
+        return method_GET(shard, response, cookie_id, PAGE_GAMEOVER) == 0;
+    }
+    //update player stage
+    set_stage(shard, cookie_id, page);
+    if (added_text.text == NULL){
+        added_text = arena_printf(response->arena, INSERT_TEXT,
+                                  post_message);
+        if (added_text.text == NULL){ return false; }
+    }
+    return respond_page(shard, response, page, cookie_id, added_text,
+                     player_image(shard, cookie_id)) == 0;
+}
+
+/**
+ * Read the cookie of a player registered on this shard
+ * @param shard the shard that owns the player
+ * @param request the parsed request
+ * @return int the slot of the session store that holds the player
+ *             (also called ID), -1 if unknown or expired
+ */
+int read_slot(Shard *shard, Http_request const *request){
+    int cookie = request->cookie;
+    if (cookie < 0 || cookie_shard(cookie) != shard->id){ return -1; }
+    int slot = (cookie & COOKIE_MASK) / num_shards;
+    if (slot >= shard->sessions.count){ return -1; }
+    Session *session = session_get(&shard->sessions, slot);
+    // a cookie of a released slot must not reach the player reusing it
+    if (!session->in_use ||
+        (session->generation & 0x7f) != cookie >> COOKIE_BITS){
+        return -1;
+    }
+    return slot;
+}
+
+/**
+ * Store keyword into particular user's keyword list, a partner on another
+ * shard gets a copy
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param keyword   keyword input by player
+ */
+static void store_keyword(Shard *shard, int cookie_id, char *keyword){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    Session_data *data = session_data(&shard->sessions, cookie_id);
+    if (keyword_set_add(&data->keywords, keyword, strlen(keyword)) < 0){
+        log_event(shard->log, LOG_ERROR, -1, errno, ORIGIN_KEYWORD_SET, 0, 0);
+    }
+    if (session->other_index >= 0 &&
+        session->other_shard != shard_address(shard)){
+        Message *message = message_create(MSG_KEYWORD, keyword,
+                                          strlen(keyword));
+        if (message == NULL){ return; }
+        message->slot = session->other_index;
+        message->peer_shard = shard_address(shard);
+        message->peer_slot = cookie_id;
+        send_message(session->other_shard, message);
+    }
+    return;
+}
+
+/**
+ * Check whether a player waits for a partner
+ * @param session the hot fields of the player
+ * @return Boolean true if the player can be paired
+ */
+bool is_waiting(Session const *session){
+    //pair condition: un-paired, no offer out and currently at first_turn
+    //page or discarded page
+    return session->in_use && session->other_index == -1 &&
+           !session->pending &&
+           (session->stage == PAGE_FIRST_TURN ||
+            session->stage == PAGE_DISCARDED);
+}
+
+/**
+ * The second the timer of a player next has to look at it: the game of a
+ * paired player ends, a waiting player leaves its queue and any other
+ * player loses its session once idle long enough
+ * @param session the hot fields of the player
+ * @return uint32_t the second
+ */
+static uint32_t session_deadline(Session const *session){
+    if (session->other_index >= 0){
+        return session->last_active + GAME_IDLE;
+    }
+    if (session->queue >= 0){
+        return session->last_active + WAIT_IDLE;
+    }
+    return session->last_active + SESSION_IDLE;
+}
+
+/**
+ * Make sure the timer of a player fires by its deadline. It is only moved
+ * earlier, requests push the deadline later and the timer finds out when it
+ * fires, so the hot path never touches the wheel
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ */
+void watch_session(Shard *shard, int cookie_id){
+    Timer *timer = &session_data(&shard->sessions, cookie_id)->timer;
+    uint32_t deadline = session_deadline(session_get(&shard->sessions,
+                                                     cookie_id));
+    if (!timer_armed(timer) || (int32_t)(timer->expires - deadline) > 0){
+        timer->id = cookie_id;
+        timer_arm(&shard->session_timers, timer, deadline);
+    }
+}
+
+/**
+ * Put a player into the waiting queue of its image or take it out, after
+ * anything is changed that decides whether it waits
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ */
+void update_queue(Shard *shard, int cookie_id){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    bool waiting = is_waiting(session);
+    if (session->queue >= 0 &&
+        (!waiting || session->queue != session->image_index)){
+        matchmaker_cancel(&shard->matchmaker, &shard->sessions, cookie_id);
+    }
+    // alone in its queue, the next game scheduled is sent the same image
+    if (waiting && matchmaker_enqueue(&shard->matchmaker, &shard->sessions,
+                                      cookie_id) == 1){
+        catalog_open(&catalog, session->image_index);
+    }
+    if (session->queue >= 0){
+        watch_session(shard, cookie_id);
+    }
+}
+
+/**
+ * Record the page sent to a player
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param page the page
+ */
+static void set_stage(Shard *shard, int cookie_id, PAGE page){
+    session_get(&shard->sessions, cookie_id)->stage = page;
+    update_queue(shard, cookie_id);
+}
+
+/**
+ * Publish the player gauges of the metrics
+ * @param shard the shard
+ */
+void publish_state(Shard *shard){
+    Match_stats stats;
+    matchmaker_stats(&shard->matchmaker, &stats);
+    Metrics *metrics = &shard->metrics;
+    metric_set(&metrics->waiting, stats.waiting);
+    metric_set(&metrics->players_registered, shard->sessions.active);
+    metric_set(&metrics->players_paired, shard->paired);
+    metric_set(&metrics->pairing_wait_sum, stats.total_wait);
+    metric_set(&metrics->pairing_wait_count, stats.matched);
+    metric_set(&metrics->pairing_wait_max, stats.max_wait);
+}
+
+/**
+ * Give a player a partner
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param other_index the slot of the partner
+ * @param other_shard the shard of the partner
+ */
+static void set_partner(Shard *shard, int cookie_id, int other_index,
+                        int other_shard){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    if (session->other_index < 0){
+        shard->paired++;
+    }
+    session->other_index = other_index;
+    session->other_shard = other_shard;
+    log_event(shard->log, LOG_PAIR, -1, 0,
+              player_id(shard_address(shard), cookie_id),
+              player_id(other_shard, other_index), session->image_index);
+    watch_session(shard, cookie_id);
+    notify_player(shard, cookie_id);
+}
+
+/**
+ * Offer a player to another shard, or nudge it to offer its own player
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param target the other shard, node * NODE_SHARDS + its id
+ * @param offer true to offer the player, false to nudge
+ */
+static void reach_out(Shard *shard, int cookie_id, int target, bool offer){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    Message *message = message_create(
+            offer ? MSG_PAIR_OFFER : MSG_PAIR_NUDGE, NULL, 0);
+    if (message == NULL){ return; }
+    message->peer_shard = shard_address(shard);
+    message->peer_slot = cookie_id;
+    message->game = session->game;
+    message->image = session->image_index;
+    if (offer){
+        session->pending = true;
+        update_queue(shard, cookie_id);
+    }
+    send_message(target, message);
+}
+
+/**
+ * Pairing two player, a player nobody on this shard can pair with is
+ * offered to a lower shard that has someone waiting for the same image
+ * (only the higher shard offers, so two shards never offer to each other),
+ * or else a higher shard with someone waiting is nudged to offer its player
+ * to this one; the other nodes are tried the same way, by node id, once no
+ * shard of this node has anyone waiting
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @return 1 for a player has been successfully paired, 0 otherwise
+ */
+int pairing(Shard *shard, int cookie_id){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    //all un-paired players are initialise as -1
+    // exit if a player is already paired
+    if(session->other_index != -1){ return 1; }
+    // an offer to another shard has not been answered yet
+    if(session->pending){ return 0; }
+    int image = session->image_index;
+    int i = matchmaker_dequeue(&shard->matchmaker, &shard->sessions, image,
+                               cookie_id);
+    if (i >= 0){
+        set_partner(shard, cookie_id, i, shard_address(shard));
+        set_partner(shard, i, cookie_id, shard_address(shard));
+        update_queue(shard, cookie_id);
+        return 1;
+    }
+    // queued before any other shard is asked, a shard nudged back finds it
+    update_queue(shard, cookie_id);
+    for (int s = 0; s < num_shards; s++){
+        if (s != shard->id &&
+            matchmaker_depth(&shards[s].matchmaker, image) > 0){
+            reach_out(shard, cookie_id, peers.node * NODE_SHARDS + s,
+                      s < shard->id);
+            return 0;
+        }
+    }
+    for (int n = 0; n < peers.count; n++){
+        int node = peers.peers[n].node;
+        if (peers_waiting(&peers, n, image) > 0){
+            reach_out(shard, cookie_id, node * NODE_SHARDS + NODE_ANY,
+                      node < peers.node);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * check a freshly input keyword if submitted by paired player
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param keyword keyword input by player
+ * @return Boolean true if keyword found, false otherwise
+ */
+static bool keyword_match(Shard *shard, int cookie_id, char *keyword){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    int other_index = session->other_index;
+    //exit if self is un-paired
+    if (other_index < 0){
+        return false;
+    }else if (session->other_shard != shard_address(shard)){
+        // the partner lives on another shard, check the copy of its keywords
+        return keyword_set_contains(
+                &session_data(&shard->sessions, cookie_id)->partner_keywords,
+                keyword, strlen(keyword));
+    }
+    return keyword_set_contains(
+            &session_data(&shard->sessions, other_index)->keywords,
+            keyword, strlen(keyword));
+}
+
+/**
+ * Forget the partner and keywords of a player
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param requeue false to keep a player gone idle out of the queues
+ */
+static void clear_game(Shard *shard, int cookie_id, bool requeue){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    Session_data *data = session_data(&shard->sessions, cookie_id);
+    if (session->other_index >= 0){
+        shard->paired--;
+    }
+    session->other_index = -1;
+    keyword_set_clear(&data->keywords);
+    keyword_set_clear(&data->partner_keywords);
+    if (requeue){
+        update_queue(shard, cookie_id);
+    }else{
+        matchmaker_cancel(&shard->matchmaker, &shard->sessions, cookie_id);
+    }
+    notify_player(shard, cookie_id);
+}
+
+/**
+ * End the game of a player and of its partner, who may play again
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @param requeue false when the player is gone idle, it queues again only
+ *                with its next request
+ */
+static void end_game(Shard *shard, int cookie_id, bool requeue){
+    Session *session = session_get(&shard->sessions, cookie_id);
+    int other = session->other_index;
+    int other_shard = session->other_shard;
+    // initialise player status
+    session->pending = false;
+    session->game++;
+    clear_game(shard, cookie_id, requeue);
+    // initialise paired player status, if self was paired before
+    if(other >= 0 && other_shard == shard_address(shard)){
+        clear_game(shard, other, true);
+    }else if(other >= 0){
+        Message *message = message_create(MSG_RESET, NULL, 0);
+        if (message == NULL){ return; }
+        message->slot = other;
+        message->peer_shard = shard_address(shard);
+        message->peer_slot = cookie_id;
+        send_message(other_shard, message);
+    }
+    return;
+}
+
+/**
+ * Initialise pairing status and number of keywords
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ */
+void initialise_status(Shard *shard, int cookie_id){
+    end_game(shard, cookie_id, true);
+}
+
+/**
+ * Check whether a message comes from the current partner of a player
+ * @param shard the receiving shard
+ * @param message the message
+ * @return Boolean true if the sender is paired with message->slot
+ */
+static bool from_partner(Shard *shard, Message *message){
+    if (message->slot < 0 || message->slot >= shard->sessions.count){
+        return false;
+    }
+    Session *session = session_get(&shard->sessions, message->slot);
+    return session->in_use && session->other_index == message->peer_slot &&
+           session->other_shard == message->peer_shard;
+}
+
+/**
+ * Answer a request that could not be delimited, the connection is closed
+ * after it
+ * @param response the response built, its arena set by the caller
+ * @param result what the parser returned, HTTP_BAD or HTTP_TOO_LARGE
+ * @return Boolean true for the response is built, false otherwise
+ */
+bool game_reject(Response *response, int result){
+    response->request = NULL;
+    response->park = -1;
+    response->file = NULL;
+    memset(&response->stream, 0, sizeof(Stream));
+    response->route = ROUTE_BAD;
+    return (result == HTTP_TOO_LARGE ?
+            respond_text(response, HTTP_413, HTTP_413_LENGTH) :
+            respond_text(response, HTTP_400, HTTP_400_LENGTH)) == 0;
+}
+
+/**
+ * Apply one message about the game from another shard
+ * @param shard the receiving shard
+ * @param message the message
+ */
+void game_message(Shard *shard, Message *message){
+    Message *reply;
+    Session *session;
+    int i;
+    switch (message->type)
+    {
+        case MSG_PAIR_OFFER:
+            i = matchmaker_dequeue(&shard->matchmaker, &shard->sessions,
+                                   message->image, -1);
+            reply = message_create(i >= 0 ? MSG_PAIR_ACCEPT : MSG_PAIR_REJECT,
+                                   NULL, 0);
+            if (reply == NULL){ break; }
+            // a rejection names its shard too, another node checks it
+            reply->peer_shard = shard_address(shard);
+            if (i >= 0){
+                set_partner(shard, i, message->peer_slot, message->peer_shard);
+                keyword_set_clear(
+                        &session_data(&shard->sessions, i)->partner_keywords);
+                reply->peer_slot = i;
+            }
+            reply->slot = message->peer_slot;
+            reply->game = message->game;
+            send_message(message->peer_shard, reply);
+            break;
+        case MSG_PAIR_ACCEPT:
+        case MSG_PAIR_REJECT:
+            i = message->slot;
+            session = i >= 0 && i < shard->sessions.count ?
+                      session_get(&shard->sessions, i) : NULL;
+            if (session != NULL && session->in_use &&
+                session->game == message->game && session->pending){
+                session->pending = false;
+                if (message->type == MSG_PAIR_ACCEPT &&
+                    session->other_index == -1){
+                    set_partner(shard, i, message->peer_slot,
+                                message->peer_shard);
+                    keyword_set_clear(
+                            &session_data(&shard->sessions, i)->partner_keywords);
+                    update_queue(shard, i);
+                    break;
+                }
+                update_queue(shard, i);
+                if (message->type == MSG_PAIR_REJECT){
+                    // the queues of this node are current, unlike the counts
+                    // of the others, so the player tries again at once
+                    if (message->peer_shard / NODE_SHARDS == peers.node){
+                        pairing(shard, i);
+                    }
+                    break;
+                }
+            }
+            if (message->type == MSG_PAIR_ACCEPT){
+                // the player moved on meanwhile, release the partner again
+                reply = message_create(MSG_RESET, NULL, 0);
+                if (reply == NULL){ break; }
+                reply->slot = message->peer_slot;
+                reply->peer_shard = shard_address(shard);
+                reply->peer_slot = message->slot;
+                send_message(message->peer_shard, reply);
+            }
+            break;
+        case MSG_PAIR_NUDGE:
+            // a lower shard has queued a player for the image, offer ours
+            // straight to it
+            i = matchmaker_head(&shard->matchmaker, message->image);
+            if (i >= 0){
+                reach_out(shard, i, message->peer_shard, true);
+            }
+            break;
+        case MSG_PAIR_RETRY:
+            // something changed that may have brought a partner
+            i = matchmaker_head(&shard->matchmaker, message->image);
+            if (i >= 0){
+                pairing(shard, i);
+            }
+            break;
+        case MSG_KEYWORD:
+            if (from_partner(shard, message)){
+                Session_data *data = session_data(&shard->sessions,
+                                                  message->slot);
+                if (keyword_set_add(&data->partner_keywords, message->data,
+                                    message->length) < 0){
+                    log_event(shard->log, LOG_ERROR, -1, errno,
+                              ORIGIN_KEYWORD_SET, 0, 0);
+                }
+            }
+            break;
+        case MSG_RESET:
+            if (from_partner(shard, message)){
+                clear_game(shard, message->slot, true);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Handler of the timer of a player, end what it left idle: its game, so
+ * the partner can play again, its place in a queue, so nobody is paired
+ * with it, and at last its session
+ * @param wheel the session wheel of the shard
+ * @param timer the timer of the player
+ * @param data the shard
+ */
+void expire_session(Timer_wheel *wheel, Timer *timer, void *data)
+{
+    Shard *shard = data;
+    Session_store *sessions = &shard->sessions;
+    int slot = timer->id;
+    Session *session = session_get(sessions, slot);
+    uint32_t idle = wheel->now - session->last_active;
+    if (idle >= SESSION_IDLE)
+    {
+        // a partner still playing is told the player left
+        end_game(shard, slot, false);
+        answer_poll(shard, slot);
+        session_release(sessions, slot);
+        metric_add(&shard->metrics.timeouts[TIMEOUT_SESSION], 1);
+        return;
+    }
+    // the partner plays again, the player idle is not queued for anyone
+    if (session->other_index >= 0 && idle >= GAME_IDLE)
+    {
+        end_game(shard, slot, false);
+        metric_add(&shard->metrics.timeouts[TIMEOUT_GAME], 1);
+    }
+    // it queues again with its next request
+    if (session->queue >= 0 && idle >= WAIT_IDLE)
+    {
+        matchmaker_cancel(&shard->matchmaker, sessions, slot);
+        metric_add(&shard->metrics.timeouts[TIMEOUT_WAIT], 1);
+    }
+    watch_session(shard, slot);
+}
@@ -0,0 +1,177 @@
+/*
+** Game core of image-tagger
+ * The game state machine without sockets: it takes a parsed request and
+ * the shard that owns the player, updates the players and queues, and
+ * describes the response as an iovec list built in an arena. The server
+ * sends it, or parks the connection when a GET /events has to wait. What
+ * the core needs from its embedder, a way to message other shards and to
+ * answer a parked poll, is declared below and provided by the server and
+ * by the benchmark.
+*/
+
+#ifndef GAME_H
+#define GAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "catalog.h"
+#include "event.h"
+#include "event_log.h"
+#include "file_cache.h"
+#include "http.h"
+#include "mailbox.h"
+#include "matchmaking.h"
+#include "metrics.h"
+#include "peer.h"
+#include "rate_limit.h"
+#include "session.h"
+#include "stream.h"
+#include "tag_store.h"
+#include "template.h"
+#include "timer_wheel.h"
+
+/** Define the max # worker shards */
+#define MAX_SHARDS 256
+
+/** Define the bits of a cookie holding slot * num_shards + shard id, the
+ *  bits above hold the generation of the slot */
+#define COOKIE_BITS 24
+#define COOKIE_MASK ((1 << COOKIE_BITS) - 1)
+
+/** Define the longest event response */
+#define EVENT_SIZE 128
+
+/** Represents the state of a player reported by GET /events */
+typedef enum
+{
+    POLL_WAITING,
+    POLL_PAIRED,
+    POLL_ENDED,
+    NUM_POLL_STATES
+} POLL_STATE;
+
+/** The state owned by one worker thread, a player belongs to the shard that
+ *  registered it and its cookie names the shard, the slot and the generation
+ *  @param int id The number of the shard
+ *  @param int listenfd The SO_REUSEPORT listening socket of the shard
+ *  @param int wakefd The eventfd signalled when the mailbox is pushed
+ *  @param int timerfd The timerfd ticking every second
+ *  @param pthread_t thread The worker thread
+ *  @param Event_loop *loop The event loop of the shard
+ *  @param Mailbox mailbox Messages and connections from other shards
+ *  @param Session_store sessions The players registered on the shard
+ *  @param Matchmaker matchmaker The players waiting for a partner
+ *  @param int paired The number of players with a partner
+ *  @param Metrics metrics The counters of the shard, read by every shard
+ *  @param Log_ring *log The ring of the shard in the event log
+ *  @param int parked_head The slot parked longest by GET /events, -1 if none
+ *  @param int parked_tail The slot parked last by GET /events, -1 if none
+ *  @param uint32_t saved_at The second the players were last saved
+ *  @param bool stopping The shard no longer accepts and stops at the next
+ *  tick
+ *  @param Timer_wheel connection_timers The deadlines of the connections
+ *  @param Timer_wheel session_timers The deadlines of the players
+ *  @param Template_set templates The compiled pages of the shard
+ *  @param File_cache files The images the shard keeps open
+ *  @param Rate_limiter limiter The token buckets of the clients of the shard
+ */
+typedef struct {
+    int id;
+    int listenfd;
+    int wakefd;
+    int timerfd;
+    pthread_t thread;
+    Event_loop *loop;
+    Mailbox mailbox;
+    Session_store sessions;
+    Matchmaker matchmaker;
+    int paired;
+    Metrics metrics;
+    Log_ring *log;
+    int parked_head;
+    int parked_tail;
+    uint32_t saved_at;
+    bool stopping;
+    Timer_wheel connection_timers;
+    Timer_wheel session_timers;
+    Template_set templates;
+    File_cache files;
+    Rate_limiter limiter;
+} Shard;
+
+/** The answer to one request, the pieces point into the arena, the
+ *  compiled pages and the players, and stay valid until the next request
+ *  of the shard
+ *  @param Arena *arena The memory the response is built in, set by the
+ *  caller
+ *  @param Http_request const *request The request answered
+ *  @param struct iovec *iov The pieces of the response, in order
+ *  @param int iovcnt The number of pieces, 0 if parked
+ *  @param int park The slot of the player whose next event the request
+ *  waits for, -1 if answered
+ *  @param ROUTE route The route of the request
+ *  @param File *file The file sent after the pieces, held until it is sent,
+ *  NULL if none
+ *  @param off_t file_offset The offset of the first byte of file sent
+ *  @param size_t file_length The number of bytes of file sent
+ *  @param Stream stream The body streamed after the pieces, its fill is NULL
+ *  if none
+ */
+typedef struct {
+    Arena *arena;
+    Http_request const *request;
+    struct iovec *iov;
+    int iovcnt;
+    int park;
+    ROUTE route;
+    File *file;
+    off_t file_offset;
+    size_t file_length;
+    Stream stream;
+} Response;
+
+/** All shards, shared by every shard */
+extern Shard *shards;
+extern int num_shards;
+
+/** The images played and the scheduler of new games, shared by every shard */
+extern Image_catalog catalog;
+
+/** The agreed keywords of every image, shared by every shard */
+extern Tag_store tags;
+
+/** The trace of connections, requests and games, shared by every shard */
+extern Event_log events;
+
+/** The links to the other nodes, shared by every shard */
+extern Peer_set peers;
+
+/** Prototypes */
+bool game_request(Shard *shard, Http_request const *request,
+                  Response *response);
+bool game_reject(Response *response, int result);
+ROUTE game_route(Http_request const *request, Slice *rest);
+int read_slot(Shard *shard, Http_request const *request);
+int game_state(Shard *shard, int cookie_id, char *out, size_t size);
+void game_message(Shard *shard, Message *message);
+int cookie_shard(int cookie);
+int shard_address(Shard const *shard);
+bool is_waiting(Session const *session);
+void watch_session(Shard *shard, int cookie_id);
+void update_queue(Shard *shard, int cookie_id);
+void publish_state(Shard *shard);
+int pairing(Shard *shard, int cookie_id);
+void initialise_status(Shard *shard, int cookie_id);
+void expire_session(Timer_wheel *wheel, Timer *timer, void *data);
+
+/** Prototypes provided by the embedder */
+void send_message(int shard_id, Message *message);
+void answer_poll(Shard *shard, int cookie_id);
+
+#endif
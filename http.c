@@ -0,0 +1,267 @@
+/*
+** HTTP/1.1 request parser of image-tagger
+ * Only the head is searched for its end, and the search resumes where the
+ * previous read stopped, so a request split over many reads is scanned once.
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <strings.h>
+
+#include "http.h"
+
+/**
+ * Compare a slice with a string, ignoring case
+ * @param slice the slice
+ * @param text the string
+ * @return Boolean true if they are equal
+ */
+static bool slice_equal(Slice slice, char const *text){
+    size_t length = strlen(text);
+    return slice.length == length &&
+           !strncasecmp(slice.text, text, length);
+}
+
+/**
+ * Check whether a comma separated header value contains a token
+ * @param value the header value
+ * @param token the token, compared ignoring case
+ * @return Boolean true if the token is listed
+ */
+static bool has_token(Slice value, char const *token){
+    size_t length = strlen(token);
+    char const *end = value.text + value.length;
+    for (char const *p = value.text; p + length <= end; p++){
+        if (!strncasecmp(p, token, length) &&
+            (p == value.text || p[-1] == ',' || p[-1] == ' ') &&
+            (p + length == end || p[length] == ',' || p[length] == ' ')){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check whether an Accept-Encoding value allows gzip, a zero quality
+ * refuses it
+ * @param value the header value
+ * @return Boolean true if gzip is accepted
+ */
+static bool accepts_gzip(Slice value){
+    char const *end = value.text + value.length;
+    char const *p = value.text;
+    while (p < end){
+        while (p < end && (*p == ' ' || *p == ',')){ p++; }
+        char const *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' '){ p++; }
+        Slice coding = {name, p - name};
+        char const *params = p;
+        while (p < end && *p != ','){ p++; }
+        if (slice_equal(coding, "gzip") || slice_equal(coding, "x-gzip")){
+            // q=0, q=0.0 and so on, any other digit accepts
+            char const *q = params;
+            while (q + 1 < p && !(q[0] == 'q' && q[1] == '=')){ q++; }
+            if (q + 1 >= p){ return true; }
+            for (q += 2; q < p; q++){
+                if (*q >= '1' && *q <= '9'){ return true; }
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Read a non-negative decimal number
+ * @param value the text
+ * @param limit the largest accepted number
+ * @return long the number, -1 if it is not one or is above limit
+ */
+static long parse_number(Slice value, long limit){
+    long number = 0;
+    if (value.length == 0){ return -1; }
+    for (size_t i = 0; i < value.length; i++){
+        if (value.text[i] < '0' || value.text[i] > '9'){ return -1; }
+        number = number * 10 + (value.text[i] - '0');
+        if (number > limit){ return -1; }
+    }
+    return number;
+}
+
+/**
+ * Read the id of a Cookie header
+ * @param value the header value
+ * @return int the id, -1 if there is none
+ */
+static int parse_cookie(Slice value){
+    char const *end = value.text + value.length;
+    for (char const *p = value.text; p + 3 <= end; p++){
+        if (strncmp(p, "id=", 3) ||
+            (p != value.text && p[-1] != ' ' && p[-1] != ';')){
+            continue;
+        }
+        Slice number = {p + 3, 0};
+        while (number.text < end && *number.text == ' '){ number.text++; }
+        while (number.text + number.length < end &&
+               number.text[number.length] >= '0' &&
+               number.text[number.length] <= '9'){
+            number.length++;
+        }
+        return (int)parse_number(number, 0x7fffffff);
+    }
+    return -1;
+}
+
+/**
+ * Tokenize the head of a request once it is complete
+ * @param data the buffered bytes of the connection
+ * @param length the number of buffered bytes
+ * @param scanned how far earlier calls searched, updated
+ * @param request filled in when the head is complete
+ * @return int HTTP_INCOMPLETE until the head is complete, 1 once it is
+ *             parsed, HTTP_BAD or HTTP_TOO_LARGE if it can not be served
+ */
+int http_parse_head(char const *data, size_t length, size_t *scanned,
+                    Http_request *request){
+    // resume the search for the blank line, it may straddle two reads
+    size_t from = *scanned > 3 ? *scanned - 3 : 0;
+    char const *end = memmem(data + from, length - from, "\r\n\r\n", 4);
+    if (end == NULL){
+        *scanned = length;
+        return length > MAX_HEAD ? HTTP_TOO_LARGE : HTTP_INCOMPLETE;
+    }
+    memset(request, 0, sizeof(Http_request));
+    request->head_length = end - data + 4;
+    request->cookie = -1;
+    if (request->head_length > MAX_HEAD){ return HTTP_TOO_LARGE; }
+
+    // request line: method SP target SP HTTP/1.x CRLF
+    char const *line_end = memmem(data, end + 2 - data, "\r\n", 2);
+    char const *p = memchr(data, ' ', line_end - data);
+    if (p == NULL){ return HTTP_BAD; }
+    Slice method = {data, p - data};
+    request->method = slice_equal(method, "GET") ? GET :
+                      slice_equal(method, "POST") ? POST : UNKNOWN;
+    request->target.text = p + 1;
+    p = memchr(p + 1, ' ', line_end - p - 1);
+    if (p == NULL){ return HTTP_BAD; }
+    request->target.length = p - request->target.text;
+    if (line_end - p - 1 != 8 || strncmp(p + 1, "HTTP/1.", 7) ||
+        p[8] < '0' || p[8] > '9'){
+        return HTTP_BAD;
+    }
+    request->version = p[8] - '0';
+
+    // header lines: name ":" OWS value OWS CRLF
+    for (p = line_end + 2; p < end + 2; p = line_end + 2){
+        line_end = memmem(p, end + 2 - p, "\r\n", 2);
+        char const *colon = memchr(p, ':', line_end - p);
+        if (colon == NULL || colon == p || *p == ' ' || *p == '\t'){
+            return HTTP_BAD;
+        }
+        if (request->num_headers == MAX_HEADERS){ return HTTP_TOO_LARGE; }
+        Http_header *header = &request->headers[request->num_headers++];
+        header->name.text = p;
+        header->name.length = colon - p;
+        char const *value = colon + 1;
+        char const *value_end = line_end;
+        while (value < value_end && (*value == ' ' || *value == '\t')){
+            value++;
+        }
+        while (value_end > value &&
+               (value_end[-1] == ' ' || value_end[-1] == '\t')){
+            value_end--;
+        }
+        header->value.text = value;
+        header->value.length = value_end - value;
+    }
+
+    // the body is delimited by Content-Length only
+    if (http_header(request, "Transfer-Encoding").text != NULL){
+        return HTTP_BAD;
+    }
+    long body_length = 0;
+    Slice content_length = http_header(request, "Content-Length");
+    if (content_length.text != NULL){
+        body_length = parse_number(content_length, MAX_BODY);
+        if (body_length < 0){
+            return parse_number(content_length, 0x7fffffff) < 0 ?
+                   HTTP_BAD : HTTP_TOO_LARGE;
+        }
+    }
+    request->body.text = data + request->head_length;
+    request->body.length = body_length;
+    request->length = request->head_length + body_length;
+
+    Slice connection = http_header(request, "Connection");
+    request->keep_alive = request->version >= 1 ?
+                          !has_token(connection, "close") :
+                          has_token(connection, "keep-alive");
+    Slice cookie = http_header(request, "Cookie");
+    if (cookie.text != NULL){
+        request->cookie = parse_cookie(cookie);
+    }
+    Slice encoding = http_header(request, "Accept-Encoding");
+    request->gzip = encoding.text != NULL && accepts_gzip(encoding);
+    *scanned = 0;
+    return 1;
+}
+
+/**
+ * Move every slice of a request after its buffer moved
+ * @param request the request
+ * @param from the old address of the buffer
+ * @param to the new address of the buffer
+ */
+void http_rebase(Http_request *request, char const *from, char const *to){
+    request->target.text = to + (request->target.text - from);
+    for (int i = 0; i < request->num_headers; i++){
+        Http_header *header = &request->headers[i];
+        header->name.text = to + (header->name.text - from);
+        header->value.text = to + (header->value.text - from);
+    }
+    request->body.text = to + (request->body.text - from);
+}
+
+/**
+ * Look a header up in the index
+ * @param request the request
+ * @param name the header name, compared ignoring case
+ * @return Slice the value, text is NULL if the header is absent
+ */
+Slice http_header(Http_request const *request, char const *name){
+    Slice none = {NULL, 0};
+    for (int i = 0; i < request->num_headers; i++){
+        if (slice_equal(request->headers[i].name, name)){
+            return request->headers[i].value;
+        }
+    }
+    return none;
+}
+
+/**
+ * Find a field of a urlencoded form
+ * @param body the form
+ * @param name the field name
+ * @param value set to the raw value of the field
+ * @return Boolean true if the field is present
+ */
+bool http_form_value(Slice body, char const *name, Slice *value){
+    size_t length = strlen(name);
+    char const *end = body.text + body.length;
+    char const *p = body.text;
+    while (p < end){
+        char const *next = memchr(p, '&', end - p);
+        if (next == NULL){ next = end; }
+        if ((size_t)(next - p) > length && p[length] == '=' &&
+            !strncmp(p, name, length)){
+            value->text = p + length + 1;
+            value->length = next - p - length - 1;
+            return true;
+        }
+        p = next + 1;
+    }
+    return false;
+}
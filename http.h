@@ -0,0 +1,81 @@
+/*
+** HTTP/1.1 request parser of image-tagger
+ * The head of a request is tokenized once into a method, a target and an
+ * index of headers, the body is delimited by Content-Length. Every piece is
+ * a slice of the connection's input buffer, nothing is copied.
+*/
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "slice.h"
+
+/** Define the max # headers of a request */
+#define MAX_HEADERS 32
+
+/** Define the max length of a request head */
+#define MAX_HEAD 8192
+
+/** Define the max length of a request body */
+#define MAX_BODY 8192
+
+/** Results of http_parse_head */
+#define HTTP_INCOMPLETE 0
+#define HTTP_BAD (-1)
+#define HTTP_TOO_LARGE (-2)
+
+/** Represents the types of method */
+typedef enum
+{
+    GET,
+    POST,
+    UNKNOWN
+} METHOD;
+
+/** One header line
+ *  @param Slice name The header name
+ *  @param Slice value The value without surrounding spaces
+ */
+typedef struct {
+    Slice name;
+    Slice value;
+} Http_header;
+
+/** A parsed request
+ *  @param METHOD method The request method
+ *  @param Slice target The request target (URI)
+ *  @param int version The minor version, 1 for HTTP/1.1
+ *  @param Http_header headers[MAX_HEADERS] The header index
+ *  @param int num_headers The number of headers
+ *  @param Slice body The body, Content-Length bytes after the head
+ *  @param size_t head_length The length of the request line and headers
+ *  @param size_t length The length of the whole request
+ *  @param bool keep_alive The connection stays open after the response
+ *  @param int cookie The id of the Cookie header, -1 if there is none
+ *  @param bool gzip Accept-Encoding allows a gzip response
+ */
+typedef struct {
+    METHOD method;
+    Slice target;
+    int version;
+    Http_header headers[MAX_HEADERS];
+    int num_headers;
+    Slice body;
+    size_t head_length;
+    size_t length;
+    bool keep_alive;
+    int cookie;
+    bool gzip;
+} Http_request;
+
+/** Prototypes */
+int http_parse_head(char const *data, size_t length, size_t *scanned,
+                    Http_request *request);
+void http_rebase(Http_request *request, char const *from, char const *to);
+Slice http_header(Http_request const *request, char const *name);
+bool http_form_value(Slice body, char const *name, Slice *value);
+
+#endif
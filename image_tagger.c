@@ -8,539 +8,792 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
 #include <strings.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/uio.h>
 
+#include "connection.h"
+#include "game.h"
+
 // constants
-static char const * const HTTP_200_FORMAT = "HTTP/1.1 200 OK\r\n\
-Set-Cookie: id= %d \r\n\
-Content-Type: text/html\r\n\
-Content-Length: %ld\r\n\r\n";
-static char const * const HTTP_400 = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
-static int const HTTP_400_LENGTH = 47;
-static char const * const HTTP_404 = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-static int const HTTP_404_LENGTH = 45;
-static char const * const INSERT_TEXT = "\r\n<p>%s</p>\r\n";
+static char const * const HTTP_503_BUSY = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static int const HTTP_503_BUSY_LENGTH = 90;
+static char const * const HTTP_429 = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+static int const HTTP_429_LENGTH = 69;
 
-/** Define the max char length */
-#define MAX_C 20
+/** Define the max # open connections unless given on the command line */
+#define MAX_CONNECTIONS 10000
 
-/** Define the max # player*/
-#define MAX_P 10
+/** Define the # file descriptors kept back from connections for the
+ *  listeners, event loops, timers and files */
+#define FD_RESERVE 64
 
-/** Define the default buff size */
-#define BUFF_SIZE 2048
+/** Define the bytes of a request read before a shed connection is closed */
+#define SHED_DRAIN 2048
 
-/** Define the default text size */
-#define TEXT_SIZE 300
+/** Define the manifest of the images, one URL per line */
+#define IMAGE_MANIFEST "images.txt"
 
-/** Define a smaller text size */
-#define TEXT_SIZE_S 250
+/** Define the directory of the images served locally, and their path */
+#define IMAGE_DIR "images"
+#define IMAGE_PATH "/images/"
 
-/** Represents the types of method */
-typedef enum
-{
-    GET,
-    POST,
-    UNKNOWN
-} METHOD;
-
-/** The structure of user's data stored in server
- *  @param char username[MAX_C] The username
- *  @param char stage[MAX_C] The page(html) that server sent to client previously
- *  @param char keyword[MAX_C][MAX_C] The keyword list stores all keywords input in each turn
- *  @param int int num_keywords The counter of the number of keywords input
- *  @param int int other_index The index indicates index in user_data of
- *  the paired player in each game turn, not paired is -1
- *  @param char image_index The char indicates the image used in each turn
- */
-typedef struct {
-    char username[MAX_C];
-    char stage[MAX_C];
-    char keyword[MAX_C][MAX_C];
-    int num_keywords;
-    int other_index;
-    char image_index;
-} User_data;
+/** Define the limit of the requests of a client on every route */
+#define RATE_LIMITS "rate_limits.txt"
 
-/** Prototypes */
-int method_GET(int sockfd,char *buff, char *html_name, User_data *user_data,
-               char *image_index);
-bool method_POST(int sockfd,char *buff, char *html_name,
-                 User_data *user_data, int *index, char *image_index);
-int read_cookie(char *buff);
-char* extract_message(char *str, char *start, char *end);
-void store_keyword(User_data *user_data, int cookie_id, char *keyword);
-char* all_keywords(User_data *user_data, int cookie_id);
-int pairing(User_data *user_data, int cookie_id, int index);
-bool keyword_match(User_data *user_data, int cookie_id, char *keyword);
-void initialise_status(User_data *user_data, int cookie_id);
-char* image_controller(char *buff, char *image_index);
+/** Define the nodes players are paired across, none if the file is missing */
+#define PEERS "peers.txt"
+
+/** Define the files of the tag store */
+#define TAG_LOG "tags.log"
+#define TAG_INDEX "tags.idx"
+
+/** Define the file the event log is written to, rotated to EVENT_LOG.1 */
+#define EVENT_LOG "events.log"
+
+/** Define the seconds a connection may stay idle before it is closed */
+#define CONNECTION_IDLE 30
+
+/** Define the seconds a request may take to arrive once it started */
+#define REQUEST_DEADLINE 10
+
+/** Define the snapshot file of each shard, numbered by the shard */
+#define STATE_FILE "state.%d"
+
+/** Define the seconds between two snapshots of a shard */
+#define SNAPSHOT_INTERVAL 30
+
+/** Define the environment variable handing the listening sockets to the
+ *  process a restart execs, one fd per shard separated by commas */
+#define LISTEN_FDS "IMAGE_TAGGER_LISTEN_FDS"
+
+/** Define the seconds GET /events waits for an event before it answers */
+#define POLL_TIMEOUT 25
 
+/** The admission limits, connections beyond max_connections are shed and
+ *  backlog bounds the connections queued before they are accepted */
+static int max_connections = MAX_CONNECTIONS;
+static int backlog = SOMAXCONN;
+
+/** The rate limit of every route, shared by every shard */
+static Rate_limit rate_limits[NUM_ROUTES];
+
+/** The failures of the tag store logged so far, only read by the first shard */
+static uint64_t tag_failures_seen;
+
+/** The snapshots the shards took and the saver thread has not written yet,
+ *  one per shard, a newer one replaces the one before */
+static Snapshot *unsaved;
+static pthread_mutex_t saver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t saver_ready = PTHREAD_COND_INITIALIZER;
+static bool saver_stopping;
+static pthread_t saver;
+
+/** Prototypes */
+static void handle_client(Event_loop *loop, int fd, unsigned events, void *data);
+static void serve_requests(Shard *shard, Connection *connection);
+static void watch_connection(Shard *shard, Connection *connection);
 
 /**
- * The http request handle function
- * @param sockfd socket file descriptor
- * @return Boolean true for the http request is properly handled
- *                 false otherwise
+ * Take the parked connection of a player off the waiting list
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player
+ * @return Connection* the connection, NULL if none was parked
  */
-static bool handle_http_request(int sockfd)
-{
-    // User database and its initialisation
-    static User_data user_data[MAX_P] = {{{'\0'}, {'\0'},{{'\0'}},0,-1, '0'}};
-    // the number of users have registered in the server
-    static int index = 0;
-    static char image_index = '2';
-    // try to read the request
-    char buff[BUFF_SIZE+1];
-    int n = read(sockfd, buff, BUFF_SIZE+1);
-    char html_name[MAX_C];
-
-    if (n <= 0)
-    {
-        if (n < 0)
-            perror("read");
-        else
-            printf("socket %d close the connection\n", sockfd);
-        return false;
+static Connection* unpark(Shard *shard, int cookie_id){
+    Session_data *data = session_data(&shard->sessions, cookie_id);
+    Connection *connection = data->waiter;
+    if (connection == NULL){ return NULL; }
+    if (data->waiter_prev >= 0){
+        session_data(&shard->sessions, data->waiter_prev)->waiter_next =
+                data->waiter_next;
+    }else{
+        shard->parked_head = data->waiter_next;
     }
+    if (data->waiter_next >= 0){
+        session_data(&shard->sessions, data->waiter_next)->waiter_prev =
+                data->waiter_prev;
+    }else{
+        shard->parked_tail = data->waiter_prev;
+    }
+    data->waiter = NULL;
+    connection->parked = -1;
+    connection->active_at = session_now();
+    return connection;
+}
 
-    // terminate the string
-    buff[n] = 0;
-
-    char * curr = buff;
-    int cookie_id = read_cookie(buff);
+/**
+ * Answer the parked connection of a player with its current state, the
+ * requests it buffered meanwhile are served when it is writable
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of the player
+ */
+void answer_poll(Shard *shard, int cookie_id){
+    Connection *connection = unpark(shard, cookie_id);
+    if (connection == NULL){ return; }
+    // built on the stack, it may be answered from the request of another
+    // connection
+    char text[EVENT_SIZE];
+    struct iovec iov;
+    iov.iov_base = text;
+    iov.iov_len = game_state(shard, cookie_id, text, sizeof(text));
+    if (connection_send(shard->loop, connection, &iov, 1) < 0 ||
+        (!connection_pending(connection) &&
+         event_loop_modify(shard->loop, connection->fd, EVENT_WRITE) < 0)){
+        connection_close(shard->loop, connection);
+    }
+}
 
-    // parse the method
-    METHOD method = UNKNOWN;
-    if (strncmp(curr, "GET ", 4) == 0)
-    {
-        curr += 4;
-        method = GET;
+/**
+ * Park a connection until the player leaves the state its GET /events
+ * named, or POLL_TIMEOUT passes
+ * @param shard the shard that owns the player
+ * @param connection the client connection
+ * @param cookie_id ID of the player
+ */
+static void park(Shard *shard, Connection *connection, int cookie_id){
+    // one waiter per player, an older one gets the state as it is
+    Session_data *data = session_data(&shard->sessions, cookie_id);
+    answer_poll(shard, cookie_id);
+    data->waiter = connection;
+    data->parked_at = session_now();
+    data->waiter_prev = shard->parked_tail;
+    data->waiter_next = -1;
+    if (shard->parked_tail >= 0){
+        session_data(&shard->sessions, shard->parked_tail)->waiter_next =
+                cookie_id;
+    }else{
+        shard->parked_head = cookie_id;
     }
-    else if (strncmp(curr, "POST ", 5) == 0)
+    shard->parked_tail = cookie_id;
+    connection->parked = cookie_id;
+}
+
+/**
+ * Push a message into the mailbox of a shard and wake it up
+ * @param shard the receiving shard
+ * @param message the message, owned by the receiver afterwards
+ */
+static void deliver(Shard *shard, Message *message){
+    uint64_t one = 1;
+    mailbox_push(&shard->mailbox, message);
+    if (write(shard->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
     {
-        curr += 5;
-        method = POST;
+        perror("write");
     }
-    else if (write(sockfd, HTTP_400, HTTP_400_LENGTH) < 0)
+}
+
+/**
+ * Send a message to a shard of this node or, through the links, of another
+ * @param shard_id the receiving shard, node * NODE_SHARDS + its id
+ * @param message the message, owned by the receiver afterwards
+ */
+void send_message(int shard_id, Message *message){
+    if (shard_id / NODE_SHARDS != peers.node)
     {
-        perror("write");
-        return false;
+        peers_send(&peers, shard_id, message);
+        return;
     }
-    // sanitise the URI
-    while (*curr == '.' || *curr == '/' || *curr == '?')
-        ++curr;
-    // assume the only valid request URI is "/" but it can be modified to accept more files
-    if (*curr == ' '){
-        if(method == GET && cookie_id < 0){
-            strcpy(html_name, "1_intro.html");
-        }else{
-            strcpy(html_name, "2_start.html");
-        }
-    }
-    else if(strncmp(curr, "start", 5) == 0){
-        // game state
-        if (method == GET || !strcmp(user_data[cookie_id].stage, "6_endgame.html")){
-            strcpy(html_name, "3_first_turn.html");
-            //start a game, try to pair other player, set image index to player
-            user_data[cookie_id].image_index = image_index;
-            initialise_status(user_data, cookie_id);
-            pairing(user_data, cookie_id, index);
-        }else{
-            //Try to pair other player
-            if (pairing(user_data, cookie_id, index)){
-                //Successfully pair, input will be accepted
-                strcpy(html_name, "4_accepted.html");
-            }
-            //If other player win/leave, direct player to end game
-            else if(!strcmp(user_data[cookie_id].stage, "4_accepted.html") &&
-                     user_data[cookie_id].other_index < 0){
-                initialise_status(user_data, cookie_id);
-                strcpy(html_name, "6_endgame.html");
-                method_GET(sockfd, buff, html_name, user_data, &image_index);
-            }
-            // pairing failed, input discarded
-            else if(user_data[cookie_id].other_index < 0){
-                strcpy(html_name, "5_discarded.html");
-            }
-        }
+    deliver(&shards[shard_id % NODE_SHARDS], message);
+}
+
+/**
+ * Copy the players of a shard for the saver thread, which writes them to
+ * the snapshot file of the shard
+ * @param shard the shard
+ */
+static void save_state(Shard *shard){
+    Snapshot snapshot;
+    shard->saved_at = session_now();
+    if (session_store_snapshot(&shard->sessions, num_shards, &snapshot) < 0){
+        perror("snapshot");
+        return;
     }
-        // send 404
-    else if (write(sockfd, HTTP_404, HTTP_404_LENGTH) < 0)
+    pthread_mutex_lock(&saver_lock);
+    free(unsaved[shard->id].data);
+    unsaved[shard->id] = snapshot;
+    pthread_cond_signal(&saver_ready);
+    pthread_mutex_unlock(&saver_lock);
+}
+
+/**
+ * The saver thread, writes the snapshots of the shards so no shard waits
+ * for the disk, and every one left once it is told to stop
+ * @param arg unused
+ * @return NULL
+ */
+static void* saver_main(void *arg)
+{
+    pthread_mutex_lock(&saver_lock);
+    for (;;)
     {
-        perror("write");
-        return false;
+        int shard_id = -1;
+        for (int i = 0; i < num_shards && shard_id < 0; i++)
+        {
+            if (unsaved[i].data != NULL){ shard_id = i; }
+        }
+        if (shard_id < 0)
+        {
+            if (saver_stopping){ break; }
+            pthread_cond_wait(&saver_ready, &saver_lock);
+            continue;
+        }
+        Snapshot snapshot = unsaved[shard_id];
+        unsaved[shard_id].data = NULL;
+        pthread_mutex_unlock(&saver_lock);
+        char path[32];
+        snprintf(path, sizeof(path), STATE_FILE, shard_id);
+        if (session_snapshot_write(&snapshot, path) < 0)
+        {
+            perror(path);
+        }
+        free(snapshot.data);
+        pthread_mutex_lock(&saver_lock);
     }
-    if (method == GET) {
-        method_GET(sockfd, buff, html_name, user_data, &image_index);
-    }else if (method == POST)
+    pthread_mutex_unlock(&saver_lock);
+    return NULL;
+}
+
+/**
+ * Apply one message from another shard, the game core applies those about
+ * the game
+ * @param shard the receiving shard
+ * @param message the message
+ */
+static void handle_message(Shard *shard, Message *message){
+    Connection *connection;
+    switch (message->type)
     {
-        method_POST(sockfd, buff, html_name, user_data, &index, &image_index);
-    }else {
-        // never used, just for completeness
-        fprintf(stderr, "no other methods supported");
+        case MSG_CONNECTION:
+            // a connection of one of our players, serve what it buffered
+            connection = message->connection;
+            connection->owner = shard;
+            connection->metrics = &shard->metrics;
+            connection->log = shard->log;
+            if (event_loop_add(shard->loop, connection->fd, EVENT_READ,
+                               handle_client, connection) < 0)
+            {
+                log_event(shard->log, LOG_ERROR, connection->fd, errno,
+                          ORIGIN_EVENT_LOOP, 0, 0);
+                connection->owner = NULL;
+                connection_close(NULL, connection);
+                break;
+            }
+            watch_connection(shard, connection);
+            serve_requests(shard, connection);
+            break;
+        case MSG_SHUTDOWN:
+            // new connections wait in the listen queue for the next process,
+            // the requests already read are answered until the next tick
+            event_loop_remove(shard->loop, shard->listenfd);
+            shard->stopping = true;
+            break;
+        default:
+            game_message(shard, message);
+            break;
     }
-    return true;
+    publish_state(shard);
 }
 
 /**
- * Get request handle function
- * @param sockfd socket file descriptor
- * @param buff the buff that read http request
- * @param html_name the name of html file is going to send
- * @param user_data all users' data
- * @param image_index  The index of image that server sending
- * @return int 0 for the html file is successfully sent, 1 otherwise
+ * Event handler of the timerfd, answer the polls that waited long enough
+ * and fire the timers due
+ * @param loop the event loop
+ * @param fd the timerfd
+ * @param events the events that fired
+ * @param data the shard
  */
-int method_GET(int sockfd,char *buff, char *html_name, User_data *user_data,
-               char *image_index){
-    // get the size of the file
-    struct stat st;
-    stat(html_name, &st);
-    long size = st.st_size;
-    char added_text[TEXT_SIZE];
-    int added_text_length = 0;
-    int cookie_id = read_cookie(buff);
-    if(cookie_id >= 0){
-        strcpy(user_data[cookie_id].stage,html_name);
-    }
-    //update the size of the file
-    //username may need to be inserted to start.html
-    if(!strcmp(html_name,"2_start.html")){
-        sprintf(added_text, INSERT_TEXT, user_data[cookie_id].username);
-        added_text_length = strlen(added_text);
-        size = size + added_text_length;
-    }
-
-    int n = sprintf(buff, HTTP_200_FORMAT, cookie_id, size);
-    // send the header first
-    if (write(sockfd, buff, n) < 0) {
-        perror("write");
-        return 1;
-    }
-    // read html file to the buffer
-    int filefd = open(html_name, O_RDONLY);
-    n = read(filefd, buff, BUFF_SIZE);
-    if (n < 0) {
+static void handle_sweep(Event_loop *loop, int fd, unsigned events, void *data)
+{
+    Shard *shard = data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
         perror("read");
-        close(filefd);
-        return 1;
-    }
-    close(filefd);
-    //dynamically edit html file and insert username
-    if(!strcmp(html_name,"2_start.html")){
-        char *p1 = strstr(buff, "<form method=");
-        size_t len = strlen(buff) - strlen(p1);
-        char new_buff[BUFF_SIZE + added_text_length];
-        strncpy(new_buff, buff, len);
-        new_buff[len] = '\0';
-        strcat(new_buff,added_text);
-        strcat(new_buff,p1);
-        if (write(sockfd, new_buff, size) < 0)
-        {
-            perror("write");
-            return false;
-        }
-        return 0;
     }
-    if(!strcmp(html_name,"3_first_turn.html") ||
-       !strcmp(html_name,"5_discarded.html")){
-        image_controller(buff, image_index);
+    if (shard->stopping)
+    {
+        // the players are picked up again by the next process
+        save_state(shard);
+        event_loop_stop(loop);
+        return;
+    }
+    Session_store *sessions = &shard->sessions;
+    uint32_t now = session_now();
+    // every poll waits as long, the longest parked is at the head
+    while (shard->parked_head >= 0 &&
+           now - session_data(sessions, shard->parked_head)->parked_at >=
+           POLL_TIMEOUT)
+    {
+        answer_poll(shard, shard->parked_head);
     }
-    if (write(sockfd, buff, size) < 0) {
-        perror("write");
-        return 1;
+    // the writer of the tag store has no ring, the first shard logs for it
+    uint64_t failures = metric_get(&tags.failures);
+    if (shard->id == 0 && failures != tag_failures_seen)
+    {
+        tag_failures_seen = failures;
+        log_event(shard->log, LOG_ERROR, -1,
+                  __atomic_load_n(&tags.error, __ATOMIC_RELAXED),
+                  ORIGIN_TAG_STORE, 0, metric_get(&tags.lost));
+    }
+    timer_wheel_advance(&shard->connection_timers, now);
+    timer_wheel_advance(&shard->session_timers, now);
+    metric_set(&shard->metrics.oldest_wait,
+               matchmaker_oldest_wait(&shard->matchmaker, sessions));
+    publish_state(shard);
+    // a crash loses at most the last interval
+    if (now - shard->saved_at >= SNAPSHOT_INTERVAL)
+    {
+        save_state(shard);
     }
-    return 0;
 }
 
 /**
- * Post request handle function
- * @param sockfd socket file descriptor
- * @param buff the buff that read http request
- * @param html_name the name of html file is going to send
- * @param user_data all users' data
- * @param index the number of users registered in the server
- * @param image_index The index of image that server sending
- * @return Boolean true for the html file is successfully sent, false otherwise
+ * Event handler of the mailbox eventfd, drain every pending message
+ * @param loop the event loop
+ * @param fd the eventfd
+ * @param events the events that fired
+ * @param data the shard
  */
-bool method_POST(int sockfd,char *buff, char *html_name,
-                 User_data *user_data, int *index, char *image_index){
-    char *post_message = NULL;
-    char *p1;
-    int cookie_id = read_cookie(buff);
-    int n = 0;
-    //"user=" is an indicator of creating a new user
-    if(strstr(buff,"user=")){
-        p1 = strstr(buff,"user=") + 5;
-        post_message = p1;
-        // add a new user and initialise data;
-        strcpy(user_data[*index].username, post_message);
-        cookie_id = *index;
-        user_data[cookie_id].num_keywords = 0;
-        user_data[cookie_id].other_index = -1;
-        user_data[cookie_id].image_index = *image_index;
-        initialise_status(user_data, cookie_id);
-        *index = *index + 1;
-    }
-    // player inputs keyword
-    else if (strstr(buff,"keyword=")){
-        post_message = extract_message(buff, "keyword=","&guess=");
-        //keyword was submitted by other previously
-        if (keyword_match(user_data, cookie_id, post_message)){
-            //switch image index on the server
-            if(*image_index == '2'){
-                *image_index = '1';
-            }else{
-                *image_index = '2';
-            }
-            initialise_status(user_data, cookie_id);
-            method_GET(sockfd, buff, "6_endgame.html", user_data, image_index);
-            return true;
-        }else if(!strcmp(html_name,"5_discarded.html")){
-            method_GET(sockfd, buff, "5_discarded.html", user_data, image_index);
-            return true;
-        }
-        //put keyword into list
-        store_keyword(user_data,cookie_id, post_message);
-        //sting that contains all keyword input by a player
-        post_message = all_keywords(user_data, cookie_id);
-    }
-    // qui game, send game over page and exit
-    else if(strstr(buff, "quit=")){
-        initialise_status(user_data, cookie_id);
-        method_GET(sockfd, buff, "7_gameover.html", user_data, image_index);
-        return true;
-    }
-    //update player stage
-    strcpy(user_data[cookie_id].stage, html_name);
-    char added_text[TEXT_SIZE];
-    sprintf(added_text, INSERT_TEXT, post_message);
-    int added_text_length = strlen(added_text);
-    // get the size of the file
-    struct stat st;
-    stat(html_name, &st);
-    // increase file size to accommodate the username
-    long size = st.st_size + added_text_length;
-    n = sprintf(buff, HTTP_200_FORMAT, cookie_id, size);
-    // send the header first
-    if (write(sockfd, buff, n) < 0)
+static void handle_mailbox(Event_loop *loop, int fd, unsigned events, void *data)
+{
+    Shard *shard = data;
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
     {
-        perror("write");
-        return false;
+        perror("read");
     }
-    // read the content of the HTML file
-    int filefd = open(html_name, O_RDONLY);
-    n = read(filefd, buff, BUFF_SIZE);
-    if (n < 0)
+    Message *message;
+    while ((message = mailbox_pop(&shard->mailbox)) != NULL)
     {
-        perror("read");
-        close(filefd);
-        return false;
+        handle_message(shard, message);
+        message_free(message);
+    }
+}
+
+/**
+ * Close a client connection, a parked connection leaves the waiting list
+ * first
+ * @param shard the shard serving the connection
+ * @param connection the client connection
+ */
+static void drop_client(Shard *shard, Connection *connection){
+    if (connection->parked >= 0){
+        unpark(shard, connection->parked);
     }
-    close(filefd);
-    //dynamically edit html and insert text
-    char *buff_split = strstr(buff, "<form method=");
-    size_t len = strlen(buff) - strlen(buff_split);
-    char new_buff[BUFF_SIZE + added_text_length];
-    strncpy(new_buff, buff, len);
-    new_buff[len] = '\0';
+    connection_close(shard->loop, connection);
+}
 
-    strcat(new_buff,added_text);
-    strcat(new_buff,buff_split);
-    //control which image is shown
-    if(!strcmp(html_name,"4_accepted.html")){
-        image_controller(new_buff, image_index);
+/**
+ * The second the timer of a connection next has to look at it: a parked
+ * poll is answered by the poll timeout, a response waiting for the client
+ * and an idle connection need progress, a request that started has to
+ * arrive in time
+ * @param connection the connection
+ * @param now the current second
+ * @return uint32_t the second
+ */
+static uint32_t connection_deadline(Connection const *connection,
+                                    uint32_t now)
+{
+    if (connection->parked >= 0)
+    {
+        return now + CONNECTION_IDLE;
     }
-    if (write(sockfd, new_buff, size) < 0)
+    if (connection_pending(connection) || !connection_buffered(connection))
     {
-        perror("write");
-        return false;
+        return connection->active_at + CONNECTION_IDLE;
     }
-    return true;
+    return connection->request_at + REQUEST_DEADLINE;
 }
 
 /**
- * Read cookie function
- * @param buff the buff that read http request
- * @return int index of user_data list that
- *             store a particular user's data (also called ID)
+ * Make sure the timer of a connection fires by its deadline, it is only
+ * moved earlier
+ * @param shard the shard serving the connection
+ * @param connection the connection
  */
-int read_cookie(char *buff){
-    char *index;
-    //if the http request doesn't contain Cookie, return -1
-    if(strstr(buff, "Cookie: ") == NULL){ return -1; }
-    index = extract_message(buff,"id=", "\r\n");
-    return atoi(index);
+static void watch_connection(Shard *shard, Connection *connection)
+{
+    Timer *timer = &connection->timer;
+    uint32_t deadline = connection_deadline(connection, session_now());
+    if (!timer_armed(timer) || (int32_t)(timer->expires - deadline) > 0)
+    {
+        timer->id = connection->fd;
+        timer_arm(&shard->connection_timers, timer, deadline);
+    }
 }
 
 /**
- * Extract message(substring) between two positions
- * @param str a string contains all message
- * @param start position 1, start from
- * @param end   position 2, end.
- * @return  a substring between position 1 and 2.
+ * Handler of the timer of a connection, close it if idle or too slow to
+ * send its request, which also frees the fd of a peer that went away
+ * @param wheel the connection wheel of the shard
+ * @param timer the timer of the connection
+ * @param data the shard
  */
-char* extract_message(char *str, char *start, char *end){
-    char *p1 = strstr(str, start) + strlen(start);
-    char *p2 = strstr(p1, end);
-    long len = p2 - p1;
-    char *substr = (char *) malloc(len + 1);
-    if (p1 == NULL || p2 == NULL){
-        substr[0] = '\0';
-        return substr;
-    }
-    strncpy(substr, p1, len);
-    substr[len] = '\0';
-    return substr;
+static void expire_connection(Timer_wheel *wheel, Timer *timer, void *data)
+{
+    Shard *shard = data;
+    Connection *connection = (Connection *)((char *)timer -
+                                            offsetof(Connection, timer));
+    uint32_t deadline = connection_deadline(connection, wheel->now);
+    if ((int32_t)(deadline - wheel->now) > 0)
+    {
+        timer_arm(wheel, timer, deadline);
+        return;
+    }
+    bool slow = !connection_pending(connection) &&
+                connection_buffered(connection);
+    metric_add(&shard->metrics.timeouts[slow ? TIMEOUT_REQUEST : TIMEOUT_IDLE],
+               1);
+    drop_client(shard, connection);
 }
 
 /**
- * Store keyword into particular user's keyword list
- * @param user_data all users' data
- * @param cookie_id ID of a particular user's data
- * @param keyword   keyword input by player
+ * The monotonic clock in microseconds
+ * @return uint64_t the time
  */
-void store_keyword(User_data *user_data, int cookie_id, char *keyword){
-    int n = user_data[cookie_id].num_keywords;
-    strcpy(user_data[cookie_id].keyword[n], keyword);
-    user_data[cookie_id].num_keywords++;
-    return;
+static uint64_t now_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
 /**
- * a toString function of keyword list
- * @param user_data all users' data
- * @param cookie_id ID of a particular user's data
- * @return  char* a string of all keywords input by a player in each turn
+ * Serve every complete request buffered on a connection, in order, while
+ * the responses leave without queueing and it is not parked
+ * @param shard the shard serving the connection
+ * @param connection the client connection
  */
-char* all_keywords(User_data *user_data, int cookie_id){
-    int n = user_data[cookie_id].num_keywords;
-    if(n <= 1){
-        return user_data[cookie_id].keyword[0];
-    }else{
-        char* str = malloc(TEXT_SIZE_S);
-        strcpy(str, user_data[cookie_id].keyword[0]);
-        for (int i = 1; i < n ; i++ ){
-            strcat(str,", ");
-            strcat(str,user_data[cookie_id].keyword[i]);
+static void serve_requests(Shard *shard, Connection *connection)
+{
+    while (!connection_pending(connection) && !connection->closing &&
+           connection->parked < 0)
+    {
+        int result = connection_next_request(connection);
+        if (result == HTTP_INCOMPLETE)
+        {
+            break;
+        }
+        if (result < 0)
+        {
+            // the rest of the stream can not be delimited, answer and close
+            Response response = {.arena = &connection->arena};
+            metrics_request(&shard->metrics, ROUTE_BAD, UNKNOWN, 0);
+            log_event(shard->log, LOG_REQUEST, connection->fd, ROUTE_BAD,
+                      UNKNOWN, 0, UINT64_MAX);
+            if (!game_reject(&response, result) ||
+                connection_send(shard->loop, connection, response.iov,
+                                response.iovcnt) < 0)
+            {
+                connection_close(shard->loop, connection);
+                return;
+            }
+            connection->closing = true;
+            break;
+        }
+        Http_request *request = &connection->request;
+        // a player registered on another shard is served by that shard
+        if (request->cookie >= 0 && cookie_shard(request->cookie) != shard->id)
+        {
+            Message *message = message_create(MSG_CONNECTION, NULL, 0);
+            if (message != NULL)
+            {
+                event_loop_remove(shard->loop, connection->fd);
+                timer_cancel(&connection->timer);
+                message->connection = connection;
+                deliver(&shards[cookie_shard(request->cookie)], message);
+                return;
+            }
+        }
+        Response response = {.arena = &connection->arena};
+        uint64_t start = now_us();
+        // a client over its rate is turned away before the game sees it
+        Slice rest;
+        ROUTE route = game_route(request, &rest);
+        if (!rate_limit_take(&shard->limiter, route, connection->address,
+                             read_slot(shard, request), start / 1000))
+        {
+            struct iovec iov = {(void *)HTTP_429, HTTP_429_LENGTH};
+            metric_add(&shard->metrics.throttled[route], 1);
+            log_event(shard->log, LOG_REQUEST, connection->fd, route,
+                      request->method, now_us() - start,
+                      request->cookie < 0 ? UINT64_MAX : request->cookie);
+            if (connection_send(shard->loop, connection, &iov, 1) < 0)
+            {
+                connection_close(shard->loop, connection);
+                return;
+            }
+            if (!request->keep_alive)
+            {
+                connection->closing = true;
+            }
+            connection_consume(connection);
+            connection->request_at = connection->active_at;
+            continue;
+        }
+        bool served = game_request(shard, request, &response);
+        if (served && response.park >= 0)
+        {
+            park(shard, connection, response.park);
+        }
+        else if (served)
+        {
+            served = connection_send(shard->loop, connection, response.iov,
+                                     response.iovcnt) == 0;
+            // the connection owns the file or stream from here, even if it
+            // failed
+            if (response.file != NULL && !served)
+            {
+                file_release(response.file);
+            }
+            else if (response.file != NULL)
+            {
+                served = connection_send_file(shard->loop, connection,
+                                              response.file,
+                                              response.file_offset,
+                                              response.file_length) == 0;
+            }
+            if (response.stream.fill != NULL && !served)
+            {
+                response.stream.release(response.stream.state);
+            }
+            else if (response.stream.fill != NULL)
+            {
+                served = connection_send_stream(shard->loop, connection,
+                                                &response.stream) == 0;
+            }
+        }
+        uint64_t latency = now_us() - start;
+        metrics_request(&shard->metrics, response.route, request->method,
+                        latency);
+        log_event(shard->log, LOG_REQUEST, connection->fd, response.route,
+                  request->method, latency,
+                  request->cookie < 0 ? UINT64_MAX : request->cookie);
+        if (!served)
+        {
+            connection_close(shard->loop, connection);
+            return;
+        }
+        if (!request->keep_alive)
+        {
+            connection->closing = true;
         }
-        return str;
+        connection_consume(connection);
+        // a pipelined request arrived with the last read at the latest
+        connection->request_at = connection->active_at;
+    }
+    if (connection->closing && !connection_pending(connection) &&
+        connection->parked < 0)
+    {
+        connection_close(shard->loop, connection);
     }
 }
 
 /**
- * Pairing two player
- * @param user_data all users' data
- * @param cookie_id ID of a particular user's data
- * @param index the number of users registered in the server
- * @return 1 for a player has been successfully paired, 0 otherwise
+ * Event handler of a client socket, a request is sent from the client or
+ * the socket can take more of a queued response
+ * @param loop the event loop
+ * @param fd the client socket
+ * @param events the events that fired
+ * @param data the connection
  */
-int pairing(User_data *user_data, int cookie_id, int index){
-    //all un-paired players are initialise as -1
-    // exit if a player is already paired
-    if(user_data[cookie_id].other_index != -1){ return 1; }
-    //loop all other players
-    for (int i = 0; i < index; i++){
-        // pair condition: not itself and other player is un-paired
-        if(i != cookie_id && user_data[i].other_index == -1){
-            //pair condition: same image index (same image shown in the game)
-            if(user_data[i].image_index == user_data[cookie_id].image_index) {
-                //pair condition: player is currently at first_turn page
-                //or discarded page
-                if (!(strcmp(user_data[i].stage, "3_first_turn.html")
-                      && strcmp(user_data[i].stage, "5_discarded.html"))) {
-                    user_data[cookie_id].other_index = i;
-                    user_data[i].other_index = cookie_id;
-                    return 1;
-                }
-            }
+static void handle_client(Event_loop *loop, int fd, unsigned events, void *data)
+{
+    Connection *connection = data;
+    Shard *shard = connection->owner;
+    if ((events & EVENT_WRITE) && connection_flush(loop, connection) < 0)
+    {
+        drop_client(shard, connection);
+        return;
+    }
+    uint32_t now = session_now();
+    if (events & EVENT_WRITE)
+    {
+        connection->active_at = now;
+    }
+    // the previous response has to leave before the next request is read
+    if ((events & EVENT_READ) && !connection_pending(connection))
+    {
+        bool started = !connection_buffered(connection);
+        int n = connection_read(connection);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            if (n < 0)
+                log_event(shard->log, LOG_ERROR, fd, errno, ORIGIN_READ, 0, 0);
+            drop_client(shard, connection);
+            return;
+        }
+        if (n > 0)
+        {
+            connection->active_at = now;
+        }
+        // a request has REQUEST_DEADLINE to arrive from its first byte
+        if (n > 0 && started)
+        {
+            connection->request_at = now;
+            watch_connection(shard, connection);
         }
     }
-    return 0;
+    serve_requests(shard, connection);
+    publish_state(shard);
 }
 
 /**
- * check a freshly input keyword if submitted by paired player
- * @param user_data all users' data
- * @param cookie_id ID of a particular user's data
- * @param keyword keyword input by player
- * @return Boolean true if keyword found, false otherwise
+ * Count the connections open on every shard, a connection handed to
+ * another shard is closed there so only the sum is exact
+ * @return int the connections open
  */
-bool keyword_match(User_data *user_data, int cookie_id, char *keyword){
-    int other_index = user_data[cookie_id].other_index;
-    //exit if self is un-paired
-    if (other_index < 0){
-        return false;
-    }else{
-        int n = user_data[other_index].num_keywords;
-        for (int i = 0; i < n; i++){
-            if(!strcmp(keyword, user_data[other_index].keyword[i])){
-                return true;
-            }
-        }
+static int open_connections(void)
+{
+    uint64_t open = 0;
+    for (int i = 0; i < num_shards; i++)
+    {
+        open += metric_get(&shards[i].metrics.connections_opened) -
+                metric_get(&shards[i].metrics.connections_closed);
     }
-    return false;
+    return (int)open;
 }
 
 /**
- * Initialise pairing status and number of keywords
- * @param user_data all users' data
- * @param cookie_id ID of a particular user's data
+ * Turn a connection away while the server is saturated, it costs one read
+ * and one write and never reaches the event loop
+ * @param shard the shard that accepted it
+ * @param fd the socket
+ * @param peer the address of the client
  */
-void initialise_status(User_data *user_data, int cookie_id){
-    int other = user_data[cookie_id].other_index;
-    // initialise player status
-    user_data[cookie_id].other_index = -1;
-    user_data[cookie_id].num_keywords = 0;
-    // initialise paired player status, if self was paired before
-    if(other >= 0){
-        user_data[other].other_index = -1;
-        user_data[other].num_keywords = 0;
-    }
-    return;
+static void shed_connection(Shard *shard, int fd,
+                            struct sockaddr_in const *peer)
+{
+    log_event(shard->log, LOG_SHED, fd, 0, peer->sin_addr.s_addr,
+              peer->sin_port, 0);
+    // closing over unread bytes resets the connection before the client
+    // reads the answer, the request is usually here already
+    char discard[SHED_DRAIN];
+    if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) >= 0)
+    {
+        send(fd, HTTP_503_BUSY, HTTP_503_BUSY_LENGTH,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(fd);
+    metric_add(&shard->metrics.connections_shed, 1);
 }
 
 /**
- * Handle which image should be sent by server
- * @param buff the buffer that read the html file is about to send
- * @param image_index The index of image that server sending
- * @return a modifier buffer that store html file
+ * Event handler of the listening socket, create new socket if there is
+ * new incoming connection request
+ * @param loop the event loop
+ * @param fd the listening socket
+ * @param events the events that fired
+ * @param data the shard
  */
-char* image_controller(char *buff, char *image_index){
-    //char image_index = user_data[cookie_id].image_index;
-    char *p1 = strstr(buff,"image-") + strlen("image-");
-    if( p1 != NULL){
-        *(p1 + 0) = *image_index;
-        return buff;
-    }
-    return buff;
+static void handle_accept(Event_loop *loop, int fd, unsigned events, void *data)
+{
+    Shard *shard = data;
+    // the whole queue is taken in one wakeup, the count is read once as it
+    // sums every shard
+    int open = open_connections();
+    for (;;)
+    {
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int newsockfd = accept4(fd, (struct sockaddr *)&cliaddr, &clilen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0)
+        {
+            // a client may give up while queued
+            if (errno == ECONNABORTED || errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                log_event(shard->log, LOG_ERROR, -1, errno, ORIGIN_ACCEPT, 0,
+                          0);
+            }
+            return;
+        }
+        if (open >= max_connections)
+        {
+            shed_connection(shard, newsockfd, &cliaddr);
+            continue;
+        }
+        // add the socket to the loop
+        Connection *connection = connection_create(newsockfd, data);
+        if (connection == NULL ||
+            event_loop_add(loop, newsockfd, EVENT_READ, handle_client,
+                           connection) < 0)
+        {
+            log_event(shard->log, LOG_ERROR, newsockfd, errno,
+                      ORIGIN_EVENT_LOOP, 0, 0);
+            close(newsockfd);
+            free(connection);
+            continue;
+        }
+        open++;
+        connection->metrics = &shard->metrics;
+        connection->log = shard->log;
+        connection->address = cliaddr.sin_addr.s_addr;
+        connection->active_at = session_now();
+        watch_connection(shard, connection);
+        metric_add(&shard->metrics.connections_opened, 1);
+        log_event(shard->log, LOG_CONNECT, newsockfd, 0,
+                  cliaddr.sin_addr.s_addr, cliaddr.sin_port, 0);
+    }
 }
 
-
-int main(int argc, char * argv[])
+/**
+ * Set the admission options of a listening socket, again on one handed
+ * down by a restart as the limits may have changed
+ * @param sockfd the listening socket
+ */
+static void configure_listener(int sockfd)
 {
-
-    if (argc < 3)
+    // accepted in batches until the queue is empty
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    // a connection wakes the shard only once its request has arrived
+    int const defer = REQUEST_DEADLINE;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer,
+                   sizeof(int)) < 0)
     {
-        fprintf(stderr, "usage: %s ip port\n", argv[0]);
-        return 0;
+        perror("setsockopt");
+    }
+    // listen on the socket, a restart leaves connections queued here
+    if (listen(sockfd, backlog) < 0)
+    {
+        perror("listen");
+        exit(EXIT_FAILURE);
     }
+}
 
+/**
+ * Create the listening socket of a shard
+ * @param ip the address to listen on
+ * @param port the port to listen on
+ * @param reuseport true if several shards share the port
+ * @return int the socket
+ */
+static int create_listener(char *ip, char *port, bool reuseport)
+{
     // create TCP socket which only accept IPv4
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
@@ -556,14 +809,21 @@ int main(int argc, char * argv[])
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
+    // every shard binds the same port and the kernel spreads connections
+    if (reuseport &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) < 0)
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
 
     // create and initialise address we will listen on
     struct sockaddr_in serv_addr;
     bzero(&serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     // if ip parameter is not specified
-    serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    serv_addr.sin_port = htons(atoi(argv[2]));
+    serv_addr.sin_addr.s_addr = inet_addr(ip);
+    serv_addr.sin_port = htons(atoi(port));
 
     // bind address to socket
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
@@ -572,63 +832,455 @@ int main(int argc, char * argv[])
         exit(EXIT_FAILURE);
     }
 
-    // listen on the socket
-    listen(sockfd, 5);
+    configure_listener(sockfd);
+    return sockfd;
+}
+
+/**
+ * Take over the listening sockets handed down by a restart, connections
+ * they queued meanwhile are accepted as usual
+ * @param fds filled with the socket of every shard
+ * @return Boolean true if every shard got one
+ */
+static bool inherit_listeners(int *fds)
+{
+    char *list = getenv(LISTEN_FDS);
+    if (list == NULL)
+    {
+        return false;
+    }
+    int n = 0;
+    char *end;
+    while (*list != '\0' && n < MAX_SHARDS)
+    {
+        long fd = strtol(list, &end, 10);
+        if (end == list || fd < 0 || fd > INT32_MAX || fcntl(fd, F_GETFD) < 0)
+        {
+            break;
+        }
+        fds[n++] = fd;
+        list = *end == ',' ? end + 1 : end;
+    }
+    bool complete = n == num_shards && *list == '\0';
+    unsetenv(LISTEN_FDS);
+    // handed down for another number of shards, bind afresh
+    for (int i = 0; !complete && i < n; i++)
+    {
+        close(fds[i]);
+    }
+    return complete;
+}
+
+/**
+ * Check that the partner of a restored player names it back, the shards
+ * are saved at different moments and a partner on another node may have
+ * moved on meanwhile
+ * @param shard the shard that owns the player
+ * @param cookie_id ID of a particular user's data
+ * @return Boolean true if the pair is whole
+ */
+static bool partner_agrees(Shard *shard, int cookie_id)
+{
+    Session const *session = session_get(&shard->sessions, cookie_id);
+    int s = session->other_shard - peers.node * NODE_SHARDS;
+    if (s < 0 || s >= num_shards ||
+        session->other_index >= shards[s].sessions.count)
+    {
+        return false;
+    }
+    Session const *other = session_get(&shards[s].sessions,
+                                       session->other_index);
+    return other->in_use && other->other_index == cookie_id &&
+           other->other_shard == shard_address(shard);
+}
 
-    // initialise an active file descriptors set
-    fd_set masterfds;
-    FD_ZERO(&masterfds);
-    FD_SET(sockfd, &masterfds);
-    // record the maximum socket number
-    int maxfd = sockfd;
+/**
+ * Order two (queued_at, slot) keys
+ * @param a the first key
+ * @param b the second key
+ * @return int negative, zero or positive as for qsort
+ */
+static int compare_waits(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
 
-    while (1)
+/**
+ * Load the snapshot of every shard before any shard runs, and rebuild what
+ * is not saved: the waiting queues, oldest first, and the counters
+ */
+static void restore_players(void)
+{
+    for (int i = 0; i < num_shards; i++)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), STATE_FILE, i);
+        if (session_store_load(&shards[i].sessions, path, num_shards) < 0 &&
+            errno != ENOENT)
+        {
+            fprintf(stderr, "%s: %s, its players are not restored\n", path,
+                    strerror(errno));
+        }
+    }
+    // a pair only one side of which was saved is ended
+    for (int i = 0; i < num_shards; i++)
+    {
+        Session_store *sessions = &shards[i].sessions;
+        for (int slot = 0; slot < sessions->count; slot++)
+        {
+            Session *session = session_get(sessions, slot);
+            if (!session->in_use)
+            {
+                continue;
+            }
+            if (session->image_index >= catalog.count)
+            {
+                session->image_index = -1;
+            }
+            if (session->other_index >= 0 && !partner_agrees(&shards[i], slot))
+            {
+                session->other_index = -1;
+                keyword_set_clear(&session_data(sessions, slot)->keywords);
+                keyword_set_clear(
+                        &session_data(sessions, slot)->partner_keywords);
+            }
+        }
+    }
+    for (int i = 0; i < num_shards; i++)
     {
-        // monitor file descriptors
-        fd_set readfds = masterfds;
-        if (select(FD_SETSIZE, &readfds, NULL, NULL, NULL) < 0)
+        Shard *shard = &shards[i];
+        Session_store *sessions = &shard->sessions;
+        uint64_t *waits = malloc(sessions->count * sizeof(uint64_t) + 1);
+        if (waits == NULL)
         {
-            perror("select");
+            perror("malloc");
             exit(EXIT_FAILURE);
         }
-
-        // loop all possible descriptor
-        for (int i = 0; i <= maxfd; ++i)
-            // determine if the current file descriptor is active
-            if (FD_ISSET(i, &readfds))
+        int num_waits = 0;
+        for (int slot = 0; slot < sessions->count; slot++)
+        {
+            Session *session = session_get(sessions, slot);
+            shard->paired += session->in_use && session->other_index >= 0;
+            if (is_waiting(session))
+            {
+                waits[num_waits++] = (uint64_t)session->queued_at << 32 | slot;
+            }
+        }
+        qsort(waits, num_waits, sizeof(uint64_t), compare_waits);
+        for (int n = 0; n < num_waits; n++)
+        {
+            int slot = (int)(waits[n] & 0xffffffff);
+            // oldest first, so moving the second back keeps the heads of
+            // the queues in order
+            update_queue(shard, slot);
+            session_get(sessions, slot)->queued_at = waits[n] >> 32;
+        }
+        // offers lost in flight are made again
+        for (int n = 0; n < num_waits; n++)
+        {
+            int slot = (int)(waits[n] & 0xffffffff);
+            if (session_get(sessions, slot)->queue >= 0)
+            {
+                pairing(shard, slot);
+            }
+        }
+        for (int slot = 0; slot < sessions->count; slot++)
+        {
+            if (session_get(sessions, slot)->in_use)
             {
-                // create new socket if there is new incoming connection request
-                if (i == sockfd)
-                {
-                    struct sockaddr_in cliaddr;
-                    socklen_t clilen = sizeof(cliaddr);
-                    int newsockfd = accept(sockfd, (struct sockaddr *)&cliaddr, &clilen);
-                    if (newsockfd < 0)
-                        perror("accept");
-                    else
-                    {
-                        // add the socket to the set
-                        FD_SET(newsockfd, &masterfds);
-                        // update the maximum tracker
-                        if (newsockfd > maxfd)
-                            maxfd = newsockfd;
-                        // print out the IP and the socket number
-                        char ip[INET_ADDRSTRLEN];
-                        printf(
-                                "new connection from %s on socket %d\n",
-                                // convert to human readable string
-                                inet_ntop(cliaddr.sin_family, &cliaddr.sin_addr, ip, INET_ADDRSTRLEN),
-                                newsockfd
-                        );
-                    }
-                }
-                    // a request is sent from the client
-                else if (!handle_http_request(i))
-                {
-                    close(i);
-                    FD_CLR(i, &masterfds);
-                }
+                watch_session(shard, slot);
             }
+        }
+        free(waits);
+        publish_state(shard);
+        shard->saved_at = session_now();
+    }
+}
+
+/**
+ * Stop every shard, each stops accepting, answers what it has read and
+ * saves its players, and wait for the saver to write them
+ */
+static void stop_shards(void)
+{
+    for (int i = 0; i < num_shards; i++)
+    {
+        Message *message = message_create(MSG_SHUTDOWN, NULL, 0);
+        if (message == NULL)
+        {
+            perror("message_create");
+            exit(EXIT_FAILURE);
+        }
+        deliver(&shards[i], message);
+    }
+    for (int i = 0; i < num_shards; i++)
+    {
+        pthread_join(shards[i].thread, NULL);
+    }
+    // the last snapshots are on disk before the process goes
+    pthread_mutex_lock(&saver_lock);
+    saver_stopping = true;
+    pthread_cond_signal(&saver_ready);
+    pthread_mutex_unlock(&saver_lock);
+    pthread_join(saver, NULL);
+}
+
+/**
+ * Replace the process by a fresh run of the program, which may be a new
+ * build, handing it the listening sockets so no connection is refused
+ * @param argv the arguments the server was started with
+ */
+static void restart(char *argv[])
+{
+    char list[MAX_SHARDS * 12];
+    int length = 0;
+    for (int i = 0; i < num_shards; i++)
+    {
+        fcntl(shards[i].listenfd, F_SETFD, 0);
+        length += snprintf(list + length, sizeof(list) - length, "%s%d",
+                           i > 0 ? "," : "", shards[i].listenfd);
+    }
+    setenv(LISTEN_FDS, list, 1);
+    execvp(argv[0], argv);
+    perror("execvp");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * The worker thread of a shard
+ * @param arg the shard
+ * @return NULL
+ */
+static void* shard_main(void *arg)
+{
+    Shard *shard = arg;
+    if (event_loop_run(shard->loop) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+/**
+ * Keep the connection limit within the descriptors the process may open,
+ * raising the soft limit as far as allowed, so accept never fails for
+ * lack of one and the excess is shed instead
+ */
+static void limit_connections(void)
+{
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) < 0)
+    {
+        return;
+    }
+    // every shard keeps images open too, and every other node takes a link
+    // each way
+    int reserve = FD_RESERVE + num_shards * FILE_CACHE_SIZE + 2 * MAX_NODES;
+    rlim_t wanted = (rlim_t)max_connections + reserve;
+    if (files.rlim_cur < wanted)
+    {
+        files.rlim_cur = wanted < files.rlim_max ? wanted : files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        getrlimit(RLIMIT_NOFILE, &files);
+    }
+#ifdef EVENT_USE_SELECT
+    // select() can not watch a descriptor beyond FD_SETSIZE
+    files.rlim_cur = files.rlim_cur < FD_SETSIZE ? files.rlim_cur : FD_SETSIZE;
+#endif
+    if (files.rlim_cur < wanted)
+    {
+        max_connections = files.rlim_cur > 2 * (rlim_t)reserve ?
+                          (int)files.rlim_cur - reserve : FD_RESERVE;
+        fprintf(stderr, "connections limited to %d by the open file limit\n",
+                max_connections);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s ip port [workers] [max_connections] "
+                "[backlog]\n", argv[0]);
+        return 0;
+    }
+    if (argc > 3)
+    {
+        num_shards = atoi(argv[3]);
+        if (num_shards < 1 || num_shards > MAX_SHARDS)
+        {
+            fprintf(stderr, "workers must be between 1 and %d\n", MAX_SHARDS);
+            return 0;
+        }
+    }
+    if (argc > 4)
+    {
+        max_connections = atoi(argv[4]);
+        if (max_connections < 1)
+        {
+            fprintf(stderr, "max_connections must be positive\n");
+            return 0;
+        }
+    }
+    if (argc > 5)
+    {
+        backlog = atoi(argv[5]);
+        if (backlog < 1)
+        {
+            fprintf(stderr, "backlog must be positive\n");
+            return 0;
+        }
+    }
+    limit_connections();
+
+    // a client that goes away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // stopping and restarting are left to the main thread, every thread
+    // started from here inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (tag_store_open(&tags, TAG_LOG, TAG_INDEX) < 0)
+    {
+        perror("tag store");
+        exit(EXIT_FAILURE);
+    }
+    if (event_log_open(&events, EVENT_LOG, num_shards) < 0)
+    {
+        perror("event log");
+        exit(EXIT_FAILURE);
+    }
+    if (catalog_load(&catalog, IMAGE_MANIFEST, &tags) < 0)
+    {
+        perror(IMAGE_MANIFEST);
+        exit(EXIT_FAILURE);
+    }
+    if (rate_limits_load(rate_limits, RATE_LIMITS) < 0)
+    {
+        perror(RATE_LIMITS);
+        exit(EXIT_FAILURE);
+    }
+    if (peers_load(&peers, PEERS) < 0)
+    {
+        perror(PEERS);
+        exit(EXIT_FAILURE);
+    }
+    // the pages link the images found locally to this server
+    catalog_localize(&catalog, IMAGE_DIR, IMAGE_PATH);
+
+    // every shard is set up before any starts, they message each other
+    shards = calloc(num_shards, sizeof(Shard));
+    if (shards == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    int listenfds[MAX_SHARDS];
+    bool inherited = inherit_listeners(listenfds);
+    for (int i = 0; i < num_shards; i++)
+    {
+        Shard *shard = &shards[i];
+        shard->id = i;
+        shard->log = &events.rings[i];
+        if (inherited)
+        {
+            shard->listenfd = listenfds[i];
+            configure_listener(shard->listenfd);
+        }
+        else
+        {
+            shard->listenfd = create_listener(argv[1], argv[2],
+                                              num_shards > 1);
+        }
+        shard->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        shard->timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+        shard->loop = event_loop_create();
+        // every cookie has to fit below the generation bits
+        session_store_init(&shard->sessions,
+                           (COOKIE_MASK - i) / num_shards + 1);
+        if (matchmaker_init(&shard->matchmaker, catalog.count) < 0)
+        {
+            perror("matchmaker_init");
+            exit(EXIT_FAILURE);
+        }
+        shard->parked_head = -1;
+        shard->parked_tail = -1;
+        timer_wheel_init(&shard->connection_timers, session_now(),
+                         expire_connection, shard);
+        timer_wheel_init(&shard->session_timers, session_now(),
+                         expire_session, shard);
+        struct itimerspec tick = {{1, 0}, {1, 0}};
+        if (templates_load(&shard->templates) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        file_cache_init(&shard->files, IMAGE_DIR);
+        shard->limiter.limits = rate_limits;
+        if (shard->wakefd < 0 || shard->timerfd < 0 || shard->loop == NULL ||
+            timerfd_settime(shard->timerfd, 0, &tick, NULL) < 0 ||
+            mailbox_init(&shard->mailbox) < 0 ||
+            event_loop_add(shard->loop, shard->listenfd, EVENT_READ,
+                           handle_accept, shard) < 0 ||
+            event_loop_add(shard->loop, shard->wakefd, EVENT_READ,
+                           handle_mailbox, shard) < 0 ||
+            event_loop_add(shard->loop, shard->timerfd, EVENT_READ,
+                           handle_sweep, shard) < 0)
+        {
+            perror("shard");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // pages can be edited while the server runs
+    if (templates_watch(shards[0].loop) < 0)
+    {
+        perror("inotify");
+    }
+
+    restore_players();
+
+    // the players are paired with those of the other nodes from now on
+    if (peers_start(&peers, catalog.count) < 0)
+    {
+        perror("peers");
+        exit(EXIT_FAILURE);
+    }
+
+    unsaved = calloc(num_shards, sizeof(Snapshot));
+    if (unsaved == NULL || pthread_create(&saver, NULL, saver_main, NULL))
+    {
+        perror("saver");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]))
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // SIGINT and SIGTERM stop the server, SIGUSR2 restarts it in place
+    int signal_number;
+    while (sigwait(&signals, &signal_number) != 0)
+    {
+    }
+    peers_stop(&peers);
+    stop_shards();
+    tag_store_flush(&tags);
+    event_log_close(&events);
+    if (signal_number == SIGUSR2)
+    {
+        restart(argv);
     }
 
     return 0;
@@ -0,0 +1,281 @@
+/*
+** Keyword sets of image-tagger
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyword_set.h"
+
+/** Define the initial size of the hash table */
+#define TABLE_SIZE 16
+
+/** Define the initial size of the list buffer */
+#define LIST_SIZE 256
+
+/** Define the separator of the list */
+#define SEPARATOR ", "
+
+/**
+ * The FNV-1a hash of a keyword
+ * @param keyword the keyword
+ * @param length the length of the keyword
+ * @return uint32_t the hash
+ */
+uint32_t keyword_hash(char const *keyword, size_t length){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)keyword[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the entry of a keyword or the free entry it would take
+ * @param set the set, with a table
+ * @param keyword the keyword
+ * @param length the length of the keyword
+ * @param hash the hash of the keyword
+ * @return Keyword_entry* the entry
+ */
+static Keyword_entry* probe(Keyword_set const *set, char const *keyword,
+                            size_t length, uint32_t hash){
+    int mask = set->capacity - 1;
+    for (int i = hash & mask; ; i = (i + 1) & mask){
+        Keyword_entry *entry = &set->table[i];
+        if (entry->offset < 0 ||
+            (entry->hash == hash && entry->length == length &&
+             !memcmp(set->text + entry->offset, keyword, length))){
+            return entry;
+        }
+    }
+}
+
+/**
+ * Double the hash table, or create it
+ * @param set the set
+ * @return int 0 on success, -1 otherwise
+ */
+static int grow_table(Keyword_set *set){
+    int capacity = set->capacity ? set->capacity * 2 : TABLE_SIZE;
+    Keyword_entry *table = malloc(capacity * sizeof(Keyword_entry));
+    if (table == NULL){ return -1; }
+    for (int i = 0; i < capacity; i++){
+        table[i].offset = -1;
+    }
+    Keyword_entry *old = set->table;
+    int old_capacity = set->capacity;
+    set->table = table;
+    set->capacity = capacity;
+    for (int i = 0; i < old_capacity; i++){
+        if (old[i].offset >= 0){
+            *probe(set, set->text + old[i].offset, old[i].length,
+                   old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * Make room at the end of the list
+ * @param set the set
+ * @param length the number of bytes to append
+ * @return int 0 on success, -1 otherwise
+ */
+static int reserve_text(Keyword_set *set, size_t length){
+    size_t needed = KEYWORD_RESERVE + set->length + length + KEYWORD_RESERVE;
+    if (needed <= set->text_capacity){ return 0; }
+    size_t capacity = set->text_capacity ? set->text_capacity : LIST_SIZE;
+    while (capacity < needed){
+        capacity *= 2;
+    }
+    char *buffer = realloc(set->text ? set->text - KEYWORD_RESERVE : NULL,
+                           capacity);
+    if (buffer == NULL){ return -1; }
+    set->text = buffer + KEYWORD_RESERVE;
+    set->text_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Add a keyword at the end of the list, a repeated keyword is listed again
+ * but indexed once
+ * @param set the set
+ * @param keyword the keyword
+ * @param length the length of the keyword
+ * @return int 0 on success, -1 otherwise
+ */
+int keyword_set_add(Keyword_set *set, char const *keyword, size_t length){
+    size_t separator = set->num_keywords > 0 ? strlen(SEPARATOR) : 0;
+    if (reserve_text(set, separator + length) < 0){ return -1; }
+    if ((set->count + 1) * 4 > set->capacity * 3 && grow_table(set) < 0){
+        return -1;
+    }
+    memcpy(set->text + set->length, SEPARATOR, separator);
+    int offset = set->length + separator;
+    memcpy(set->text + offset, keyword, length);
+    set->length = offset + length;
+    set->num_keywords++;
+
+    uint32_t hash = keyword_hash(keyword, length);
+    Keyword_entry *entry = probe(set, keyword, length, hash);
+    if (entry->offset < 0){
+        entry->hash = hash;
+        entry->length = length;
+        entry->offset = offset;
+        set->count++;
+    }
+    return 0;
+}
+
+/**
+ * Check whether a keyword was added
+ * @param set the set
+ * @param keyword the keyword
+ * @param length the length of the keyword
+ * @return Boolean true if the keyword is in the set
+ */
+bool keyword_set_contains(Keyword_set const *set, char const *keyword,
+                          size_t length){
+    if (set->count == 0){ return false; }
+    Keyword_entry const *entry = probe(set, keyword, length,
+                                       keyword_hash(keyword, length));
+    return entry->offset >= 0;
+}
+
+/**
+ * Empty a set for the next game, keeping its memory
+ * @param set the set
+ */
+void keyword_set_clear(Keyword_set *set){
+    for (int i = 0; i < set->capacity && set->count > 0; i++){
+        if (set->table[i].offset >= 0){
+            set->table[i].offset = -1;
+            set->count--;
+        }
+    }
+    set->num_keywords = 0;
+    set->length = 0;
+}
+
+/**
+ * Release the memory of a set, it is empty afterwards
+ * @param set the set
+ */
+void keyword_set_free(Keyword_set *set){
+    free(set->table);
+    free(set->text ? set->text - KEYWORD_RESERVE : NULL);
+    memset(set, 0, sizeof(Keyword_set));
+}
+
+/**
+ * The list surrounded by a prefix and a suffix, written into the room kept
+ * around it, valid until the set is changed
+ * @param set the set
+ * @param prefix the text before the list, at most KEYWORD_RESERVE long
+ * @param suffix the text after the list, at most KEYWORD_RESERVE long
+ * @return Slice the text, empty if the set can not hold it
+ */
+Slice keyword_set_text(Keyword_set *set, char const *prefix,
+                       char const *suffix){
+    Slice text = {"", 0};
+    size_t prefix_length = strlen(prefix);
+    size_t suffix_length = strlen(suffix);
+    if (prefix_length > KEYWORD_RESERVE || suffix_length > KEYWORD_RESERVE ||
+        reserve_text(set, 0) < 0){
+        return text;
+    }
+    memcpy(set->text - prefix_length, prefix, prefix_length);
+    memcpy(set->text + set->length, suffix, suffix_length);
+    text.text = set->text - prefix_length;
+    text.length = prefix_length + set->length + suffix_length;
+    return text;
+}
+
+/**
+ * The bytes keyword_set_save writes for a set
+ * @param set the set
+ * @return size_t the size, a multiple of 4
+ */
+size_t keyword_set_saved_size(Keyword_set const *set){
+    return 3 * sizeof(uint32_t) + ((set->length + 3) & ~(size_t)3) +
+           set->count * 2 * sizeof(uint32_t);
+}
+
+/**
+ * Write a set as the length of the list, the number of keywords added and
+ * of distinct ones, the list padded to 4 bytes and the offset and length of
+ * every distinct keyword
+ * @param set the set
+ * @param out room for keyword_set_saved_size bytes
+ * @return size_t the bytes written
+ */
+size_t keyword_set_save(Keyword_set const *set, char *out){
+    uint32_t head[3] = {set->length, set->num_keywords, set->count};
+    char *at = out;
+    memcpy(at, head, sizeof(head));
+    at += sizeof(head);
+    if (set->length > 0){
+        memcpy(at, set->text, set->length);
+    }
+    memset(at + set->length, 0, ((set->length + 3) & ~(size_t)3) - set->length);
+    at += (set->length + 3) & ~(size_t)3;
+    for (int i = 0; i < set->capacity; i++){
+        if (set->table[i].offset >= 0){
+            uint32_t entry[2] = {set->table[i].offset, set->table[i].length};
+            memcpy(at, entry, sizeof(entry));
+            at += sizeof(entry);
+        }
+    }
+    return at - out;
+}
+
+/**
+ * Read back a set written by keyword_set_save into an empty set
+ * @param set the set, empty
+ * @param in the saved set
+ * @param size the bytes available at in
+ * @return long the bytes read, -1 if they do not hold a valid set or
+ * memory runs out
+ */
+long keyword_set_load(Keyword_set *set, char const *in, size_t size){
+    uint32_t head[3];
+    if (size < sizeof(head)){ return -1; }
+    memcpy(head, in, sizeof(head));
+    size_t length = head[0];
+    size_t padded = (length + 3) & ~(size_t)3;
+    if (padded > size - sizeof(head) ||
+        head[2] > (size - sizeof(head) - padded) / (2 * sizeof(uint32_t)) ||
+        head[2] > head[1] || ((length > 0 || head[2] > 0) &&
+                               reserve_text(set, length) < 0)){
+        return -1;
+    }
+    char const *at = in + sizeof(head);
+    if (length > 0){
+        memcpy(set->text, at, length);
+    }
+    set->length = length;
+    set->num_keywords = head[1];
+    at += padded;
+    for (uint32_t i = 0; i < head[2]; i++){
+        uint32_t entry[2];
+        memcpy(entry, at, sizeof(entry));
+        at += sizeof(entry);
+        if (entry[0] > length || entry[1] > length - entry[0]){ return -1; }
+        if ((set->count + 1) * 4 > set->capacity * 3 && grow_table(set) < 0){
+            return -1;
+        }
+        char const *keyword = set->text + entry[0];
+        uint32_t hash = keyword_hash(keyword, entry[1]);
+        Keyword_entry *slot = probe(set, keyword, entry[1], hash);
+        if (slot->offset < 0){
+            slot->hash = hash;
+            slot->length = entry[1];
+            slot->offset = entry[0];
+            set->count++;
+        }
+    }
+    return at - in;
+}
@@ -0,0 +1,67 @@
+/*
+** Keyword sets of image-tagger
+ * The keywords of a game are appended to one comma separated list, which is
+ * also the text shown to the player, and indexed by an open addressing hash
+ * table holding the hash, length and list offset of every distinct keyword.
+ * A zeroed set is empty and valid. A set can be saved as the list followed
+ * by the offset and length of every distinct keyword, so a restored set
+ * lists and indexes exactly what was added.
+*/
+
+#ifndef KEYWORD_SET_H
+#define KEYWORD_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "slice.h"
+
+/** Define the room kept before and after the list for the text around it */
+#define KEYWORD_RESERVE 16
+
+/** A keyword in the hash table
+ *  @param uint32_t hash The hash of the keyword
+ *  @param uint32_t length The length of the keyword
+ *  @param int offset The offset of the keyword in the list, -1 if unused
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t length;
+    int offset;
+} Keyword_entry;
+
+/** The keywords of one player in one game
+ *  @param Keyword_entry *table The hash table
+ *  @param int capacity The size of the table, a power of two
+ *  @param int count The number of distinct keywords
+ *  @param int num_keywords The number of keywords added, repeats included
+ *  @param char *text The list, KEYWORD_RESERVE bytes after the start of the
+ *  buffer
+ *  @param size_t length The length of the list
+ *  @param size_t text_capacity The size of the buffer
+ */
+typedef struct {
+    Keyword_entry *table;
+    int capacity;
+    int count;
+    int num_keywords;
+    char *text;
+    size_t length;
+    size_t text_capacity;
+} Keyword_set;
+
+/** Prototypes */
+uint32_t keyword_hash(char const *keyword, size_t length);
+int keyword_set_add(Keyword_set *set, char const *keyword, size_t length);
+bool keyword_set_contains(Keyword_set const *set, char const *keyword,
+                          size_t length);
+void keyword_set_clear(Keyword_set *set);
+void keyword_set_free(Keyword_set *set);
+Slice keyword_set_text(Keyword_set *set, char const *prefix,
+                       char const *suffix);
+size_t keyword_set_saved_size(Keyword_set const *set);
+size_t keyword_set_save(Keyword_set const *set, char *out);
+long keyword_set_load(Keyword_set *set, char const *in, size_t size);
+
+#endif
@@ -0,0 +1,579 @@
+/*
+** Load generator of image-tagger
+ * Drives simulated players through the real game over local sockets, each
+ * on its own keep-alive connection and in a closed loop: register, start,
+ * guess keywords until the game ends, quit, then register again. Guesses
+ * are drawn from a vocabulary with a Zipf distribution (uniform when the
+ * skew is 0), so two paired players eventually agree. Reports the
+ * throughput and the latency percentiles of every route. Every player
+ * registers from the same address, so the server should run without the
+ * rate limits of rate_limits.txt.
+ * usage: loadgen [-c players] [-d seconds] [-v words] [-s skew]
+ *                [-t think_ms] [-g max_guesses] ip port
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "event.h"
+
+/** Define the size of the response buffer of a player */
+#define RESPONSE_SIZE 16384
+
+/** Define the size of a request */
+#define REQUEST_SIZE 512
+
+/** Represents the routes measured */
+typedef enum
+{
+    ROUTE_REGISTER,
+    ROUTE_START,
+    ROUTE_GUESS,
+    ROUTE_QUIT,
+    NUM_ROUTES
+} ROUTE;
+
+/** Represents what a player is doing */
+typedef enum
+{
+    PLAYER_CONNECTING,
+    PLAYER_WAITING,
+    PLAYER_THINKING
+} PLAYER;
+
+static char const * const ROUTE_NAMES[NUM_ROUTES] = {
+    "register", "start", "guess", "quit"
+};
+
+/** The latencies of one route
+ *  @param uint32_t *samples The latencies in microseconds
+ *  @param size_t count The number of samples
+ *  @param size_t capacity The allocated size of samples
+ *  @param uint64_t errors The number of failed requests
+ */
+typedef struct {
+    uint32_t *samples;
+    size_t count;
+    size_t capacity;
+    uint64_t errors;
+} Route_stats;
+
+/** A simulated player
+ *  @param int id The number of the player
+ *  @param int fd The socket, -1 if not connected
+ *  @param PLAYER state What the player is doing
+ *  @param ROUTE route The route of the request in flight or next
+ *  @param int cookie The id set by the server, -1 before registering
+ *  @param int guesses The number of guesses in this game
+ *  @param unsigned seed The random state of the player
+ *  @param uint64_t sent_at The microsecond the request was sent
+ *  @param uint64_t wake_at The microsecond thinking ends
+ *  @param char request[REQUEST_SIZE] The request being sent
+ *  @param int request_length The length of request
+ *  @param int request_sent The bytes of request sent
+ *  @param char response[RESPONSE_SIZE] The response being read
+ *  @param int response_length The bytes of response read
+ */
+typedef struct {
+    int id;
+    int fd;
+    PLAYER state;
+    ROUTE route;
+    int cookie;
+    int guesses;
+    unsigned seed;
+    uint64_t sent_at;
+    uint64_t wake_at;
+    char request[REQUEST_SIZE];
+    int request_length;
+    int request_sent;
+    char response[RESPONSE_SIZE];
+    int response_length;
+} Player;
+
+/** The settings and state of the run */
+static struct sockaddr_in server;
+static Event_loop *loop;
+static Player *players;
+static int num_players = 50;
+static int duration = 10;
+static int vocabulary = 50;
+static double skew = 1.0;
+static int think_ms = 0;
+static int max_guesses = 100;
+static double *word_cdf;
+static uint64_t end_at;
+static Route_stats stats[NUM_ROUTES];
+static uint64_t games;
+
+/** Prototypes */
+static void handle_player(Event_loop *loop, int fd, unsigned events, void *data);
+static void next_request(Player *player);
+
+/**
+ * The current time
+ * @return uint64_t microseconds of the monotonic clock
+ */
+static uint64_t now_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Record a latency
+ * @param route the route
+ * @param latency the latency in microseconds
+ */
+static void record(ROUTE route, uint64_t latency){
+    Route_stats *route_stats = &stats[route];
+    if (route_stats->count == route_stats->capacity){
+        size_t capacity = route_stats->capacity ?
+                          route_stats->capacity * 2 : 4096;
+        uint32_t *samples = realloc(route_stats->samples,
+                                    capacity * sizeof(uint32_t));
+        if (samples == NULL){ return; }
+        route_stats->samples = samples;
+        route_stats->capacity = capacity;
+    }
+    route_stats->samples[route_stats->count++] =
+            latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+}
+
+/**
+ * Build the cumulative distribution of the vocabulary, word r has weight
+ * 1 / r^skew
+ * @return int 0 on success, -1 otherwise
+ */
+static int build_words(void){
+    word_cdf = malloc(vocabulary * sizeof(double));
+    if (word_cdf == NULL){ return -1; }
+    double total = 0;
+    for (int r = 0; r < vocabulary; r++){
+        total += 1.0 / pow(r + 1, skew);
+        word_cdf[r] = total;
+    }
+    for (int r = 0; r < vocabulary; r++){
+        word_cdf[r] /= total;
+    }
+    return 0;
+}
+
+/**
+ * Draw a word of the vocabulary
+ * @param player the player guessing
+ * @return int the rank of the word
+ */
+static int draw_word(Player *player){
+    double u = rand_r(&player->seed) / ((double)RAND_MAX + 1);
+    int low = 0, high = vocabulary - 1;
+    while (low < high){
+        int middle = (low + high) / 2;
+        if (word_cdf[middle] < u){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Drop the connection of a player, it registers again on a new one
+ * @param player the player
+ * @param delay the microseconds to wait before reconnecting
+ */
+static void disconnect(Player *player, uint64_t delay){
+    stats[player->route].errors++;
+    if (player->fd >= 0){
+        event_loop_remove(loop, player->fd);
+        close(player->fd);
+        player->fd = -1;
+    }
+    player->cookie = -1;
+    player->route = ROUTE_REGISTER;
+    player->state = PLAYER_THINKING;
+    player->wake_at = now_us() + delay;
+}
+
+/**
+ * Open the connection of a player
+ * @param player the player
+ * @return int 0 on success, -1 otherwise
+ */
+static int connect_player(Player *player){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0){
+        perror("socket");
+        return -1;
+    }
+    int const one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0 &&
+        errno != EINPROGRESS){
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    if (event_loop_add(loop, fd, EVENT_WRITE, handle_player, player) < 0){
+        perror("event_loop_add");
+        close(fd);
+        return -1;
+    }
+    player->fd = fd;
+    player->state = PLAYER_CONNECTING;
+    return 0;
+}
+
+/**
+ * Write as much of the request as the socket takes
+ * @param player the player
+ * @return int 0 on success, -1 if the connection is broken
+ */
+static int send_request(Player *player){
+    while (player->request_sent < player->request_length){
+        ssize_t n = write(player->fd, player->request + player->request_sent,
+                          player->request_length - player->request_sent);
+        if (n < 0){
+            if (errno == EAGAIN){
+                return event_loop_modify(loop, player->fd, EVENT_WRITE);
+            }
+            if (errno == EINTR){ continue; }
+            return -1;
+        }
+        player->request_sent += n;
+    }
+    return event_loop_modify(loop, player->fd, EVENT_READ);
+}
+
+/**
+ * Build and send the request of player->route
+ * @param player the player
+ */
+static void next_request(Player *player){
+    char body[64];
+    char const *method = "POST";
+    char const *target = "/?start=Start";
+    int body_length;
+    switch (player->route)
+    {
+        case ROUTE_REGISTER:
+            target = "/";
+            body_length = sprintf(body, "user=player%d", player->id);
+            break;
+        case ROUTE_START:
+            method = "GET";
+            body_length = 0;
+            break;
+        case ROUTE_GUESS:
+            body_length = sprintf(body, "keyword=word%d&guess=Guess",
+                                  draw_word(player));
+            break;
+        default:
+            body_length = sprintf(body, "quit=Quit");
+            break;
+    }
+    char cookie[32] = "";
+    if (player->cookie >= 0){
+        sprintf(cookie, "Cookie: id=%d\r\n", player->cookie);
+    }
+    player->request_length = sprintf(player->request,
+            "%s %s HTTP/1.1\r\nHost: loadgen\r\n%s"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: %d\r\n\r\n%.*s",
+            method, target, cookie, body_length, body_length, body);
+    player->request_sent = 0;
+    player->response_length = 0;
+    player->sent_at = now_us();
+    // a new connection sends once it is established
+    if (player->fd < 0){
+        if (connect_player(player) < 0){
+            disconnect(player, 100000);
+        }
+        return;
+    }
+    player->state = PLAYER_WAITING;
+    if (send_request(player) < 0){
+        disconnect(player, 1000);
+    }
+}
+
+/**
+ * Pick the route after a response, then think or send at once
+ * @param player the player
+ * @param body the page received
+ */
+static void advance(Player *player, char const *body){
+    switch (player->route)
+    {
+        case ROUTE_REGISTER:
+            player->route = ROUTE_START;
+            break;
+        case ROUTE_START:
+            player->route = ROUTE_GUESS;
+            player->guesses = 0;
+            break;
+        case ROUTE_GUESS:
+            player->guesses++;
+            if (strstr(body, "The game is completed") != NULL){
+                games++;
+                player->route = ROUTE_QUIT;
+            }else if (player->guesses >= max_guesses){
+                player->route = ROUTE_QUIT;
+            }
+            break;
+        default:
+            player->route = ROUTE_REGISTER;
+            player->cookie = -1;
+            break;
+    }
+    if (think_ms > 0){
+        player->state = PLAYER_THINKING;
+        player->wake_at = now_us() + (uint64_t)think_ms * 1000;
+    }else{
+        next_request(player);
+    }
+}
+
+/**
+ * Check whether a whole response was read, and take the cookie from it
+ * @param player the player
+ * @return char* the body of the response, NULL if it is not complete
+ */
+static char* complete_response(Player *player){
+    player->response[player->response_length] = '\0';
+    char *end = strstr(player->response, "\r\n\r\n");
+    if (end == NULL){ return NULL; }
+    char *length = strcasestr(player->response, "Content-Length:");
+    long body_length = length != NULL && length < end ?
+                       strtol(length + 15, NULL, 10) : 0;
+    if (end + 4 + body_length > player->response + player->response_length){
+        return NULL;
+    }
+    char *cookie = strstr(player->response, "Set-Cookie: id=");
+    if (cookie != NULL && cookie < end){
+        int id = atoi(cookie + 15);
+        if (id >= 0){ player->cookie = id; }
+    }
+    return end + 4;
+}
+
+/**
+ * Event handler of a player socket
+ * @param loop the event loop
+ * @param fd the socket
+ * @param events the events that fired
+ * @param data the player
+ */
+static void handle_player(Event_loop *loop, int fd, unsigned events, void *data)
+{
+    Player *player = data;
+    if (player->state == PLAYER_CONNECTING)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0 || (events & EVENT_ERROR))
+        {
+            disconnect(player, 100000);
+            return;
+        }
+        player->state = PLAYER_WAITING;
+        if (send_request(player) < 0)
+        {
+            disconnect(player, 1000);
+        }
+        return;
+    }
+    if ((events & EVENT_WRITE) && send_request(player) < 0)
+    {
+        goto broken;
+    }
+    if (!(events & EVENT_READ))
+    {
+        return;
+    }
+    for (;;)
+    {
+        ssize_t n = read(fd, player->response + player->response_length,
+                         RESPONSE_SIZE - 1 - player->response_length);
+        if (n > 0)
+        {
+            player->response_length += n;
+            if (player->response_length == RESPONSE_SIZE - 1){ goto broken; }
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN){ break; }
+        if (n < 0 && errno == EINTR){ continue; }
+        goto broken;
+    }
+    char *body = complete_response(player);
+    if (body == NULL){ return; }
+    record(player->route, now_us() - player->sent_at);
+    if (strncmp(player->response, "HTTP/1.1 200", 12))
+    {
+        stats[player->route].errors++;
+        player->route = ROUTE_QUIT;
+    }
+    advance(player, body);
+    return;
+
+broken:
+    disconnect(player, 1000);
+}
+
+/**
+ * Event handler of the tick timer, wake the players done thinking and end
+ * the run
+ * @param loop the event loop
+ * @param fd the timerfd
+ * @param events the events that fired
+ * @param data unused
+ */
+static void handle_tick(Event_loop *loop, int fd, unsigned events, void *data)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        perror("read");
+    }
+    uint64_t now = now_us();
+    if (now >= end_at)
+    {
+        event_loop_stop(loop);
+        return;
+    }
+    for (int i = 0; i < num_players; i++)
+    {
+        if (players[i].state == PLAYER_THINKING && players[i].wake_at <= now)
+        {
+            next_request(&players[i]);
+        }
+    }
+}
+
+/**
+ * Order latencies for qsort
+ * @param a a latency
+ * @param b a latency
+ * @return int the order
+ */
+static int compare_latency(void const *a, void const *b){
+    uint32_t x = *(uint32_t const *)a, y = *(uint32_t const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * A percentile of sorted latencies
+ * @param route_stats the latencies, sorted
+ * @param percentile the percentile, 0 to 100
+ * @return double the latency in milliseconds
+ */
+static double percentile_ms(Route_stats const *route_stats, double percentile){
+    if (route_stats->count == 0){ return 0; }
+    size_t i = (size_t)(percentile / 100 * route_stats->count);
+    if (i >= route_stats->count){ i = route_stats->count - 1; }
+    return route_stats->samples[i] / 1000.0;
+}
+
+/**
+ * Print the throughput and latencies of every route
+ * @param seconds the length of the run
+ */
+static void report(double seconds){
+    uint64_t total = 0;
+    printf("%-9s %9s %10s %9s %9s %9s %9s %7s\n", "route", "requests",
+           "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms", "errors");
+    for (int r = 0; r < NUM_ROUTES; r++)
+    {
+        Route_stats *route_stats = &stats[r];
+        qsort(route_stats->samples, route_stats->count, sizeof(uint32_t),
+              compare_latency);
+        printf("%-9s %9zu %10.1f %9.3f %9.3f %9.3f %9.3f %7llu\n",
+               ROUTE_NAMES[r], route_stats->count,
+               route_stats->count / seconds,
+               percentile_ms(route_stats, 50), percentile_ms(route_stats, 99),
+               percentile_ms(route_stats, 99.9),
+               percentile_ms(route_stats, 100),
+               (unsigned long long)route_stats->errors);
+        total += route_stats->count;
+    }
+    printf("total     %9llu %10.1f   games completed %llu (%.1f/s)\n",
+           (unsigned long long)total, total / seconds,
+           (unsigned long long)games, games / seconds);
+}
+
+int main(int argc, char * argv[])
+{
+    int option;
+    while ((option = getopt(argc, argv, "c:d:v:s:t:g:")) != -1)
+    {
+        switch (option)
+        {
+            case 'c': num_players = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'v': vocabulary = atoi(optarg); break;
+            case 's': skew = atof(optarg); break;
+            case 't': think_ms = atoi(optarg); break;
+            case 'g': max_guesses = atoi(optarg); break;
+            default: optind = argc + 1; break;
+        }
+    }
+    if (optind + 2 != argc || num_players < 1 || duration < 1 ||
+        vocabulary < 1 || skew < 0 || think_ms < 0 || max_guesses < 1)
+    {
+        fprintf(stderr, "usage: %s [-c players] [-d seconds] [-v words] "
+                "[-s skew] [-t think_ms] [-g max_guesses] ip port\n", argv[0]);
+        return 1;
+    }
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(argv[optind]);
+    server.sin_port = htons(atoi(argv[optind + 1]));
+    signal(SIGPIPE, SIG_IGN);
+
+    loop = event_loop_create();
+    players = calloc(num_players, sizeof(Player));
+    int tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = {{0, 1000000}, {0, 1000000}};
+    if (loop == NULL || players == NULL || build_words() < 0 || tickfd < 0 ||
+        timerfd_settime(tickfd, 0, &tick, NULL) < 0 ||
+        event_loop_add(loop, tickfd, EVENT_READ, handle_tick, NULL) < 0)
+    {
+        perror("loadgen");
+        return 1;
+    }
+
+    printf("%d players for %d s, %d words (skew %.2f), think %d ms\n",
+           num_players, duration, vocabulary, skew, think_ms);
+    uint64_t start = now_us();
+    end_at = start + (uint64_t)duration * 1000000;
+    for (int i = 0; i < num_players; i++)
+    {
+        players[i].id = i;
+        players[i].fd = -1;
+        players[i].cookie = -1;
+        players[i].seed = i * 2654435761u + 1;
+        players[i].route = ROUTE_REGISTER;
+        next_request(&players[i]);
+    }
+    if (event_loop_run(loop) < 0)
+    {
+        return 1;
+    }
+    report((now_us() - start) / 1e6);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+** Event log decoder of image-tagger
+ * Prints the records of event logs written by the server as one line of
+ * text each, in the order they were written. Records of different shards
+ * interleave by batch, sort on the time column for a global order.
+ * usage: logdump [file ...], standard input without a file
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "event_log.h"
+#include "metrics.h"
+
+static char const * const EVENT_NAMES[NUM_LOG_EVENTS] = {
+    "open", "connect", "shed", "close", "request", "pair", "match", "error",
+    "dropped"
+};
+
+static char const * const ORIGIN_NAMES[NUM_ORIGINS] = {
+    "accept", "read", "write", "event_loop", "tag_store", "keyword_set"
+};
+
+static char const * const METHOD_NAMES[NUM_METHODS] = {
+    "GET", "POST", "UNKNOWN"
+};
+
+/**
+ * Print the address of a client
+ * @param address the IPv4 address in network order
+ * @param port the port in network order
+ */
+static void print_peer(uint32_t address, uint32_t port){
+    struct in_addr in = { .s_addr = address };
+    char ip[INET_ADDRSTRLEN];
+    printf(" %s:%u", inet_ntop(AF_INET, &in, ip, sizeof(ip)),
+           ntohs((uint16_t)port));
+}
+
+/**
+ * Print one record
+ * @param record the record
+ */
+static void print_record(Log_record const *record){
+    time_t seconds = record->time / 1000000;
+    struct tm tm;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S",
+             gmtime_r(&seconds, &tm));
+    printf("%s.%06uZ shard %u ", when,
+           (unsigned)(record->time % 1000000), record->shard);
+    if (record->type >= NUM_LOG_EVENTS){
+        printf("unknown type %u\n", record->type);
+        return;
+    }
+    printf("%s", EVENT_NAMES[record->type]);
+    if (record->fd >= 0){
+        printf(" fd %d", record->fd);
+    }
+    switch (record->type){
+        case LOG_CONNECT:
+        case LOG_SHED:
+            print_peer(record->a, record->b);
+            break;
+        case LOG_REQUEST:
+            printf(" %s %s %uus",
+                   record->a < NUM_METHODS ? METHOD_NAMES[record->a] : "?",
+                   record->code < NUM_ROUTES ?
+                   metrics_route_name(record->code) : "?",
+                   record->b);
+            if (record->c != UINT64_MAX){
+                printf(" cookie %llu", (unsigned long long)record->c);
+            }
+            break;
+        case LOG_PAIR:
+        case LOG_MATCH:
+            printf(" player %u partner %u image %llu", record->a, record->b,
+                   (unsigned long long)record->c);
+            break;
+        case LOG_ERROR:
+            printf(" %s: %s",
+                   record->a < NUM_ORIGINS ? ORIGIN_NAMES[record->a] : "?",
+                   strerror(record->code));
+            break;
+        case LOG_DROPPED:
+            printf(" %llu records", (unsigned long long)record->c);
+            break;
+        default:
+            break;
+    }
+    printf("\n");
+}
+
+/**
+ * Print every record of a log, it has to start with LOG_OPEN
+ * @param in the log
+ * @param name the name of the log for errors
+ * @return int 0 on success, -1 if it is not an event log
+ */
+static int dump(FILE *in, char const *name){
+    Log_record record;
+    bool first = true;
+    while (fread(&record, sizeof(record), 1, in) == 1){
+        if (first && (record.type != LOG_OPEN || record.c != LOG_MAGIC ||
+                      record.a != sizeof(Log_record))){
+            fprintf(stderr, "%s: not an event log of this version\n", name);
+            return -1;
+        }
+        first = false;
+        print_record(&record);
+    }
+    if (ferror(in)){
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2)
+    {
+        return dump(stdin, "stdin") < 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *in = fopen(argv[i], "rb");
+        if (in == NULL)
+        {
+            perror(argv[i]);
+            status = 1;
+            continue;
+        }
+        if (dump(in, argv[i]) < 0)
+        {
+            status = 1;
+        }
+        fclose(in);
+    }
+    return status;
+}
@@ -0,0 +1,103 @@
+/*
+** Lock-free mailbox of image-tagger
+ * push is wait-free, pop may report empty while a push is half done, the
+ * producer wakes the consumer again after it finishes so nothing is lost.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mailbox.h"
+
+/**
+ * Initialise an empty mailbox
+ * @param mailbox the mailbox
+ * @return int 0 on success, -1 otherwise
+ */
+int mailbox_init(Mailbox *mailbox){
+    mailbox->stub = calloc(1, sizeof(Message));
+    if (mailbox->stub == NULL){ return -1; }
+    mailbox->head = mailbox->stub;
+    mailbox->tail = mailbox->stub;
+    return 0;
+}
+
+/**
+ * Append a message, safe from any thread
+ * @param mailbox the mailbox
+ * @param message the message, owned by the mailbox afterwards
+ */
+void mailbox_push(Mailbox *mailbox, Message *message){
+    __atomic_store_n(&message->next, NULL, __ATOMIC_RELAXED);
+    Message *prev = __atomic_exchange_n(&mailbox->head, message,
+                                        __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the oldest message, only called by the owning shard
+ * @param mailbox the mailbox
+ * @return Message* the message, NULL if none is ready
+ */
+Message* mailbox_pop(Mailbox *mailbox){
+    Message *tail = mailbox->tail;
+    Message *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    // skip the stub
+    if (tail == mailbox->stub){
+        if (next == NULL){ return NULL; }
+        mailbox->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL){
+        mailbox->tail = next;
+        return tail;
+    }
+    // a producer is between its exchange and its link
+    if (tail != __atomic_load_n(&mailbox->head, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    // tail is the last message, put the stub behind it so it can be taken
+    mailbox_push(mailbox, mailbox->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL){
+        mailbox->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a message, copying a payload if given
+ * @param type the type of message
+ * @param data the payload, may be NULL
+ * @param length the number of bytes of payload
+ * @return Message* the message, NULL on failure
+ */
+Message* message_create(MESSAGE type, char const *data, int length){
+    Message *message = calloc(1, sizeof(Message));
+    if (message == NULL){ return NULL; }
+    message->type = type;
+    message->slot = -1;
+    if (data != NULL){
+        message->data = malloc(length + 1);
+        if (message->data == NULL){
+            free(message);
+            return NULL;
+        }
+        memcpy(message->data, data, length);
+        message->data[length] = '\0';
+        message->length = length;
+    }
+    return message;
+}
+
+/**
+ * Release a message and its payload
+ * @param message the message
+ */
+void message_free(Message *message){
+    if (message == NULL){ return; }
+    free(message->data);
+    free(message);
+}
@@ -0,0 +1,67 @@
+/*
+** Lock-free mailbox of image-tagger
+ * An intrusive multi-producer single-consumer queue (Vyukov style), used to
+ * hand messages and connections from one worker shard to another without a
+ * lock. Producers only do one atomic exchange, the owning shard pops.
+*/
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+/** Represents the types of message between shards */
+typedef enum
+{
+    MSG_CONNECTION,
+    MSG_PAIR_OFFER,
+    MSG_PAIR_ACCEPT,
+    MSG_PAIR_REJECT,
+    MSG_PAIR_NUDGE,
+    MSG_KEYWORD,
+    MSG_RESET,
+    MSG_PAIR_RETRY,
+    MSG_SHUTDOWN
+} MESSAGE;
+
+/** A message sent to a shard
+ *  @param Message *next The link used by the queue
+ *  @param MESSAGE type The type of message
+ *  @param int shard The shard it is sent to, set when it goes to another
+ *  node
+ *  @param int slot The player of the receiving shard it is about, or -1
+ *  @param int peer_shard The shard of the player that sent it
+ *  @param int peer_slot The player that sent it
+ *  @param int game The game counter of the player the message is about
+ *  @param int image The image id a pairing offer, nudge or retry is for
+ *  @param void *connection The connection handed over by MSG_CONNECTION
+ *  @param int length The number of bytes in data
+ *  @param char *data The pending request or the keyword, NUL terminated
+ */
+typedef struct Message {
+    struct Message *next;
+    MESSAGE type;
+    int shard;
+    int slot;
+    int peer_shard;
+    int peer_slot;
+    int game;
+    int image;
+    void *connection;
+    int length;
+    char *data;
+} Message;
+
+/** The queue, head is shared by producers, tail is owned by the consumer */
+typedef struct {
+    Message *head;
+    Message *tail;
+    Message *stub;
+} Mailbox;
+
+/** Prototypes */
+int mailbox_init(Mailbox *mailbox);
+void mailbox_push(Mailbox *mailbox, Message *message);
+Message* mailbox_pop(Mailbox *mailbox);
+Message* message_create(MESSAGE type, char const *data, int length);
+void message_free(Message *message);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+** Matchmaking of image-tagger
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matchmaking.h"
+
+/**
+ * Initialise empty queues
+ * @param matchmaker the queues of a shard
+ * @param num_images the number of images of the catalog
+ * @return int 0 on success, -1 otherwise
+ */
+int matchmaker_init(Matchmaker *matchmaker, int num_images){
+    memset(matchmaker, 0, sizeof(Matchmaker));
+    matchmaker->queues = malloc(num_images * sizeof(Wait_queue));
+    matchmaker->heap = malloc((num_images + 1) * sizeof(int));
+    if (matchmaker->queues == NULL || matchmaker->heap == NULL){ return -1; }
+    matchmaker->num_images = num_images;
+    for (int i = 0; i < num_images; i++){
+        matchmaker->queues[i].head = -1;
+        matchmaker->queues[i].tail = -1;
+        matchmaker->queues[i].depth = 0;
+        matchmaker->queues[i].heap_index = -1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether the head of one queue joined before the head of another
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @param a an image whose queue has players
+ * @param b another one
+ * @return Boolean true if the head of a joined first
+ */
+static bool joined_before(Matchmaker const *matchmaker,
+                          Session_store const *store, int a, int b){
+    uint32_t since_a = session_get(store, matchmaker->queues[a].head)->queued_at;
+    uint32_t since_b = session_get(store, matchmaker->queues[b].head)->queued_at;
+    return (int32_t)(since_a - since_b) < 0;
+}
+
+/**
+ * Put an image at a position of the heap
+ * @param matchmaker the queues of a shard
+ * @param at the position
+ * @param image the image
+ */
+static void heap_place(Matchmaker *matchmaker, int at, int image){
+    matchmaker->heap[at] = image;
+    matchmaker->queues[image].heap_index = at;
+}
+
+/**
+ * Move an image of the heap up to its place, after its head got older or
+ * it was added
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @param at the position of the image
+ */
+static void sift_up(Matchmaker *matchmaker, Session_store const *store,
+                    int at){
+    int image = matchmaker->heap[at];
+    while (at > 0){
+        int parent = (at - 1) / 2;
+        if (!joined_before(matchmaker, store, image, matchmaker->heap[parent])){
+            break;
+        }
+        heap_place(matchmaker, at, matchmaker->heap[parent]);
+        at = parent;
+    }
+    heap_place(matchmaker, at, image);
+}
+
+/**
+ * Move an image of the heap down to its place, after its head left
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @param at the position of the image
+ */
+static void sift_down(Matchmaker *matchmaker, Session_store const *store,
+                      int at){
+    int image = matchmaker->heap[at];
+    for (;;){
+        int child = 2 * at + 1;
+        if (child >= matchmaker->heap_length){ break; }
+        if (child + 1 < matchmaker->heap_length &&
+            joined_before(matchmaker, store, matchmaker->heap[child + 1],
+                          matchmaker->heap[child])){
+            child++;
+        }
+        if (!joined_before(matchmaker, store, matchmaker->heap[child], image)){
+            break;
+        }
+        heap_place(matchmaker, at, matchmaker->heap[child]);
+        at = child;
+    }
+    heap_place(matchmaker, at, image);
+}
+
+/**
+ * Take an image whose queue emptied out of the heap
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @param image the image
+ */
+static void heap_remove(Matchmaker *matchmaker, Session_store const *store,
+                        int image){
+    int at = matchmaker->queues[image].heap_index;
+    matchmaker->queues[image].heap_index = -1;
+    int last = matchmaker->heap[--matchmaker->heap_length];
+    if (last == image){ return; }
+    // the last image fills the hole and moves whichever way it has to
+    heap_place(matchmaker, at, last);
+    sift_down(matchmaker, store, at);
+    sift_up(matchmaker, store, matchmaker->queues[last].heap_index);
+}
+
+/**
+ * Unlink a queued slot
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @param slot the slot, queued
+ */
+static void unlink_slot(Matchmaker *matchmaker, Session_store *store,
+                        int slot){
+    Session *session = session_get(store, slot);
+    int image = session->queue;
+    Wait_queue *queue = &matchmaker->queues[image];
+    if (session->queue_prev >= 0){
+        session_get(store, session->queue_prev)->queue_next =
+                session->queue_next;
+    }else{
+        queue->head = session->queue_next;
+    }
+    if (session->queue_next >= 0){
+        session_get(store, session->queue_next)->queue_prev =
+                session->queue_prev;
+    }else{
+        queue->tail = session->queue_prev;
+    }
+    __atomic_store_n(&queue->depth, queue->depth - 1, __ATOMIC_RELAXED);
+    matchmaker->waiting--;
+    session->queue = -1;
+    if (queue->head < 0){
+        heap_remove(matchmaker, store, image);
+    }else if (session->queue_prev < 0){
+        // the next player, who joined later, heads the queue now
+        sift_down(matchmaker, store, queue->heap_index);
+    }
+}
+
+/**
+ * Put a player at the end of the queue of its image, a player already
+ * queued keeps its place
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slot belongs to
+ * @param slot the slot of the player
+ * @return int the depth of the queue joined, 0 if the player was not queued
+ */
+int matchmaker_enqueue(Matchmaker *matchmaker, Session_store *store,
+                       int slot){
+    Session *session = session_get(store, slot);
+    int image = session->image_index;
+    if (session->queue >= 0 || image < 0 || image >= matchmaker->num_images){
+        return 0;
+    }
+    Wait_queue *queue = &matchmaker->queues[image];
+    session->queue = image;
+    session->queue_prev = queue->tail;
+    session->queue_next = -1;
+    session->queued_at = session_now();
+    if (queue->tail >= 0){
+        session_get(store, queue->tail)->queue_next = slot;
+    }else{
+        queue->head = slot;
+        heap_place(matchmaker, matchmaker->heap_length++, image);
+        sift_up(matchmaker, store, queue->heap_index);
+    }
+    queue->tail = slot;
+    __atomic_store_n(&queue->depth, queue->depth + 1, __ATOMIC_RELAXED);
+    matchmaker->waiting++;
+    return queue->depth;
+}
+
+/**
+ * Take the player waiting longest for an image
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @param image the image id the partner must play
+ * @param exclude the slot looking for a partner, skipped, -1 if remote
+ * @return int the slot of the partner, -1 if nobody waits
+ */
+int matchmaker_dequeue(Matchmaker *matchmaker, Session_store *store,
+                       int image, int exclude){
+    if (image < 0 || image >= matchmaker->num_images){ return -1; }
+    int slot = matchmaker->queues[image].head;
+    if (slot >= 0 && slot == exclude){
+        slot = session_get(store, slot)->queue_next;
+    }
+    if (slot < 0){ return -1; }
+    uint32_t wait = session_now() - session_get(store, slot)->queued_at;
+    unlink_slot(matchmaker, store, slot);
+    matchmaker->matched++;
+    matchmaker->total_wait += wait;
+    if (wait > matchmaker->max_wait){ matchmaker->max_wait = wait; }
+    return slot;
+}
+
+/**
+ * Remove a player that stopped waiting, nothing happens if it is not queued
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slot belongs to
+ * @param slot the slot of the player
+ */
+void matchmaker_cancel(Matchmaker *matchmaker, Session_store *store,
+                       int slot){
+    if (session_get(store, slot)->queue < 0){ return; }
+    unlink_slot(matchmaker, store, slot);
+    matchmaker->cancelled++;
+}
+
+/**
+ * The player waiting longest for an image, left in the queue
+ * @param matchmaker the queues of a shard
+ * @param image the image id
+ * @return int the slot, -1 if nobody waits
+ */
+int matchmaker_head(Matchmaker const *matchmaker, int image){
+    if (image < 0 || image >= matchmaker->num_images){ return -1; }
+    return matchmaker->queues[image].head;
+}
+
+/**
+ * The number of players waiting for an image, may be called by any shard
+ * @param matchmaker the queues of a shard
+ * @param image the image id
+ * @return int the depth of its queue
+ */
+int matchmaker_depth(Matchmaker const *matchmaker, int image){
+    if (image < 0 || image >= matchmaker->num_images){ return 0; }
+    return __atomic_load_n(&matchmaker->queues[image].depth,
+                           __ATOMIC_RELAXED);
+}
+
+/**
+ * Take a snapshot of the counters
+ * @param matchmaker the queues of a shard
+ * @param stats filled in
+ */
+void matchmaker_stats(Matchmaker const *matchmaker, Match_stats *stats){
+    stats->waiting = matchmaker->waiting;
+    stats->matched = matchmaker->matched;
+    stats->cancelled = matchmaker->cancelled;
+    stats->total_wait = matchmaker->total_wait;
+    stats->max_wait = matchmaker->max_wait;
+}
+
+/**
+ * The wait of the player waiting longest, the head of the queue at the top
+ * of the heap
+ * @param matchmaker the queues of a shard
+ * @param store the session store the slots belong to
+ * @return uint32_t the seconds waited, 0 if nobody waits
+ */
+uint32_t matchmaker_oldest_wait(Matchmaker const *matchmaker,
+                                Session_store const *store){
+    if (matchmaker->heap_length == 0){ return 0; }
+    int head = matchmaker->queues[matchmaker->heap[0]].head;
+    return session_now() - session_get(store, head)->queued_at;
+}
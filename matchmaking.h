@@ -0,0 +1,87 @@
+/*
+** Matchmaking of image-tagger
+ * Players waiting for a partner are kept in one FIFO queue per image id of
+ * the catalog, linked through their session slots, so a partner is found,
+ * and a player that stops waiting is removed, in constant time. The depth
+ * of each queue is read by the other shards to find a partner for the
+ * same image. The queues with players are kept in a min-heap by the second
+ * their head joined, so the longest wait is found without visiting every
+ * queue.
+*/
+
+#ifndef MATCHMAKING_H
+#define MATCHMAKING_H
+
+#include <stdint.h>
+
+#include "session.h"
+
+/** The players waiting for one image, oldest first
+ *  @param int head The slot waiting longest, -1 if empty
+ *  @param int tail The slot that joined last, -1 if empty
+ *  @param int depth The number of players in the queue, read by other
+ *  shards
+ *  @param int heap_index The position of the queue in the heap of the
+ *  shard, -1 if empty
+ */
+typedef struct {
+    int head;
+    int tail;
+    int depth;
+    int heap_index;
+} Wait_queue;
+
+/** The waiting queues of one shard
+ *  @param Wait_queue *queues The queue of each image
+ *  @param int num_images The number of queues
+ *  @param int *heap The images whose queue has players, the one whose head
+ *  joined first at the top
+ *  @param int heap_length The number of images in heap
+ *  @param int waiting The number of players in every queue
+ *  @param uint64_t matched The number of players taken from a queue
+ *  @param uint64_t cancelled The number of players that left a queue unpaired
+ *  @param uint64_t total_wait The seconds waited by the players matched
+ *  @param uint32_t max_wait The longest wait of a player matched
+ */
+typedef struct {
+    Wait_queue *queues;
+    int num_images;
+    int *heap;
+    int heap_length;
+    int waiting;
+    uint64_t matched;
+    uint64_t cancelled;
+    uint64_t total_wait;
+    uint32_t max_wait;
+} Matchmaker;
+
+/** A snapshot of the queues
+ *  @param int waiting The number of players waiting
+ *  @param uint64_t matched The number of players taken from a queue
+ *  @param uint64_t cancelled The number of players that left a queue unpaired
+ *  @param uint64_t total_wait The seconds waited by the players matched
+ *  @param uint32_t max_wait The longest wait of a player matched
+ */
+typedef struct {
+    int waiting;
+    uint64_t matched;
+    uint64_t cancelled;
+    uint64_t total_wait;
+    uint32_t max_wait;
+} Match_stats;
+
+/** Prototypes */
+int matchmaker_init(Matchmaker *matchmaker, int num_images);
+int matchmaker_enqueue(Matchmaker *matchmaker, Session_store *store,
+                       int slot);
+int matchmaker_dequeue(Matchmaker *matchmaker, Session_store *store,
+                       int image, int exclude);
+void matchmaker_cancel(Matchmaker *matchmaker, Session_store *store,
+                       int slot);
+int matchmaker_head(Matchmaker const *matchmaker, int image);
+int matchmaker_depth(Matchmaker const *matchmaker, int image);
+void matchmaker_stats(Matchmaker const *matchmaker, Match_stats *stats);
+uint32_t matchmaker_oldest_wait(Matchmaker const *matchmaker,
+                                Session_store const *store);
+
+#endif
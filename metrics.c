@@ -0,0 +1,262 @@
+/*
+** Metrics of image-tagger
+*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "metrics.h"
+
+/** Define the size reserved for the rendered metrics */
+#define RENDER_SIZE 65536
+
+/** The upper bounds of the latency buckets in microseconds */
+static uint64_t const BUCKETS[NUM_BUCKETS] = {
+    25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000
+};
+
+static char const * const ROUTE_NAMES[NUM_ROUTES] = {
+    "root", "start", "tags", "metrics", "events", "image", "export",
+    "not_found", "bad_request"
+};
+
+static char const * const TIMEOUT_NAMES[NUM_TIMEOUTS] = {
+    "idle_connection", "request_read", "pairing_wait", "game", "session"
+};
+
+static char const * const METHOD_NAMES[NUM_METHODS] = {
+    "GET", "POST", "UNKNOWN"
+};
+
+/** The text being rendered
+ *  @param char *text The buffer
+ *  @param size_t length The bytes written
+ *  @param size_t capacity The size of the buffer
+ */
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+} Output;
+
+/**
+ * The name of a route, as the metrics label it
+ * @param route the route
+ * @return char const* the name
+ */
+char const* metrics_route_name(ROUTE route){
+    return ROUTE_NAMES[route];
+}
+
+/**
+ * Count a request served by the calling shard
+ * @param metrics the metrics of the shard
+ * @param route the route of the request
+ * @param method the method of the request
+ * @param latency the microseconds taken to answer it
+ */
+void metrics_request(Metrics *metrics, ROUTE route, METHOD method,
+                     uint64_t latency){
+    Histogram *histogram = &metrics->latency[route];
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS && latency > BUCKETS[bucket]){
+        bucket++;
+    }
+    metric_add(&metrics->requests[route][method], 1);
+    metric_add(&histogram->buckets[bucket], 1);
+    metric_add(&histogram->sum, latency);
+    metric_add(&histogram->count, 1);
+}
+
+/**
+ * Append to the rendered text, anything past its capacity is dropped
+ * @param out the text
+ * @param format the printf format
+ */
+static void emit(Output *out, char const *format, ...){
+    if (out->length >= out->capacity){ return; }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out->text + out->length, out->capacity - out->length,
+                      format, args);
+    va_end(args);
+    if (n > 0){
+        out->length += n;
+    }
+    if (out->length > out->capacity){
+        out->length = out->capacity;
+    }
+}
+
+/**
+ * Sum a metric over every shard
+ * @param all the metrics of the shards
+ * @param count the number of shards
+ * @param offset the offset of the metric in Metrics
+ * @return uint64_t the sum
+ */
+static uint64_t sum(Metrics * const *all, int count, size_t offset){
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++){
+        total += metric_get((uint64_t const *)((char const *)all[i] + offset));
+    }
+    return total;
+}
+
+/**
+ * Write a metric that has a single value
+ * @param out the text
+ * @param name the name of the metric
+ * @param type counter or gauge
+ * @param help the description
+ * @param value the value
+ */
+static void emit_single(Output *out, char const *name, char const *type,
+                        char const *help, uint64_t value){
+    emit(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type,
+         name, (unsigned long long)value);
+}
+
+/**
+ * Render the metrics of every shard
+ * @param arena the arena the text is put in
+ * @param all the metrics of the shards
+ * @param count the number of shards
+ * @param global the metrics kept outside the shards
+ * @return Slice the text, text is NULL on failure
+ */
+Slice metrics_render(Arena *arena, Metrics * const *all, int count,
+                     Global_metrics const *global){
+    Slice text = {NULL, 0};
+    Output out = {arena_alloc(arena, RENDER_SIZE), 0, RENDER_SIZE};
+    if (out.text == NULL){ return text; }
+
+    emit(&out, "# HELP image_tagger_requests_total Requests served.\n"
+         "# TYPE image_tagger_requests_total counter\n");
+    for (int r = 0; r < NUM_ROUTES; r++){
+        for (int m = 0; m < NUM_METHODS; m++){
+            uint64_t n = sum(all, count, offsetof(Metrics, requests[r][m]));
+            if (n > 0){
+                emit(&out, "image_tagger_requests_total{route=\"%s\","
+                     "method=\"%s\"} %llu\n", ROUTE_NAMES[r], METHOD_NAMES[m],
+                     (unsigned long long)n);
+            }
+        }
+    }
+
+    emit(&out, "# HELP image_tagger_request_duration_seconds Time taken to "
+         "answer a request.\n"
+         "# TYPE image_tagger_request_duration_seconds histogram\n");
+    for (int r = 0; r < NUM_ROUTES; r++){
+        uint64_t total = sum(all, count, offsetof(Metrics, latency[r].count));
+        if (total == 0){ continue; }
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= NUM_BUCKETS; b++){
+            cumulative += sum(all, count,
+                              offsetof(Metrics, latency[r].buckets[b]));
+            if (b < NUM_BUCKETS){
+                emit(&out, "image_tagger_request_duration_seconds_bucket"
+                     "{route=\"%s\",le=\"%g\"} %llu\n", ROUTE_NAMES[r],
+                     BUCKETS[b] / 1e6, (unsigned long long)cumulative);
+            }else{
+                emit(&out, "image_tagger_request_duration_seconds_bucket"
+                     "{route=\"%s\",le=\"+Inf\"} %llu\n", ROUTE_NAMES[r],
+                     (unsigned long long)cumulative);
+            }
+        }
+        emit(&out, "image_tagger_request_duration_seconds_sum{route=\"%s\"} "
+             "%.6f\n", ROUTE_NAMES[r],
+             sum(all, count, offsetof(Metrics, latency[r].sum)) / 1e6);
+        emit(&out, "image_tagger_request_duration_seconds_count"
+             "{route=\"%s\"} %llu\n", ROUTE_NAMES[r],
+             (unsigned long long)total);
+    }
+
+    emit(&out, "# HELP image_tagger_requests_throttled_total Requests turned "
+         "away by the rate limiter.\n"
+         "# TYPE image_tagger_requests_throttled_total counter\n");
+    for (int r = 0; r < NUM_ROUTES; r++){
+        uint64_t n = sum(all, count, offsetof(Metrics, throttled[r]));
+        if (n > 0){
+            emit(&out, "image_tagger_requests_throttled_total{route=\"%s\"} "
+                 "%llu\n", ROUTE_NAMES[r], (unsigned long long)n);
+        }
+    }
+
+    emit_single(&out, "image_tagger_bytes_written_total", "counter",
+                "Bytes written to clients.",
+                sum(all, count, offsetof(Metrics, bytes_written)));
+    emit_single(&out, "image_tagger_connections_active", "gauge",
+                "Client connections open.",
+                sum(all, count, offsetof(Metrics, connections_opened)) -
+                sum(all, count, offsetof(Metrics, connections_closed)));
+    emit_single(&out, "image_tagger_connections_total", "counter",
+                "Client connections accepted.",
+                sum(all, count, offsetof(Metrics, connections_opened)));
+    emit_single(&out, "image_tagger_connections_shed_total", "counter",
+                "Client connections turned away while saturated.",
+                sum(all, count, offsetof(Metrics, connections_shed)));
+    emit(&out, "# HELP image_tagger_timeouts_total Connections closed and "
+         "waits, games and sessions ended for inactivity.\n"
+         "# TYPE image_tagger_timeouts_total counter\n");
+    for (int t = 0; t < NUM_TIMEOUTS; t++){
+        emit(&out, "image_tagger_timeouts_total{kind=\"%s\"} %llu\n",
+             TIMEOUT_NAMES[t],
+             (unsigned long long)sum(all, count,
+                                     offsetof(Metrics, timeouts[t])));
+    }
+    emit_single(&out, "image_tagger_players_registered", "gauge",
+                "Players with a session.",
+                sum(all, count, offsetof(Metrics, players_registered)));
+    emit_single(&out, "image_tagger_players_paired", "gauge",
+                "Players with a partner.",
+                sum(all, count, offsetof(Metrics, players_paired)));
+
+    emit_single(&out, "image_tagger_players_waiting", "gauge",
+                "Players waiting for a partner.",
+                sum(all, count, offsetof(Metrics, waiting)));
+    uint64_t oldest = 0;
+    uint64_t wait_max = 0;
+    for (int s = 0; s < count; s++){
+        uint64_t wait = metric_get(&all[s]->oldest_wait);
+        oldest = wait > oldest ? wait : oldest;
+        wait = metric_get(&all[s]->pairing_wait_max);
+        wait_max = wait > wait_max ? wait : wait_max;
+    }
+    emit_single(&out, "image_tagger_oldest_wait_seconds", "gauge",
+                "Wait of the player waiting longest.", oldest);
+    emit(&out, "# HELP image_tagger_pairing_wait_seconds Time players waited "
+         "in a queue before being paired.\n"
+         "# TYPE image_tagger_pairing_wait_seconds summary\n"
+         "image_tagger_pairing_wait_seconds_sum %llu\n"
+         "image_tagger_pairing_wait_seconds_count %llu\n",
+         (unsigned long long)sum(all, count,
+                                 offsetof(Metrics, pairing_wait_sum)),
+         (unsigned long long)sum(all, count,
+                                 offsetof(Metrics, pairing_wait_count)));
+    emit_single(&out, "image_tagger_pairing_wait_max_seconds", "gauge",
+                "Longest wait of a player paired.", wait_max);
+
+    emit_single(&out, "image_tagger_matches_total", "counter",
+                "Keywords agreed on.",
+                sum(all, count, offsetof(Metrics, matches)));
+    emit_single(&out, "image_tagger_images", "gauge",
+                "Images of the catalog.", global->images);
+
+    emit_single(&out, "image_tagger_tag_commits_total", "counter",
+                "Group commits of the tag log.", global->tag_commits);
+    emit_single(&out, "image_tagger_tag_records_total", "counter",
+                "Records written to the tag log.", global->tag_records);
+    emit_single(&out, "image_tagger_tag_write_failures_total", "counter",
+                "Failed writes of a batch to the tag log.",
+                global->tag_failures);
+    emit_single(&out, "image_tagger_tag_records_lost_total", "counter",
+                "Records given up after failed writes to the tag log.",
+                global->tag_lost);
+
+    text.text = out.text;
+    text.length = out.length;
+    return text;
+}
@@ -0,0 +1,154 @@
+/*
+** Metrics of image-tagger
+ * Every shard counts into its own Metrics and is the only writer of it, so
+ * a counter is bumped with a plain add published by a relaxed atomic
+ * store, no locked instruction on the hot path. Gauges are republished by
+ * the owning shard after it changes them. /metrics sums the metrics of all
+ * shards into the Prometheus text exposition format.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "http.h"
+#include "slice.h"
+
+/** Define the # finite latency buckets */
+#define NUM_BUCKETS 15
+
+/** Represents the routes counted */
+typedef enum
+{
+    ROUTE_ROOT,
+    ROUTE_START,
+    ROUTE_TAGS,
+    ROUTE_METRICS,
+    ROUTE_EVENTS,
+    ROUTE_IMAGE,
+    ROUTE_EXPORT,
+    ROUTE_NOT_FOUND,
+    ROUTE_BAD,
+    NUM_ROUTES
+} ROUTE;
+
+/** Represents what the timer wheels expire */
+typedef enum
+{
+    TIMEOUT_IDLE,
+    TIMEOUT_REQUEST,
+    TIMEOUT_WAIT,
+    TIMEOUT_GAME,
+    TIMEOUT_SESSION,
+    NUM_TIMEOUTS
+} TIMEOUT;
+
+/** Represents the methods counted, indexed by METHOD */
+#define NUM_METHODS (UNKNOWN + 1)
+
+/** A latency histogram
+ *  @param uint64_t buckets[NUM_BUCKETS + 1] The count per bucket, the last
+ *  one is above every bound
+ *  @param uint64_t sum The sum of the latencies in microseconds
+ *  @param uint64_t count The number of latencies
+ */
+typedef struct {
+    uint64_t buckets[NUM_BUCKETS + 1];
+    uint64_t sum;
+    uint64_t count;
+} Histogram;
+
+/** The metrics of one shard
+ *  @param uint64_t requests[NUM_ROUTES][NUM_METHODS] The requests served
+ *  @param Histogram latency[NUM_ROUTES] The time taken to answer requests
+ *  @param uint64_t throttled[NUM_ROUTES] The requests turned away with a 429
+ *  by the rate limiter
+ *  @param uint64_t bytes_written The bytes written to clients
+ *  @param uint64_t connections_opened The connections taken on
+ *  @param uint64_t connections_closed The connections closed
+ *  @param uint64_t connections_shed The connections turned away with a 503
+ *  while the server was saturated
+ *  @param uint64_t timeouts[NUM_TIMEOUTS] The connections closed and the
+ *  waits, games and sessions ended for inactivity
+ *  @param uint64_t matches The keywords agreed
+ *  @param uint64_t players_registered Gauge of the sessions in use
+ *  @param uint64_t players_paired Gauge of the players with a partner
+ *  @param uint64_t waiting Gauge of the players waiting for a partner
+ *  @param uint64_t oldest_wait Gauge of the seconds the longest waiting
+ *  player has waited
+ *  @param uint64_t pairing_wait_sum The seconds waited by players paired
+ *  @param uint64_t pairing_wait_count The number of players paired from a
+ *  waiting queue
+ *  @param uint64_t pairing_wait_max The longest wait of a player paired
+ */
+typedef struct {
+    uint64_t requests[NUM_ROUTES][NUM_METHODS];
+    Histogram latency[NUM_ROUTES];
+    uint64_t throttled[NUM_ROUTES];
+    uint64_t bytes_written;
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t connections_shed;
+    uint64_t timeouts[NUM_TIMEOUTS];
+    uint64_t matches;
+    uint64_t players_registered;
+    uint64_t players_paired;
+    uint64_t waiting;
+    uint64_t oldest_wait;
+    uint64_t pairing_wait_sum;
+    uint64_t pairing_wait_count;
+    uint64_t pairing_wait_max;
+} Metrics;
+
+/** Metrics kept outside the shards
+ *  @param uint64_t tag_commits The group commits of the tag store
+ *  @param uint64_t tag_records The records written by the tag store
+ *  @param uint64_t tag_failures The batches the tag store failed to write
+ *  @param uint64_t tag_lost The records the tag store gave up
+ *  @param uint64_t images The images of the catalog
+ */
+typedef struct {
+    uint64_t tag_commits;
+    uint64_t tag_records;
+    uint64_t tag_failures;
+    uint64_t tag_lost;
+    uint64_t images;
+} Global_metrics;
+
+/** Prototypes */
+void metrics_request(Metrics *metrics, ROUTE route, METHOD method,
+                     uint64_t latency);
+char const* metrics_route_name(ROUTE route);
+Slice metrics_render(Arena *arena, Metrics * const *all, int count,
+                     Global_metrics const *global);
+
+/**
+ * Add to a counter only the calling shard writes
+ * @param counter the counter
+ * @param n the amount
+ */
+static inline void metric_add(uint64_t *counter, uint64_t n){
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set a gauge only the calling shard writes
+ * @param gauge the gauge
+ * @param value the value
+ */
+static inline void metric_set(uint64_t *gauge, uint64_t value){
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read a counter or gauge of any shard
+ * @param metric the counter or gauge
+ * @return uint64_t the value
+ */
+static inline uint64_t metric_get(uint64_t const *metric){
+    return __atomic_load_n(metric, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,877 @@
+/*
+** Peer protocol of image-tagger
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "game.h"
+
+/** Define the milliseconds between two ticks, a lost link is tried again
+ *  every PEER_RETRY ticks */
+#define PEER_INTERVAL_MS 200
+#define PEER_RETRY 5
+
+/** Define the size of the header of a frame, its length and its type */
+#define FRAME_HEAD 5
+
+/** Define the longest payload of a frame */
+#define FRAME_MAX 65536
+
+/** Define the size of the fields of a message before its data */
+#define MESSAGE_HEAD 25
+
+/** Define the bytes a link may hold before it is given up */
+#define OUT_MAX (1 << 20)
+
+/** Define the longest line of the peers file */
+#define LINE_SIZE 256
+
+/** Represents the types of frame */
+typedef enum
+{
+    FRAME_HELLO,
+    FRAME_WAITING,
+    FRAME_MESSAGE,
+    FRAME_TAGGED
+} FRAME;
+
+/** Prototypes */
+static void handle_out(Event_loop *loop, int fd, unsigned events, void *data);
+static void handle_in(Event_loop *loop, int fd, unsigned events, void *data);
+
+/**
+ * Write a number in little endian
+ * @param out the 4 bytes written
+ * @param value the number
+ */
+static void put_u32(char *out, uint32_t value){
+    for (int b = 0; b < 4; b++){
+        out[b] = (char)(value >> (8 * b));
+    }
+}
+
+/**
+ * Read a number in little endian
+ * @param in the 4 bytes read
+ * @return uint32_t the number
+ */
+static uint32_t get_u32(char const *in){
+    unsigned char const *bytes = (unsigned char const *)in;
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * Find the link to a node
+ * @param set the links
+ * @param node the id of the node
+ * @return Peer* the link, NULL if the node is unknown
+ */
+static Peer* find_peer(Peer_set *set, int node){
+    for (int i = 0; i < set->count; i++){
+        if (set->peers[i].node == node){ return &set->peers[i]; }
+    }
+    return NULL;
+}
+
+/**
+ * Read the nodes, one "id host port" line each, the line of this node ends
+ * with "self"
+ * @param set the links, cleared first
+ * @param path the file
+ * @return int 0 on success, also when there is no file and the node runs
+ *             alone, -1 on failure
+ */
+int peers_load(Peer_set *set, char const *path){
+    memset(set, 0, sizeof(Peer_set));
+    set->listenfd = set->wakefd = set->timerfd = -1;
+    FILE *file = fopen(path, "r");
+    if (file == NULL){ return errno == ENOENT ? 0 : -1; }
+    char line[LINE_SIZE];
+    int number = 0;
+    bool self = false;
+    while (fgets(line, sizeof(line), file) != NULL){
+        number++;
+        char id[16], host[64], port[16], mark[16], extra[2];
+        int fields = sscanf(line, "%15s %63s %15s %15s %1s", id, host, port,
+                            mark, extra);
+        if (fields <= 0 || id[0] == '#'){ continue; }
+        char *id_end, *end;
+        long node = strtol(id, &id_end, 10);
+        long number_port = strtol(port, &end, 10);
+        bool is_self = fields == 4 && strcmp(mark, "self") == 0;
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)number_port);
+        if ((fields != 3 && !is_self) || node < 0 || node >= MAX_NODES ||
+            *id_end != '\0' || *end != '\0' || number_port <= 0 ||
+            number_port > 65535 ||
+            inet_pton(AF_INET, host, &address.sin_addr) != 1 ||
+            find_peer(set, node) != NULL || (self && set->node == node) ||
+            (self && is_self)){
+            fprintf(stderr, "%s:%d: expected a new node id below %d, an IPv4 "
+                    "address, a port and self on one line\n", path, number,
+                    MAX_NODES);
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+        if (is_self){
+            self = true;
+            set->node = node;
+            set->address = address;
+        }else{
+            Peer *peer = &set->peers[set->count++];
+            peer->node = node;
+            peer->address = address;
+        }
+    }
+    fclose(file);
+    if (!self || find_peer(set, set->node) != NULL){
+        fprintf(stderr, "%s: expected one line of this node, ending with "
+                "self\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Make room for bytes at the end of the frames a link has to write
+ * @param peer the link
+ * @param length the number of bytes
+ * @return int 0 on success, -1 when the link holds too much
+ */
+static int reserve(Peer *peer, size_t length){
+    if (peer->out_length + length > peer->out_capacity){
+        // the frames written whole make room first
+        memmove(peer->out, peer->out + peer->out_frame,
+                peer->out_length - peer->out_frame);
+        peer->out_head -= peer->out_frame;
+        peer->out_length -= peer->out_frame;
+        peer->out_frame = 0;
+    }
+    if (peer->out_length + length > peer->out_capacity){
+        if (peer->out_length + length > OUT_MAX){
+            errno = ENOBUFS;
+            return -1;
+        }
+        size_t capacity = peer->out_capacity > 0 ? peer->out_capacity : 4096;
+        while (capacity < peer->out_length + length){ capacity *= 2; }
+        char *out = realloc(peer->out, capacity);
+        if (out == NULL){ return -1; }
+        peer->out = out;
+        peer->out_capacity = capacity;
+    }
+    return 0;
+}
+
+/**
+ * Append a frame to a link, whole or not at all
+ * @param peer the link
+ * @param type the type of the frame
+ * @param payload the payload
+ * @param length the size of the payload, FRAME_MAX at most
+ * @return int 0 on success, -1 when the link holds too much
+ */
+static int append_frame(Peer *peer, FRAME type, char const *payload,
+                        size_t length){
+    if (reserve(peer, FRAME_HEAD + length) < 0){ return -1; }
+    char *out = peer->out + peer->out_length;
+    put_u32(out, length);
+    out[4] = (char)type;
+    memcpy(out + FRAME_HEAD, payload, length);
+    peer->out_length += FRAME_HEAD + length;
+    return 0;
+}
+
+/**
+ * Append a message of a shard to a link, it is addressed to a shard of the
+ * node and names the player of this node it comes from
+ * @param peer the link
+ * @param message the message, its shard set
+ * @return int 0 on success, -1 on failure
+ */
+static int append_message(Peer *peer, Message const *message){
+    char payload[FRAME_MAX];
+    if (message->length > FRAME_MAX - MESSAGE_HEAD){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    payload[0] = (char)message->type;
+    put_u32(payload + 1, message->shard % NODE_SHARDS);
+    put_u32(payload + 5, message->slot);
+    put_u32(payload + 9, message->peer_shard);
+    put_u32(payload + 13, message->peer_slot);
+    put_u32(payload + 17, message->game);
+    put_u32(payload + 21, message->image);
+    if (message->length > 0){
+        memcpy(payload + MESSAGE_HEAD, message->data, message->length);
+    }
+    return append_frame(peer, FRAME_MESSAGE, payload,
+                        MESSAGE_HEAD + message->length);
+}
+
+/**
+ * Reject an offer that never reached the shard it was sent to, so its
+ * player waits for another partner
+ * @param type the type of the message
+ * @param peer_shard the shard of the player offered
+ * @param peer_slot the player offered
+ * @param game the game of the player when offered
+ */
+static void turn_down(int type, int peer_shard, int peer_slot, int game){
+    if (type != MSG_PAIR_OFFER){ return; }
+    Message *reply = message_create(MSG_PAIR_REJECT, NULL, 0);
+    if (reply == NULL){ return; }
+    reply->slot = peer_slot;
+    reply->peer_shard = peers.node * NODE_SHARDS;
+    reply->game = game;
+    send_message(peer_shard, reply);
+}
+
+/**
+ * Forget the players waiting on a node
+ * @param set the links
+ * @param peer the link to the node
+ */
+static void forget_waiting(Peer_set *set, Peer *peer){
+    for (int image = 0; image < set->images; image++){
+        __atomic_store_n(&peer->waiting[image], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Close a link, the offers it did not write whole are rejected and the
+ * node counts as having nobody waiting until it is reached again
+ * @param set the links
+ * @param peer the link
+ */
+static void link_down(Peer_set *set, Peer *peer){
+    for (size_t at = peer->out_frame; at + FRAME_HEAD <= peer->out_length;
+         at += FRAME_HEAD + get_u32(peer->out + at)){
+        char const *payload = peer->out + at + FRAME_HEAD;
+        if (peer->out[at + 4] == FRAME_MESSAGE){
+            turn_down(payload[0], (int)get_u32(payload + 9),
+                      (int)get_u32(payload + 13), (int)get_u32(payload + 17));
+        }
+    }
+    event_loop_remove(set->loop, peer->fd);
+    close(peer->fd);
+    peer->fd = -1;
+    peer->connected = false;
+    peer->writing = false;
+    peer->out_frame = peer->out_head = peer->out_length = 0;
+    forget_waiting(set, peer);
+}
+
+/**
+ * Write what a link holds, as far as the socket takes it
+ * @param set the links
+ * @param peer the link, connected
+ * @return int 0 on success, -1 if the link failed
+ */
+static int flush(Peer_set *set, Peer *peer){
+    while (peer->out_head < peer->out_length){
+        ssize_t n = write(peer->fd, peer->out + peer->out_head,
+                          peer->out_length - peer->out_head);
+        if (n < 0 && errno == EINTR){ continue; }
+        if (n < 0 && errno == EAGAIN){ break; }
+        if (n < 0){ return -1; }
+        peer->out_head += n;
+    }
+    while (peer->out_frame + FRAME_HEAD <= peer->out_head){
+        size_t end = peer->out_frame + FRAME_HEAD +
+                     get_u32(peer->out + peer->out_frame);
+        if (end > peer->out_head){ break; }
+        peer->out_frame = end;
+    }
+    if (peer->out_head == peer->out_length){
+        peer->out_frame = peer->out_head = peer->out_length = 0;
+    }
+    bool writing = peer->out_length > 0;
+    if (writing != peer->writing){
+        peer->writing = writing;
+        return event_loop_modify(set->loop, peer->fd,
+                                 writing ? EVENT_READ | EVENT_WRITE :
+                                           EVENT_READ);
+    }
+    return 0;
+}
+
+/**
+ * Open a link, it is connected without blocking
+ * @param set the links
+ * @param peer the link, closed
+ */
+static void connect_peer(Peer_set *set, Peer *peer){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0){ return; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if ((connect(fd, (struct sockaddr *)&peer->address,
+                 sizeof(peer->address)) < 0 && errno != EINPROGRESS) ||
+        event_loop_add(set->loop, fd, EVENT_WRITE, handle_out, peer) < 0){
+        close(fd);
+        return;
+    }
+    peer->fd = fd;
+    peer->writing = true;
+}
+
+/**
+ * Greet a node once connected: this node, its images, its shards, and every
+ * image it has players waiting for
+ * @param set the links
+ * @param peer the link
+ * @return int 0 on success, -1 on failure
+ */
+static int say_hello(Peer_set *set, Peer *peer){
+    char hello[12];
+    put_u32(hello, set->node);
+    put_u32(hello + 4, set->images);
+    put_u32(hello + 8, num_shards);
+    if (append_frame(peer, FRAME_HELLO, hello, sizeof(hello)) < 0){
+        return -1;
+    }
+    char payload[FRAME_MAX];
+    size_t length = 0;
+    for (int image = 0; image < set->images; image++){
+        if (set->sent[image] == 0){ continue; }
+        put_u32(payload + length, image);
+        put_u32(payload + length + 4, set->sent[image]);
+        length += 8;
+        if (length == FRAME_MAX){
+            if (append_frame(peer, FRAME_WAITING, payload, length) < 0){
+                return -1;
+            }
+            length = 0;
+        }
+    }
+    return length > 0 ? append_frame(peer, FRAME_WAITING, payload, length) :
+                        0;
+}
+
+/**
+ * Handler of a link: completes the connection and writes what it holds,
+ * the node never writes on it, so a readable link is closed
+ * @param loop the event loop of the links
+ * @param fd the connection
+ * @param events the events that fired
+ * @param data the link
+ */
+static void handle_out(Event_loop *loop, int fd, unsigned events, void *data){
+    Peer *peer = data;
+    Peer_set *set = peer->set;
+    if (!peer->connected){
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 ||
+            error != 0 || (events & EVENT_ERROR)){
+            link_down(set, peer);
+            return;
+        }
+        peer->connected = true;
+        if (say_hello(set, peer) < 0){
+            link_down(set, peer);
+            return;
+        }
+    }
+    if (events & EVENT_READ){
+        char buffer[64];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+            link_down(set, peer);
+            return;
+        }
+    }
+    if (flush(set, peer) < 0){
+        link_down(set, peer);
+    }
+}
+
+/**
+ * Close a connection another node opened
+ * @param set the links
+ * @param input the connection
+ */
+static void close_input(Peer_set *set, Peer_input *input){
+    event_loop_remove(set->loop, input->fd);
+    close(input->fd);
+    if (input->node >= 0){
+        forget_waiting(set, &set->peers[input->node]);
+    }
+    input->fd = -1;
+    input->node = -1;
+    input->in_length = 0;
+}
+
+/**
+ * Handler of the listening socket, accepts the connections of other nodes
+ * @param loop the event loop of the links
+ * @param fd the listening socket
+ * @param events the events that fired
+ * @param data the links
+ */
+static void handle_accept(Event_loop *loop, int fd, unsigned events,
+                          void *data){
+    Peer_set *set = data;
+    for (;;){
+        struct sockaddr_in from;
+        socklen_t length = sizeof(from);
+        int client = accept4(fd, (struct sockaddr *)&from, &length,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0 && (errno == EINTR || errno == ECONNABORTED)){
+            continue;
+        }
+        if (client < 0){ return; }
+        Peer_input *input = NULL;
+        for (int i = 0; i < MAX_NODES && input == NULL; i++){
+            if (set->inputs[i].fd < 0){ input = &set->inputs[i]; }
+        }
+        if (input == NULL || (input->in == NULL &&
+            (input->in = malloc(FRAME_HEAD + FRAME_MAX)) == NULL) ||
+            event_loop_add(loop, client, EVENT_READ, handle_in, input) < 0){
+            close(client);
+            continue;
+        }
+        input->fd = client;
+        input->node = -1;
+        input->from = from.sin_addr;
+        input->in_length = 0;
+    }
+}
+
+/**
+ * Pick the shard a message addressed to any shard goes to: one that has a
+ * player waiting for the image, else the first
+ * @param image the image
+ * @return int the id of the shard
+ */
+static int pick_shard(int image){
+    for (int s = 0; s < num_shards; s++){
+        if (matchmaker_depth(&shards[s].matchmaker, image) > 0){ return s; }
+    }
+    return 0;
+}
+
+/**
+ * Have every shard with a player waiting for an image look for a partner
+ * again, another node has players waiting for it now
+ * @param set the links
+ * @param image the image
+ */
+static void retry_shards(Peer_set *set, int image){
+    for (int s = 0; s < num_shards; s++){
+        if (matchmaker_depth(&shards[s].matchmaker, image) == 0){ continue; }
+        Message *message = message_create(MSG_PAIR_RETRY, NULL, 0);
+        if (message == NULL){ return; }
+        message->image = image;
+        send_message(set->node * NODE_SHARDS + s, message);
+    }
+}
+
+/**
+ * Apply a frame a node sent
+ * @param set the links
+ * @param input the connection it came on
+ * @param type the type of the frame
+ * @param payload the payload
+ * @param length the size of the payload
+ * @return int 0 on success, -1 if the node broke the protocol
+ */
+static int receive(Peer_set *set, Peer_input *input, int type,
+                   char const *payload, size_t length){
+    if (type == FRAME_HELLO){
+        Peer *peer = length == 12 ? find_peer(set, get_u32(payload)) : NULL;
+        uint32_t shards = length == 12 ? get_u32(payload + 8) : 0;
+        if (peer == NULL || input->node >= 0 || shards == 0 ||
+            shards >= NODE_ANY){
+            return -1;
+        }
+        // only the host peers.txt lists for the node may speak for it
+        if (input->from.s_addr != peer->address.sin_addr.s_addr){
+            fprintf(stderr, "node %d said hello from %s\n", peer->node,
+                    inet_ntoa(input->from));
+            return -1;
+        }
+        if (get_u32(payload + 4) != (uint32_t)set->images){
+            fprintf(stderr, "node %d plays %u images, this one %d\n",
+                    peer->node, get_u32(payload + 4), set->images);
+            return -1;
+        }
+        // a node that connects again left its old connection behind
+        for (int i = 0; i < MAX_NODES; i++){
+            Peer_input *old = &set->inputs[i];
+            if (old != input && old->fd >= 0 && old->node == peer - set->peers){
+                close_input(set, old);
+            }
+        }
+        input->node = peer - set->peers;
+        __atomic_store_n(&peer->shards, (int)shards, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (input->node < 0){ return -1; }
+    Peer *peer = &set->peers[input->node];
+    if (type == FRAME_WAITING){
+        if (length % 8 != 0){ return -1; }
+        for (size_t at = 0; at < length; at += 8){
+            uint32_t image = get_u32(payload + at);
+            if (image >= (uint32_t)set->images){ continue; }
+            int waiting = (int)get_u32(payload + at + 4);
+            int old = __atomic_exchange_n(&peer->waiting[image], waiting,
+                                          __ATOMIC_RELAXED);
+            if (old == 0 && waiting > 0){
+                // the next game scheduled on this node joins them too, and
+                // the players already waiting here reach out to them
+                catalog_open(&catalog, image);
+                retry_shards(set, image);
+            }
+        }
+        return 0;
+    }
+    if (type == FRAME_TAGGED){
+        if (length % 8 != 0){ return -1; }
+        for (size_t at = 0; at < length; at += 8){
+            uint32_t image = get_u32(payload + at);
+            if (image < (uint32_t)set->images){
+                catalog_tagged_n(&catalog, image, get_u32(payload + at + 4));
+            }
+        }
+        return 0;
+    }
+    if (type != FRAME_MESSAGE || length < MESSAGE_HEAD){ return -1; }
+    int message_type = payload[0];
+    uint32_t shard = get_u32(payload + 1);
+    int peer_shard = (int)get_u32(payload + 9);
+    int image = (int)get_u32(payload + 21);
+    if (message_type < MSG_PAIR_OFFER || message_type > MSG_RESET ||
+        peer_shard / NODE_SHARDS != peer->node){
+        return -1;
+    }
+    if (shard == NODE_ANY){
+        shard = pick_shard(image);
+    }else if (shard >= (uint32_t)num_shards){
+        // the node runs fewer shards than when the message was sent
+        turn_down(message_type, peer_shard, (int)get_u32(payload + 13),
+                  (int)get_u32(payload + 17));
+        return 0;
+    }
+    Message *message = message_create(message_type, length > MESSAGE_HEAD ?
+                                      payload + MESSAGE_HEAD : NULL,
+                                      length - MESSAGE_HEAD);
+    if (message == NULL){ return 0; }
+    message->slot = (int)get_u32(payload + 5);
+    message->peer_shard = peer_shard;
+    message->peer_slot = (int)get_u32(payload + 13);
+    message->game = (int)get_u32(payload + 17);
+    message->image = image;
+    send_message(set->node * NODE_SHARDS + shard, message);
+    return 0;
+}
+
+/**
+ * Handler of a connection another node opened, reads its frames
+ * @param loop the event loop of the links
+ * @param fd the connection
+ * @param events the events that fired
+ * @param data the connection
+ */
+static void handle_in(Event_loop *loop, int fd, unsigned events, void *data){
+    Peer_input *input = data;
+    Peer_set *set = input->set;
+    ssize_t n = read(fd, input->in + input->in_length,
+                     FRAME_HEAD + FRAME_MAX - input->in_length);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)){ return; }
+    if (n <= 0){
+        close_input(set, input);
+        return;
+    }
+    input->in_length += n;
+    size_t at = 0;
+    while (input->in_length - at >= FRAME_HEAD){
+        uint32_t length = get_u32(input->in + at);
+        if (length > FRAME_MAX){
+            close_input(set, input);
+            return;
+        }
+        if (input->in_length - at < FRAME_HEAD + length){ break; }
+        if (receive(set, input, input->in[at + 4], input->in + at + FRAME_HEAD,
+                    length) < 0){
+            close_input(set, input);
+            return;
+        }
+        at += FRAME_HEAD + length;
+    }
+    memmove(input->in, input->in + at, input->in_length - at);
+    input->in_length -= at;
+}
+
+/**
+ * Send a frame of counts to every connected node
+ * @param set the links
+ * @param type the type of the frame
+ * @param payload the pairs of image and count
+ * @param length the size of payload
+ */
+static void broadcast(Peer_set *set, int type, char const *payload,
+                      size_t length){
+    for (int i = 0; i < set->count; i++){
+        Peer *peer = &set->peers[i];
+        if (peer->connected &&
+            append_frame(peer, type, payload, length) < 0){
+            link_down(set, peer);
+        }
+    }
+}
+
+/**
+ * Handler of the timer: tries the lost links again and tells the other
+ * nodes which counts of waiting players changed and how many tags were
+ * agreed on since the last tick
+ * @param loop the event loop of the links
+ * @param fd the timerfd
+ * @param events the events that fired
+ * @param data the links
+ */
+static void handle_tick(Event_loop *loop, int fd, unsigned events, void *data){
+    Peer_set *set = data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0){ return; }
+    if (set->ticks++ % PEER_RETRY == 0){
+        for (int i = 0; i < set->count; i++){
+            if (set->peers[i].fd < 0){ connect_peer(set, &set->peers[i]); }
+        }
+    }
+    char payload[FRAME_MAX];
+    size_t length = 0;
+    for (int image = 0; image < set->images; image++){
+        int waiting = 0;
+        for (int s = 0; s < num_shards; s++){
+            waiting += matchmaker_depth(&shards[s].matchmaker, image);
+        }
+        if (waiting == set->sent[image]){ continue; }
+        set->sent[image] = waiting;
+        put_u32(payload + length, image);
+        put_u32(payload + length + 4, waiting);
+        length += 8;
+        if (length == FRAME_MAX){
+            broadcast(set, FRAME_WAITING, payload, length);
+            length = 0;
+        }
+    }
+    if (length > 0){
+        broadcast(set, FRAME_WAITING, payload, length);
+        length = 0;
+    }
+    for (int image = 0; image < set->images; image++){
+        uint32_t tags = __atomic_exchange_n(&set->tagged[image], 0,
+                                            __ATOMIC_RELAXED);
+        if (tags == 0){ continue; }
+        put_u32(payload + length, image);
+        put_u32(payload + length + 4, tags);
+        length += 8;
+        if (length == FRAME_MAX){
+            broadcast(set, FRAME_TAGGED, payload, length);
+            length = 0;
+        }
+    }
+    if (length > 0){
+        broadcast(set, FRAME_TAGGED, payload, length);
+    }
+    for (int i = 0; i < set->count; i++){
+        Peer *peer = &set->peers[i];
+        if (peer->connected && flush(set, peer) < 0){
+            link_down(set, peer);
+        }
+    }
+}
+
+/**
+ * Handler of the eventfd: sends the messages of the shards on their links,
+ * an offer to a node that can not be reached is rejected at once
+ * @param loop the event loop of the links
+ * @param fd the eventfd
+ * @param events the events that fired
+ * @param data the links
+ */
+static void handle_wake(Event_loop *loop, int fd, unsigned events, void *data){
+    Peer_set *set = data;
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+        perror("read");
+    }
+    if (__atomic_load_n(&set->stopping, __ATOMIC_ACQUIRE)){
+        event_loop_stop(loop);
+        return;
+    }
+    Message *message;
+    while ((message = mailbox_pop(&set->outbox)) != NULL){
+        Peer *peer = find_peer(set, message->shard / NODE_SHARDS);
+        if (peer == NULL || !peer->connected ||
+            append_message(peer, message) < 0){
+            if (peer != NULL && peer->connected && errno == ENOBUFS){
+                link_down(set, peer);
+            }
+            turn_down(message->type, message->peer_shard, message->peer_slot,
+                      message->game);
+        }
+        message_free(message);
+    }
+    for (int i = 0; i < set->count; i++){
+        Peer *peer = &set->peers[i];
+        if (peer->connected && flush(set, peer) < 0){
+            link_down(set, peer);
+        }
+    }
+}
+
+/**
+ * The thread of the links
+ * @param arg the links
+ * @return NULL
+ */
+static void* peers_main(void *arg){
+    Peer_set *set = arg;
+    if (event_loop_run(set->loop) < 0){
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+/**
+ * Listen for the other nodes and start the thread that links them, nothing
+ * is done when the node runs alone
+ * @param set the links, loaded
+ * @param images the number of images
+ * @return int 0 on success, -1 on failure
+ */
+int peers_start(Peer_set *set, int images){
+    if (set->count == 0){ return 0; }
+    set->images = images;
+    set->sent = calloc(images + 1, sizeof(int));
+    set->tagged = calloc(images + 1, sizeof(uint32_t));
+    if (set->sent == NULL || set->tagged == NULL){ return -1; }
+    for (int i = 0; i < set->count; i++){
+        Peer *peer = &set->peers[i];
+        peer->set = set;
+        peer->fd = -1;
+        peer->waiting = calloc(images + 1, sizeof(int));
+        if (peer->waiting == NULL){ return -1; }
+    }
+    for (int i = 0; i < MAX_NODES; i++){
+        set->inputs[i].fd = -1;
+        set->inputs[i].node = -1;
+        set->inputs[i].set = set;
+    }
+    int one = 1;
+    struct itimerspec tick = {{0, PEER_INTERVAL_MS * 1000000},
+                              {0, PEER_INTERVAL_MS * 1000000}};
+    set->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                           SOCK_CLOEXEC, 0);
+    set->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    set->timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                  TFD_NONBLOCK | TFD_CLOEXEC);
+    set->loop = event_loop_create();
+    if (set->listenfd < 0 || set->wakefd < 0 || set->timerfd < 0 ||
+        set->loop == NULL || mailbox_init(&set->outbox) < 0 ||
+        setsockopt(set->listenfd, SOL_SOCKET, SO_REUSEADDR, &one,
+                   sizeof(one)) < 0 ||
+        bind(set->listenfd, (struct sockaddr *)&set->address,
+             sizeof(set->address)) < 0 ||
+        listen(set->listenfd, MAX_NODES) < 0 ||
+        timerfd_settime(set->timerfd, 0, &tick, NULL) < 0 ||
+        event_loop_add(set->loop, set->listenfd, EVENT_READ, handle_accept,
+                       set) < 0 ||
+        event_loop_add(set->loop, set->wakefd, EVENT_READ, handle_wake,
+                       set) < 0 ||
+        event_loop_add(set->loop, set->timerfd, EVENT_READ, handle_tick,
+                       set) < 0){
+        return -1;
+    }
+    errno = pthread_create(&set->thread, NULL, peers_main, set);
+    return errno == 0 ? 0 : -1;
+}
+
+/**
+ * Stop the thread of the links, the messages still held are lost
+ * @param set the links
+ */
+void peers_stop(Peer_set *set){
+    if (set->count == 0){ return; }
+    uint64_t one = 1;
+    __atomic_store_n(&set->stopping, true, __ATOMIC_RELEASE);
+    if (write(set->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        perror("write");
+    }
+    pthread_join(set->thread, NULL);
+}
+
+/**
+ * Hand a message to the thread of the links, it goes to a shard of another
+ * node
+ * @param set the links
+ * @param shard the receiving shard, node * NODE_SHARDS + its id
+ * @param message the message, freed once sent
+ */
+void peers_send(Peer_set *set, int shard, Message *message){
+    uint64_t one = 1;
+    if (set->count == 0){
+        turn_down(message->type, message->peer_shard, message->peer_slot,
+                  message->game);
+        message_free(message);
+        return;
+    }
+    message->shard = shard;
+    mailbox_push(&set->outbox, message);
+    if (write(set->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        perror("write");
+    }
+}
+
+/**
+ * The players waiting for an image on another node, as it last told
+ * @param set the links
+ * @param index the index of the node in the set
+ * @param image the image id
+ * @return int the number of players
+ */
+int peers_waiting(Peer_set const *set, int index, int image){
+    if (image < 0 || image >= set->images){ return 0; }
+    return __atomic_load_n(&set->peers[index].waiting[image],
+                           __ATOMIC_RELAXED);
+}
+
+/**
+ * The number of shards another node runs, as it said hello
+ * @param set the links
+ * @param node the id of the node
+ * @return int the number of shards, 0 if the node is unknown or never said
+ *             hello
+ */
+int peers_shards(Peer_set *set, int node){
+    Peer *peer = find_peer(set, node);
+    return peer == NULL ? 0 : __atomic_load_n(&peer->shards,
+                                              __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a tag agreed on for an image, the other nodes learn of it at the
+ * next tick so they schedule the image as this node does
+ * @param set the links
+ * @param image the image id
+ */
+void peers_tagged(Peer_set *set, int image){
+    if (set->count == 0 || image < 0 || image >= set->images){ return; }
+    __atomic_add_fetch(&set->tagged[image], 1, __ATOMIC_RELAXED);
+}
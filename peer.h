@@ -0,0 +1,149 @@
+/*
+** Peer protocol of image-tagger
+ * Several instances of the server pair their players with each other. Every
+ * instance, a node, listens for the other nodes on a port of its own and
+ * connects to each of them; it only writes on the connections it opened and
+ * only reads on those it accepted, from the host peers.txt lists for the
+ * node that says hello. A node tells the others every PEER_INTERVAL_MS how
+ * many of its players wait for the images whose count changed, so a shard
+ * knows which node may have a partner, and the next game scheduled on any
+ * node joins an image somebody waits on alone. The tags agreed on since the
+ * last tick go along, so every node orders the images by the tags of all of
+ * them; the tags themselves are only stored by the node that paired the
+ * players, and the counts sent while a node can not be reached are lost to
+ * it. The messages the shards exchange to pair players, offers and their
+ * answers, keywords and resets, go to the shard of another node over the
+ * same links, so a partner is claimed by the shard that owns the waiting
+ * player exactly as between two shards of one node, and keyword_match only
+ * reads the local copy of the keywords of the partner. The frames are a
+ * little endian length, a type and a payload. A node that can not be
+ * reached is tried again every second and counts as having nobody waiting,
+ * and an offer that can not be sent to it is rejected at once. One thread
+ * runs the links: the shards hand it messages through a mailbox and read
+ * the counts it keeps. Every node reads the nodes from its own peers.txt,
+ * one "id host port" line each, its own line ending with "self", so nodes
+ * on one machine run from directories of their own with the same
+ * images.txt.
+*/
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "mailbox.h"
+
+/** Define the max # nodes */
+#define MAX_NODES 16
+
+/** Define the span of shard ids of every node, a shard is known to every
+ *  node as node * NODE_SHARDS + its id */
+#define NODE_SHARDS 512
+
+/** Define the shard a message to another node is addressed to when any
+ *  shard of that node with a player waiting for its image may take it */
+#define NODE_ANY (NODE_SHARDS - 1)
+
+/** The link to another node
+ *  @param int node The id of the node
+ *  @param struct sockaddr_in address Where the node listens
+ *  @param void *set The set of links, for the handlers
+ *  @param int fd The connection opened to the node, -1 if none
+ *  @param bool connected The connection is established
+ *  @param bool writing The connection waits to be writable
+ *  @param char *out The frames not written yet
+ *  @param size_t out_frame The start of the first frame not written whole
+ *  @param size_t out_head The bytes of out already written
+ *  @param size_t out_length The bytes in out
+ *  @param size_t out_capacity The size of out
+ *  @param int *waiting The players waiting for every image on the node
+ *  @param int shards The number of shards the node runs, 0 until it says
+ *         hello
+ */
+typedef struct {
+    int node;
+    struct sockaddr_in address;
+    void *set;
+    int fd;
+    bool connected;
+    bool writing;
+    char *out;
+    size_t out_frame;
+    size_t out_head;
+    size_t out_length;
+    size_t out_capacity;
+    int *waiting;
+    int shards;
+} Peer;
+
+/** A connection another node opened to this one
+ *  @param int fd The connection, -1 if the entry is unused
+ *  @param int node The index of the node in the set, -1 until it says hello
+ *  @param struct in_addr from The address the connection comes from
+ *  @param void *set The set of links, for the handlers
+ *  @param char *in The bytes read and not parsed yet, room for one frame
+ *  @param size_t in_length The bytes in in
+ */
+typedef struct {
+    int fd;
+    int node;
+    struct in_addr from;
+    void *set;
+    char *in;
+    size_t in_length;
+} Peer_input;
+
+/** The links of this node to every other
+ *  @param int node The id of this node, 0 if it runs alone
+ *  @param struct sockaddr_in address Where this node listens for the others
+ *  @param int count The number of other nodes, 0 if it runs alone
+ *  @param Peer peers[MAX_NODES] The other nodes
+ *  @param Peer_input inputs[MAX_NODES] The connections they opened
+ *  @param int images The number of images, the same on every node
+ *  @param int *sent The players waiting for every image as last sent
+ *  @param uint32_t *tagged The tags agreed on for every image since the
+ *         last tick
+ *  @param int listenfd The socket the other nodes connect to
+ *  @param int wakefd The eventfd signalled when the outbox is pushed
+ *  @param int timerfd The timerfd ticking every PEER_INTERVAL_MS
+ *  @param int ticks The number of ticks so far
+ *  @param Mailbox outbox The messages of the shards to other nodes
+ *  @param Event_loop *loop The event loop of the links
+ *  @param pthread_t thread The thread running the loop
+ *  @param bool stopping The thread stops at its next wakeup
+ */
+typedef struct {
+    int node;
+    struct sockaddr_in address;
+    int count;
+    Peer peers[MAX_NODES];
+    Peer_input inputs[MAX_NODES];
+    int images;
+    int *sent;
+    uint32_t *tagged;
+    int listenfd;
+    int wakefd;
+    int timerfd;
+    int ticks;
+    Mailbox outbox;
+    Event_loop *loop;
+    pthread_t thread;
+    bool stopping;
+} Peer_set;
+
+/** Prototypes */
+int peers_load(Peer_set *set, char const *path);
+int peers_start(Peer_set *set, int images);
+void peers_stop(Peer_set *set);
+void peers_send(Peer_set *set, int shard, Message *message);
+int peers_waiting(Peer_set const *set, int index, int image);
+int peers_shards(Peer_set *set, int node);
+void peers_tagged(Peer_set *set, int image);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+** Rate limiter of image-tagger
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rate_limit.h"
+
+/** Define the longest line of the limits file */
+#define LINE_SIZE 256
+
+/**
+ * Read a count of tokens as fixed point
+ * @param text the count, a decimal number
+ * @param out set to the count times RATE_SCALE
+ * @return Boolean true if it is a number that fits
+ */
+static bool read_tokens(char const *text, uint32_t *out){
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= 0) ||
+        value * RATE_SCALE > UINT32_MAX / 2){
+        return false;
+    }
+    *out = (uint32_t)(value * RATE_SCALE + 0.5);
+    return true;
+}
+
+/**
+ * Read the limit of every route, one "route rate burst" line each, a route
+ * not listed or with a rate of 0 is not limited
+ * @param limits the limits, NUM_ROUTES of them
+ * @param path the file
+ * @return int 0 on success, also when there is no file and nothing is
+ *             limited, -1 on failure
+ */
+int rate_limits_load(Rate_limit *limits, char const *path){
+    memset(limits, 0, NUM_ROUTES * sizeof(Rate_limit));
+    FILE *file = fopen(path, "r");
+    if (file == NULL){ return errno == ENOENT ? 0 : -1; }
+    char line[LINE_SIZE];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL){
+        number++;
+        char name[32], rate[32], burst[32], extra[2];
+        int fields = sscanf(line, "%31s %31s %31s %1s", name, rate, burst,
+                            extra);
+        if (fields <= 0 || name[0] == '#'){ continue; }
+        int route = 0;
+        while (route < NUM_ROUTES &&
+               strcmp(name, metrics_route_name(route))){
+            route++;
+        }
+        Rate_limit limit;
+        if (fields != 3 || route == NUM_ROUTES ||
+            !read_tokens(rate, &limit.rate) ||
+            !read_tokens(burst, &limit.burst) ||
+            (limit.rate > 0 && limit.burst < RATE_SCALE)){
+            fprintf(stderr, "%s:%d: expected a route, a rate and a burst "
+                    "of 1 at least\n", path, number);
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+        limits[route] = limit;
+    }
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Take a token from the bucket of a client, the request is served only if
+ * there was one
+ * @param limiter the buckets of the shard
+ * @param route the route of the request
+ * @param address the IPv4 address of the client, network order
+ * @param player the slot of the player on the shard, -1 if it has none and
+ *               the client is told by its address
+ * @param now the current millisecond
+ * @return Boolean true if the request may be served
+ */
+bool rate_limit_take(Rate_limiter *limiter, ROUTE route, uint32_t address,
+                     int player, uint32_t now){
+    Rate_limit const *limit = &limiter->limits[route];
+    if (limit->rate == 0){ return true; }
+    uint64_t key = (uint64_t)1 << 48 | (uint64_t)route << 40 |
+                   (player >= 0 ? (uint64_t)1 << 32 | (uint32_t)player :
+                                  address);
+    uint32_t hash = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
+
+    Rate_bucket *bucket = NULL;
+    Rate_bucket *oldest = NULL;
+    for (int p = 0; p < RATE_PROBES; p++){
+        Rate_bucket *probe = &limiter->buckets[(hash + p) &
+                                               (RATE_BUCKETS - 1)];
+        if (probe->key == key){
+            bucket = probe;
+            break;
+        }
+        if (oldest == NULL || probe->key == 0 ||
+            (oldest->key != 0 &&
+             now - probe->updated_at > now - oldest->updated_at)){
+            oldest = probe;
+        }
+    }
+    if (bucket == NULL){
+        // a new client starts with a full bucket
+        bucket = oldest;
+        bucket->key = key;
+        bucket->tokens = limit->burst;
+        bucket->updated_at = now;
+    }else{
+        // the time is consumed only once it adds a token fraction, the
+        // requests coming closer together still refill the bucket
+        uint64_t added = (uint64_t)(now - bucket->updated_at) * limit->rate /
+                         1000;
+        if (added > 0){
+            uint64_t tokens = bucket->tokens + added;
+            bucket->tokens = tokens < limit->burst ? tokens : limit->burst;
+            bucket->updated_at = now;
+        }
+    }
+    if (bucket->tokens < RATE_SCALE){ return false; }
+    bucket->tokens -= RATE_SCALE;
+    return true;
+}
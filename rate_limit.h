@@ -0,0 +1,65 @@
+/*
+** Rate limiter of image-tagger
+ * Every client gets a token bucket per route: a request takes one token,
+ * the bucket refills at the rate of the route up to its burst, and a
+ * request finding it empty is turned away before any game logic runs. A
+ * registered player is told apart by its session, anyone else by its
+ * address. Every shard keeps the buckets of the clients it serves in a
+ * fixed hash table, a key is looked for in a few buckets from its hash on
+ * and takes the least recently used of them when it is not found, so a
+ * flood of new clients costs no memory and only forgets the idlest ones.
+*/
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+/** Define the # buckets of a shard, a power of two */
+#define RATE_BUCKETS 8192
+
+/** Define the # buckets a key may be kept in */
+#define RATE_PROBES 8
+
+/** Define the fraction of a token counted, the tokens are fixed point */
+#define RATE_SCALE 1000
+
+/** The limit of a route
+ *  @param uint32_t rate The tokens added per second times RATE_SCALE, 0 if
+ *  the route is not limited
+ *  @param uint32_t burst The tokens a bucket holds times RATE_SCALE
+ */
+typedef struct {
+    uint32_t rate;
+    uint32_t burst;
+} Rate_limit;
+
+/** The tokens of one client on one route
+ *  @param uint64_t key The client and the route, 0 if the bucket is unused
+ *  @param uint32_t tokens The tokens left at updated_at times RATE_SCALE
+ *  @param uint32_t updated_at The millisecond the tokens were counted
+ */
+typedef struct {
+    uint64_t key;
+    uint32_t tokens;
+    uint32_t updated_at;
+} Rate_bucket;
+
+/** The buckets of one shard, only used by its thread
+ *  @param Rate_limit const *limits The limit of every route, shared
+ *  @param Rate_bucket buckets[RATE_BUCKETS] The buckets
+ */
+typedef struct {
+    Rate_limit const *limits;
+    Rate_bucket buckets[RATE_BUCKETS];
+} Rate_limiter;
+
+/** Prototypes */
+int rate_limits_load(Rate_limit *limits, char const *path);
+bool rate_limit_take(Rate_limiter *limiter, ROUTE route, uint32_t address,
+                     int player, uint32_t now);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+** Session store of image-tagger
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "session.h"
+
+/** Define the magic number of a snapshot file, "ITSS" */
+#define SNAPSHOT_MAGIC 0x53535449
+
+/** Define the layout version of a snapshot file */
+#define SNAPSHOT_VERSION 1
+
+/**
+ * Initialise an empty store
+ * @param store the session store
+ * @param limit the max # sessions
+ */
+void session_store_init(Session_store *store, int limit){
+    memset(store, 0, sizeof(Session_store));
+    store->limit = limit;
+}
+
+/**
+ * Allocate one more slab
+ * @param store the session store
+ * @return int 0 on success, -1 otherwise
+ */
+static int add_slab(Session_store *store){
+    if (store->num_slabs == store->max_slabs){
+        int max_slabs = store->max_slabs ? store->max_slabs * 2 : 16;
+        Session **hot = realloc(store->hot, max_slabs * sizeof(Session *));
+        if (hot == NULL){ return -1; }
+        store->hot = hot;
+        Session_data **cold = realloc(store->cold,
+                                      max_slabs * sizeof(Session_data *));
+        if (cold == NULL){ return -1; }
+        store->cold = cold;
+        store->max_slabs = max_slabs;
+    }
+    Session *hot = calloc(SLAB_SIZE, sizeof(Session));
+    Session_data *cold = calloc(SLAB_SIZE, sizeof(Session_data));
+    if (hot == NULL || cold == NULL){
+        free(hot);
+        free(cold);
+        return -1;
+    }
+    store->hot[store->num_slabs] = hot;
+    store->cold[store->num_slabs] = cold;
+    store->num_slabs++;
+    return 0;
+}
+
+/**
+ * Hand out a slot for a new player, released slots first
+ * @param store the session store
+ * @return int the slot, -1 if the store is full
+ */
+int session_create(Session_store *store){
+    int slot;
+    if (store->num_free > 0){
+        slot = store->free_slots[--store->num_free];
+    }else{
+        if (store->count == store->limit){ return -1; }
+        if (store->count == store->num_slabs * SLAB_SIZE &&
+            add_slab(store) < 0){
+            return -1;
+        }
+        slot = store->count++;
+    }
+    Session *session = session_get(store, slot);
+    session->other_index = -1;
+    session->other_shard = -1;
+    session->pending = false;
+    session->image_index = -1;
+    session->queue = -1;
+    session->in_use = true;
+    session->last_active = session_now();
+    memset(session_data(store, slot), 0, sizeof(Session_data));
+    store->active++;
+    return slot;
+}
+
+/**
+ * Make room for one more released slot
+ * @param store the session store
+ * @return int 0 on success, -1 otherwise
+ */
+static int reserve_free(Session_store *store){
+    if (store->num_free == store->free_capacity){
+        int capacity = store->free_capacity ? store->free_capacity * 2 : 64;
+        int *free_slots = realloc(store->free_slots, capacity * sizeof(int));
+        if (free_slots == NULL){ return -1; }
+        store->free_slots = free_slots;
+        store->free_capacity = capacity;
+    }
+    return 0;
+}
+
+/**
+ * Give a slot back, cookies naming its old generation stop matching
+ * @param store the session store
+ * @param slot the slot
+ */
+void session_release(Session_store *store, int slot){
+    Session *session = session_get(store, slot);
+    if (!session->in_use){ return; }
+    // without room to remember it the slot is simply not reused
+    if (reserve_free(store) < 0){ return; }
+    session->in_use = false;
+    session->other_index = -1;
+    timer_cancel(&session_data(store, slot)->timer);
+    keyword_set_free(&session_data(store, slot)->keywords);
+    keyword_set_free(&session_data(store, slot)->partner_keywords);
+    session->generation++;
+    store->free_slots[store->num_free++] = slot;
+    store->active--;
+}
+
+/**
+ * A cheap coarse clock for idle tracking
+ * @return uint32_t the current second of the monotonic clock
+ */
+uint32_t session_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint32_t)now.tv_sec;
+}
+
+/**
+ * Copy every slot handed out into memory, quick enough for the loop of the
+ * shard, the copy is written to a file by session_snapshot_write
+ * @param store the session store
+ * @param key the value session_store_load has to be given
+ * @param snapshot filled in, its data is to be freed
+ * @return int 0 on success, -1 otherwise
+ */
+int session_store_snapshot(Session_store const *store, uint32_t key,
+                           Snapshot *snapshot){
+    size_t length = sizeof(Snapshot_header) + store->count * sizeof(Session);
+    for (int i = 0; i < store->count; i++){
+        if (session_get(store, i)->in_use){
+            Session_data const *data = session_data(store, i);
+            length += MAX_C + keyword_set_saved_size(&data->keywords) +
+                      keyword_set_saved_size(&data->partner_keywords);
+        }
+    }
+    char *content = malloc(length);
+    if (content == NULL){ return -1; }
+
+    Snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, key,
+                              sizeof(Session), store->count, session_now(),
+                              (uint64_t)time(NULL), length};
+    memcpy(content, &header, sizeof(header));
+    char *at = content + sizeof(header);
+    for (int i = 0; i < store->count; i += SLAB_SIZE){
+        int n = store->count - i < SLAB_SIZE ? store->count - i : SLAB_SIZE;
+        memcpy(at, store->hot[i / SLAB_SIZE], n * sizeof(Session));
+        at += n * sizeof(Session);
+    }
+    for (int i = 0; i < store->count; i++){
+        if (session_get(store, i)->in_use){
+            Session_data const *data = session_data(store, i);
+            memcpy(at, data->username, MAX_C);
+            at += MAX_C;
+            at += keyword_set_save(&data->keywords, at);
+            at += keyword_set_save(&data->partner_keywords, at);
+        }
+    }
+    snapshot->data = content;
+    snapshot->length = length;
+    return 0;
+}
+
+/**
+ * Write a snapshot to its file through a temporary file that is synced and
+ * renamed over it, then sync the directory, so a crash leaves either the
+ * old file or the new one whole
+ * @param snapshot the snapshot
+ * @param path the snapshot file
+ * @return int 0 on success, -1 otherwise
+ */
+int session_snapshot_write(Snapshot const *snapshot, char const *path){
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0){ return -1; }
+    size_t written = 0;
+    while (written < snapshot->length){
+        ssize_t n = write(fd, snapshot->data + written,
+                          snapshot->length - written);
+        if (n < 0 && errno == EINTR){ continue; }
+        if (n < 0){ break; }
+        written += n;
+    }
+    if (written < snapshot->length || fsync(fd) < 0){
+        int error = errno;
+        close(fd);
+        unlink(temp);
+        errno = error;
+        return -1;
+    }
+    close(fd);
+    if (rename(temp, path) < 0){ return -1; }
+    // the rename only lasts once the directory holding it is synced
+    char dir[PATH_MAX] = ".";
+    char const *slash = strrchr(path, '/');
+    if (slash != NULL){
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path) + 1, path);
+    }
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0){ return -1; }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+/**
+ * Empty a store that was partly loaded
+ * @param store the session store
+ */
+static void reset_store(Session_store *store){
+    for (int i = 0; i < store->count; i++){
+        keyword_set_free(&session_data(store, i)->keywords);
+        keyword_set_free(&session_data(store, i)->partner_keywords);
+    }
+    for (int i = 0; i < store->num_slabs; i++){
+        free(store->hot[i]);
+        free(store->cold[i]);
+    }
+    free(store->hot);
+    free(store->cold);
+    free(store->free_slots);
+    session_store_init(store, store->limit);
+}
+
+/**
+ * Fill an empty store from the content of a snapshot file
+ * @param store the session store, empty
+ * @param map the content
+ * @param size the size of the content
+ * @param key the value the snapshot was saved with
+ * @return int 0 on success, -1 otherwise
+ */
+static int load_slots(Session_store *store, char const *map, size_t size,
+                      uint32_t key){
+    Snapshot_header header;
+    memcpy(&header, map, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.key != key || header.session_size != sizeof(Session) ||
+        header.length != size || header.count > (uint32_t)store->limit ||
+        header.count > (size - sizeof(header)) / sizeof(Session)){
+        errno = EINVAL;
+        return -1;
+    }
+    int count = header.count;
+    while (store->num_slabs * SLAB_SIZE < count){
+        if (add_slab(store) < 0){ return -1; }
+    }
+    char const *at = map + sizeof(header);
+    for (int i = 0; i < count; i += SLAB_SIZE){
+        int n = count - i < SLAB_SIZE ? count - i : SLAB_SIZE;
+        memcpy(store->hot[i / SLAB_SIZE], at, n * sizeof(Session));
+        at += n * sizeof(Session);
+    }
+    store->count = count;
+
+    // the clocks are moved to this boot as if the time down had passed
+    uint32_t now = session_now();
+    uint64_t wall = (uint64_t)time(NULL);
+    uint32_t down = wall > header.saved_time ? wall - header.saved_time : 0;
+    char const *end = map + size;
+    for (int i = 0; i < count; i++){
+        Session *session = session_get(store, i);
+        // offers in flight and the queues are not saved
+        session->pending = false;
+        session->queue = -1;
+        session->queue_prev = -1;
+        session->queue_next = -1;
+        if (!session->in_use){ continue; }
+        session->last_active = now - down -
+                               (header.saved_at - session->last_active);
+        session->queued_at = now - down -
+                             (header.saved_at - session->queued_at);
+        Session_data *data = session_data(store, i);
+        if (end - at < MAX_C){
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(data->username, at, MAX_C);
+        data->username[MAX_C - 1] = '\0';
+        at += MAX_C;
+        long n = keyword_set_load(&data->keywords, at, end - at);
+        long m = n < 0 ? -1 :
+                 keyword_set_load(&data->partner_keywords, at + n,
+                                  end - at - n);
+        if (m < 0){
+            errno = EINVAL;
+            return -1;
+        }
+        at += n + m;
+        store->active++;
+    }
+    // the lowest free slot is handed out first
+    for (int i = count - 1; i >= 0; i--){
+        if (!session_get(store, i)->in_use){
+            if (reserve_free(store) < 0){ return -1; }
+            store->free_slots[store->num_free++] = i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Load a snapshot file written by session_store_save into an empty store,
+ * which stays empty if the file can not be used
+ * @param store the session store, empty
+ * @param path the snapshot file
+ * @param key the value the snapshot has to be saved with
+ * @return int 0 on success, -1 otherwise
+ */
+int session_store_load(Session_store *store, char const *path, uint32_t key){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){ return -1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Snapshot_header)){
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){ return -1; }
+    int result = load_slots(store, map, st.st_size, key);
+    int error = errno;
+    munmap(map, st.st_size);
+    if (result < 0){
+        reset_store(store);
+        errno = error;
+    }
+    return result;
+}
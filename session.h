@@ -0,0 +1,177 @@
+/*
+** Session store of image-tagger
+ * Player sessions live in slabs that are allocated as the store grows and
+ * never move. The fields touched on every request and by pairing are kept
+ * apart from the username and keywords, released slots are recycled through
+ * a free list and carry a generation so a stale cookie can not reach the
+ * player that reuses its slot. A store can be copied to a snapshot, which
+ * another thread writes to a file, and loaded back by a later process, so
+ * cookies handed out stay valid.
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "keyword_set.h"
+#include "timer_wheel.h"
+
+/** Define the max char length */
+#define MAX_C 20
+
+/** Define the # sessions allocated at once */
+#define SLAB_SIZE 1024
+
+/** The hot part of a session
+ *  @param int other_index The slot of the paired player in each game turn,
+ *  not paired is -1
+ *  @param int other_shard The shard whose store other_index refers to,
+ *  node * NODE_SHARDS + its id
+ *  @param int game The counter of games played, stale shard messages are ignored
+ *  @param uint32_t last_active The second of the last request
+ *  @param int image_index The id of the image used in each turn, -1 before
+ *  the first game
+ *  @param int queue The image whose waiting queue holds the player, -1 if
+ *  not waiting
+ *  @param uint32_t queued_at The second the player joined the queue
+ *  @param int queue_prev The slot queued before, -1 at the head
+ *  @param int queue_next The slot queued after, -1 at the tail
+ *  @param uint8_t stage The PAGE that server sent to client previously
+ *  @param bool pending A pairing offer to another shard is waiting for reply
+ *  @param bool in_use The slot holds a registered player
+ *  @param uint8_t generation Bumped every time the slot is released
+ */
+typedef struct {
+    int other_index;
+    int other_shard;
+    int game;
+    uint32_t last_active;
+    int image_index;
+    int queue;
+    uint32_t queued_at;
+    int queue_prev;
+    int queue_next;
+    uint8_t stage;
+    bool pending;
+    bool in_use;
+    uint8_t generation;
+} Session;
+
+/** The cold part of a session
+ *  @param char username[MAX_C] The username
+ *  @param Keyword_set keywords The keyword set stores all keywords input in each turn
+ *  @param Keyword_set partner_keywords A copy of the keywords of a paired
+ *  player living on another shard
+ *  @param void *waiter The connection parked by GET /events until the state
+ *  of the player changes, NULL if none
+ *  @param uint8_t waiter_state The state the waiter was parked in
+ *  @param uint32_t parked_at The second the waiter was parked
+ *  @param int waiter_prev The slot parked before, -1 at the head
+ *  @param int waiter_next The slot parked after, -1 at the tail
+ *  @param Timer timer Ends the wait, the game or the session of a player
+ *  gone idle
+ */
+typedef struct {
+    char username[MAX_C];
+    Keyword_set keywords;
+    Keyword_set partner_keywords;
+    void *waiter;
+    uint8_t waiter_state;
+    uint32_t parked_at;
+    int waiter_prev;
+    int waiter_next;
+    Timer timer;
+} Session_data;
+
+/** The sessions of one shard
+ *  @param Session **hot The slabs of hot fields
+ *  @param Session_data **cold The slabs of cold fields
+ *  @param int num_slabs The number of slabs allocated
+ *  @param int max_slabs The capacity of the slab tables
+ *  @param int limit The max # sessions
+ *  @param int count The number of slots ever handed out
+ *  @param int active The number of slots in use
+ *  @param int *free_slots The released slots
+ *  @param int num_free The number of released slots
+ *  @param int free_capacity The capacity of free_slots
+ */
+typedef struct {
+    Session **hot;
+    Session_data **cold;
+    int num_slabs;
+    int max_slabs;
+    int limit;
+    int count;
+    int active;
+    int *free_slots;
+    int num_free;
+    int free_capacity;
+} Session_store;
+
+/** The head of a snapshot file, followed by the hot fields of every slot
+ *  handed out and then, for every slot in use, the username and both
+ *  keyword sets
+ *  @param uint32_t magic Identifies the file
+ *  @param uint32_t version The layout version
+ *  @param uint32_t key A value the loader has to match, such as the number
+ *  of shards the slots were numbered for
+ *  @param uint32_t session_size The size of a Session when written
+ *  @param uint32_t count The number of slots handed out
+ *  @param uint32_t saved_at The second of session_now when written
+ *  @param uint64_t saved_time The unix time when written
+ *  @param uint64_t length The size of the file
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t key;
+    uint32_t session_size;
+    uint32_t count;
+    uint32_t saved_at;
+    uint64_t saved_time;
+    uint64_t length;
+} Snapshot_header;
+
+/** A snapshot copied from a store and not written yet
+ *  @param char *data The content of the snapshot file
+ *  @param size_t length The size of data
+ */
+typedef struct {
+    char *data;
+    size_t length;
+} Snapshot;
+
+/** Prototypes */
+void session_store_init(Session_store *store, int limit);
+int session_create(Session_store *store);
+void session_release(Session_store *store, int slot);
+uint32_t session_now(void);
+int session_store_snapshot(Session_store const *store, uint32_t key,
+                           Snapshot *snapshot);
+int session_snapshot_write(Snapshot const *snapshot, char const *path);
+int session_store_load(Session_store *store, char const *path, uint32_t key);
+
+/**
+ * The hot fields of a slot
+ * @param store the session store
+ * @param slot a slot below store->count
+ * @return Session* the session
+ */
+static inline Session* session_get(Session_store const *store, int slot){
+    return &store->hot[slot / SLAB_SIZE][slot % SLAB_SIZE];
+}
+
+/**
+ * The cold fields of a slot
+ * @param store the session store
+ * @param slot a slot below store->count
+ * @return Session_data* the username and keywords
+ */
+static inline Session_data* session_data(Session_store const *store, int slot){
+    return &store->cold[slot / SLAB_SIZE][slot % SLAB_SIZE];
+}
+
+#endif
@@ -0,0 +1,21 @@
+/*
+** Slices of image-tagger
+ * A pointer and a length into text owned by someone else, used for page
+ * segments and for the pieces of a parsed request.
+*/
+
+#ifndef SLICE_H
+#define SLICE_H
+
+#include <stddef.h>
+
+/** A piece of text that is not owned
+ *  @param char const *text The first character
+ *  @param size_t length The number of characters
+ */
+typedef struct {
+    char const *text;
+    size_t length;
+} Slice;
+
+#endif
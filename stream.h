@@ -0,0 +1,38 @@
+/*
+** Streamed bodies of image-tagger
+ * A body whose length is not known when its header is sent is pulled from
+ * a producer a piece at a time, only when the socket has taken the last
+ * piece, so a large body needs no more memory than one piece and a slow
+ * client only slows down its own response. HTTP/1.1 bodies go out in
+ * chunks, an HTTP/1.0 body ends where the connection is closed.
+*/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Produces the next piece of a body
+ *  @param state the state of the producer
+ *  @param out the buffer the piece is written to
+ *  @param size the room in out
+ *  @return long the bytes written, 0 at the end of the body, -1 on failure
+ */
+typedef long (*Stream_fill)(void *state, char *out, size_t size);
+
+/** A body being streamed
+ *  @param Stream_fill fill The producer, NULL if there is no stream
+ *  @param void (*release)(void *state) Frees the state, once the body is
+ *  sent or abandoned
+ *  @param void *state The state of the producer
+ *  @param bool chunked The body is sent with chunked transfer-encoding
+ */
+typedef struct {
+    Stream_fill fill;
+    void (*release)(void *state);
+    void *state;
+    bool chunked;
+} Stream;
+
+#endif
@@ -0,0 +1,500 @@
+/*
+** Tag store of image-tagger
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "keyword_set.h"
+#include "tag_store.h"
+
+/** Define the magic number of the index file ("ITAG") */
+#define INDEX_MAGIC 0x47415449
+
+/** Define the layout version of the index file */
+#define INDEX_VERSION 2
+
+/** Define the initial # pending records */
+#define PENDING_SIZE 64
+
+/** Define the # writes of a batch before it is given up, and the seconds
+ *  between two */
+#define TAG_RETRIES 3
+#define TAG_RETRY_DELAY 1
+
+/** Define the seconds the index may trail the log before it is synced */
+#define INDEX_SYNC_DELAY 5
+
+/** Define the # slots a scan visits per call, so it holds the index lock
+ *  only briefly */
+#define SCAN_SLOTS 4096
+
+/**
+ * The check value of a record
+ * @param record the record
+ * @return uint32_t the hash of everything after the check field
+ */
+static uint32_t record_check(Tag_record const *record){
+    return keyword_hash((char const *)record + sizeof(record->check),
+                        sizeof(Tag_record) - sizeof(record->check));
+}
+
+/**
+ * Count a record into the index
+ * @param index the index
+ * @param record a valid record
+ */
+static void count_record(Tag_index *index, Tag_record const *record){
+    char keyword[TAG_LENGTH] = {0};
+    memcpy(keyword, record->keyword, record->length);
+    index->totals[record->image]++;
+    uint32_t mask = TAG_SLOTS - 1;
+    uint32_t first = (keyword_hash(keyword, record->length) ^
+                      record->image * 0x9e3779b1u) & mask;
+    uint32_t i = first;
+    do {
+        Tag_count *tag = &index->slots[i];
+        if (tag->count == 0){
+            // a new keyword of the image, chained in front of the others
+            memcpy(tag->keyword, keyword, TAG_LENGTH);
+            tag->image = record->image;
+            tag->count = 1;
+            tag->next = index->first[record->image];
+            index->first[record->image] = i + 1;
+            return;
+        }
+        if (tag->image == record->image &&
+            !memcmp(tag->keyword, keyword, TAG_LENGTH)){
+            tag->count++;
+            return;
+        }
+        i = (i + 1) & mask;
+    } while (i != first);
+    // the table is full, the record stays in the log only
+}
+
+/**
+ * Check whether a record read back from the log is whole
+ * @param record the record
+ * @return Boolean true if it can be counted
+ */
+static bool record_valid(Tag_record const *record){
+    return record->check == record_check(record) &&
+           record->image < TAG_IMAGES && record->length > 0 &&
+           record->length < TAG_LENGTH;
+}
+
+/**
+ * Count the part of the log the index does not cover yet, a torn record at
+ * the end of the log is cut off
+ * @param store the store, index mapped and log open
+ * @return int 0 on success, -1 otherwise
+ */
+static int replay_log(Tag_store *store){
+    Tag_index_header *header = &store->index->head.header;
+    struct stat st;
+    if (fstat(store->log_fd, &st) < 0){ return -1; }
+    uint64_t length = header->log_length;
+    Tag_record records[256];
+    for (;;){
+        ssize_t n = pread(store->log_fd, records, sizeof(records), length);
+        if (n < 0){
+            if (errno == EINTR){ continue; }
+            return -1;
+        }
+        int count = n / sizeof(Tag_record);
+        int i;
+        for (i = 0; i < count && record_valid(&records[i]); i++){
+            count_record(store->index, &records[i]);
+        }
+        length += i * sizeof(Tag_record);
+        if (i < count || (size_t)n < sizeof(records)){ break; }
+    }
+    if (length == 0 && (size_t)st.st_size >= sizeof(Tag_record)){
+        // not a torn tail, the log was written with another record layout
+        fprintf(stderr, "tag log: no valid record, not truncating it\n");
+        errno = EINVAL;
+        return -1;
+    }
+    if (length < (uint64_t)st.st_size){
+        fprintf(stderr, "tag log: dropping %lld torn bytes\n",
+                (long long)(st.st_size - length));
+        if (ftruncate(store->log_fd, length) < 0){ return -1; }
+    }
+    header->log_length = length;
+    return 0;
+}
+
+/**
+ * Open or create the index and bring it up to date with the log
+ * @param store the store, log open
+ * @param index_path the index file
+ * @return int 0 on success, -1 otherwise
+ */
+static int open_index(Tag_store *store, char const *index_path){
+    int fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0){ return -1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        ((size_t)st.st_size != sizeof(Tag_index) &&
+         ftruncate(fd, sizeof(Tag_index)) < 0)){
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(Tag_index), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    store->index = map;
+
+    Tag_index_header *header = &store->index->head.header;
+    off_t log_size = lseek(store->log_fd, 0, SEEK_END);
+    if (log_size < 0){
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size != sizeof(Tag_index) ||
+        header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+        header->slots != TAG_SLOTS || header->dirty ||
+        header->log_length > (uint64_t)log_size ||
+        header->log_length % sizeof(Tag_record)){
+        // rebuild the index from the whole log, cutting the file to nothing
+        // zeroes it without touching every page of the mapping
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(Tag_index)) < 0){
+            close(fd);
+            return -1;
+        }
+        header->magic = INDEX_MAGIC;
+        header->version = INDEX_VERSION;
+        header->slots = TAG_SLOTS;
+    }
+    close(fd);
+    if (replay_log(store) < 0){ return -1; }
+    return msync(store->index, sizeof(Tag_index), MS_SYNC);
+}
+
+/**
+ * Write a batch of records to the log and count them into the index
+ * @param store the store
+ * @param records the records
+ * @param count the number of records
+ * @return int 0 on success, -1 if the log could not be written or synced
+ *             and nothing was counted
+ */
+static int commit_batch(Tag_store *store, Tag_record const *records,
+                        int count){
+    Tag_index_header *header = &store->index->head.header;
+    char const *data = (char const *)records;
+    size_t length = count * sizeof(Tag_record);
+    size_t written = 0;
+    while (written < length){
+        ssize_t n = pwrite(store->log_fd, data + written, length - written,
+                           header->log_length + written);
+        if (n < 0){
+            if (errno == EINTR){ continue; }
+            __atomic_store_n(&store->error, errno, __ATOMIC_RELAXED);
+            perror("tag log write");
+            return -1;
+        }
+        written += n;
+    }
+    // the kernel may have dropped the pages that failed, the batch is not
+    // durable and goes out again
+    if (fdatasync(store->log_fd) < 0){
+        __atomic_store_n(&store->error, errno, __ATOMIC_RELAXED);
+        perror("tag log fdatasync");
+        return -1;
+    }
+
+    // the log is the commit point, a crash before the index is synced
+    // again finds dirty set and rebuilds it
+    if (!header->dirty){
+        header->dirty = 1;
+        msync(store->index, sizeof(store->index->head), MS_SYNC);
+    }
+    pthread_rwlock_wrlock(&store->index_lock);
+    for (int i = 0; i < count; i++){
+        count_record(store->index, &records[i]);
+    }
+    pthread_rwlock_unlock(&store->index_lock);
+    header->log_length += length;
+    // read by /metrics on the shards
+    __atomic_store_n(&store->commits, store->commits + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&store->records, store->records + count,
+                     __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Write the counted tables back to the index file and clear dirty, so a
+ * restart only replays the log past them
+ * @param store the store
+ */
+static void sync_index(Tag_store *store){
+    Tag_index_header *header = &store->index->head.header;
+    if (msync(store->index->totals,
+              sizeof(Tag_index) - sizeof(store->index->head), MS_SYNC) < 0){
+        perror("tag index msync");
+        return;
+    }
+    header->dirty = 0;
+    msync(store->index, sizeof(store->index->head), MS_SYNC);
+}
+
+/**
+ * The group-commit thread, every record queued while a batch is being
+ * written goes out with the next one. A batch that fails is written again
+ * after TAG_RETRY_DELAY, up to TAG_RETRIES times before it is given up.
+ * The index is synced INDEX_SYNC_DELAY after the first batch it counted
+ * since the last sync, or when a flush asks for it
+ * @param arg the store
+ * @return NULL
+ */
+static void* writer_main(void *arg){
+    Tag_store *store = arg;
+    Tag_index_header *header = &store->index->head.header;
+    Tag_record *batch = NULL;
+    int max_batch = 0;
+    int count = 0;
+    int attempts = 0;
+    struct timespec deadline = {0, 0};
+    for (;;){
+        pthread_mutex_lock(&store->lock);
+        while (count == 0 && store->num_pending == 0 &&
+               !(header->dirty && store->sync_wanted)){
+            if (!header->dirty){
+                store->sync_wanted = false;
+                pthread_cond_broadcast(&store->idle);
+                pthread_cond_wait(&store->ready, &store->lock);
+            }else if (pthread_cond_timedwait(&store->ready, &store->lock,
+                                             &deadline) == ETIMEDOUT){
+                break;
+            }
+        }
+        if (count == 0 && store->num_pending == 0){
+            // idle with counts the index file does not hold yet
+            store->writing = true;
+            pthread_mutex_unlock(&store->lock);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += INDEX_SYNC_DELAY;
+            sync_index(store);
+            pthread_mutex_lock(&store->lock);
+            store->writing = false;
+            store->sync_wanted = false;
+            pthread_cond_broadcast(&store->idle);
+            pthread_mutex_unlock(&store->lock);
+            continue;
+        }
+        // swap the buffers, the shards keep queueing into the other one
+        if (count == 0){
+            Tag_record *pending = store->pending;
+            int max_pending = store->max_pending;
+            count = store->num_pending;
+            store->pending = batch;
+            store->max_pending = max_batch;
+            store->num_pending = 0;
+            batch = pending;
+            max_batch = max_pending;
+        }
+        store->writing = true;
+        pthread_mutex_unlock(&store->lock);
+        bool synced = !header->dirty;
+        if (commit_batch(store, batch, count) == 0){
+            count = 0;
+            attempts = 0;
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (synced){
+                deadline = now;
+                deadline.tv_sec += INDEX_SYNC_DELAY;
+            }else if (now.tv_sec >= deadline.tv_sec){
+                // a store that never idles still syncs its index
+                deadline.tv_sec = now.tv_sec + INDEX_SYNC_DELAY;
+                sync_index(store);
+            }
+        }else{
+            // read by the shards for /metrics and the event log
+            __atomic_store_n(&store->failures, store->failures + 1,
+                             __ATOMIC_RELEASE);
+            if (++attempts < TAG_RETRIES){
+                sleep(TAG_RETRY_DELAY);
+            }else{
+                __atomic_store_n(&store->lost, store->lost + count,
+                                 __ATOMIC_RELAXED);
+                count = 0;
+                attempts = 0;
+            }
+        }
+        pthread_mutex_lock(&store->lock);
+        store->writing = count > 0;
+        pthread_cond_broadcast(&store->idle);
+        pthread_mutex_unlock(&store->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Open the log and the index and start the writer thread
+ * @param store the store
+ * @param log_path the log file
+ * @param index_path the index file
+ * @return int 0 on success, -1 otherwise
+ */
+int tag_store_open(Tag_store *store, char const *log_path,
+                   char const *index_path){
+    memset(store, 0, sizeof(Tag_store));
+    store->log_fd = open(log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->log_fd < 0 || open_index(store, index_path) < 0){
+        return -1;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->ready, NULL);
+    pthread_cond_init(&store->idle, NULL);
+    pthread_rwlock_init(&store->index_lock, NULL);
+    if (pthread_create(&store->writer, NULL, writer_main, store)){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue an agreed keyword, it is written by the next group commit
+ * @param store the store
+ * @param image the image id
+ * @param keyword the keyword, cut to TAG_LENGTH - 1 bytes
+ * @param length the length of the keyword
+ * @param player the id of the player that found the match
+ * @param partner the id of its partner
+ * @return int 0 on success, -1 otherwise
+ */
+int tag_store_append(Tag_store *store, uint32_t image, char const *keyword,
+                     size_t length, uint32_t player, uint32_t partner){
+    if (image >= TAG_IMAGES || length == 0){
+        return -1;
+    }
+    Tag_record record;
+    memset(&record, 0, sizeof(Tag_record));
+    record.time = (uint32_t)time(NULL);
+    record.image = image;
+    record.length = length < TAG_LENGTH ? length : TAG_LENGTH - 1;
+    record.players[0] = player;
+    record.players[1] = partner;
+    memcpy(record.keyword, keyword, record.length);
+    record.check = record_check(&record);
+
+    pthread_mutex_lock(&store->lock);
+    if (store->num_pending == store->max_pending){
+        int max_pending = store->max_pending ? store->max_pending * 2 :
+                          PENDING_SIZE;
+        Tag_record *pending = realloc(store->pending,
+                                      max_pending * sizeof(Tag_record));
+        if (pending == NULL){
+            pthread_mutex_unlock(&store->lock);
+            return -1;
+        }
+        store->pending = pending;
+        store->max_pending = max_pending;
+    }
+    store->pending[store->num_pending++] = record;
+    pthread_cond_signal(&store->ready);
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+/**
+ * Wait until every record queued so far is written and counted, and the
+ * index file holds the counts
+ * @param store the store
+ */
+void tag_store_flush(Tag_store *store){
+    pthread_mutex_lock(&store->lock);
+    store->sync_wanted = true;
+    pthread_cond_signal(&store->ready);
+    while (store->num_pending > 0 || store->writing || store->sync_wanted){
+        pthread_cond_wait(&store->idle, &store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * The most agreed keywords of an image
+ * @param store the store
+ * @param image the image id
+ * @param top filled in, most frequent first
+ * @param k the size of top
+ * @return int the number of keywords filled in
+ */
+int tag_store_top(Tag_store *store, uint32_t image, Tag_count *top, int k){
+    if (image >= TAG_IMAGES || k <= 0){ return 0; }
+    int n = 0;
+    pthread_rwlock_rdlock(&store->index_lock);
+    Tag_count const *slots = store->index->slots;
+    // only the keywords of the image are visited
+    for (uint32_t i = store->index->first[image]; i != 0;
+         i = slots[i - 1].next){
+        Tag_count const *tag = &slots[i - 1];
+        if (n == k && tag->count <= top[k - 1].count){
+            continue;
+        }
+        // insertion into the sorted top list
+        int j = n < k ? n++ : k - 1;
+        while (j > 0 && top[j - 1].count < tag->count){
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = *tag;
+    }
+    pthread_rwlock_unlock(&store->index_lock);
+    return n;
+}
+
+/**
+ * Copy the counts of the next slots of the index, calls walk the whole
+ * index in slot order and see a count as it is at the time of the call
+ * @param store the store
+ * @param cursor the first slot to visit, advanced past the slots visited,
+ * the scan is over once it reaches TAG_SLOTS
+ * @param out filled with the counts found
+ * @param max the size of out
+ * @return int the number of counts filled in
+ */
+int tag_store_scan(Tag_store *store, uint32_t *cursor, Tag_count *out,
+                   int max){
+    int n = 0;
+    uint32_t i = *cursor;
+    uint32_t end = i < TAG_SLOTS - SCAN_SLOTS ? i + SCAN_SLOTS : TAG_SLOTS;
+    pthread_rwlock_rdlock(&store->index_lock);
+    Tag_count const *slots = store->index->slots;
+    for (; i < end && n < max; i++){
+        if (slots[i].count > 0){
+            out[n++] = slots[i];
+        }
+    }
+    pthread_rwlock_unlock(&store->index_lock);
+    *cursor = i;
+    return n;
+}
+
+/**
+ * The number of keywords agreed on for an image
+ * @param store the store
+ * @param image the image id
+ * @return uint32_t the agreements counted so far
+ */
+uint32_t tag_store_total(Tag_store *store, uint32_t image){
+    if (image >= TAG_IMAGES){ return 0; }
+    pthread_rwlock_rdlock(&store->index_lock);
+    uint32_t total = store->index->totals[image];
+    pthread_rwlock_unlock(&store->index_lock);
+    return total;
+}
@@ -0,0 +1,146 @@
+/*
+** Tag store of image-tagger
+ * Every keyword two players agree on is appended to a binary log as a
+ * fixed size record. A writer thread group-commits the records queued by
+ * the shards with one write() and one fdatasync(), then counts them into a
+ * memory-mapped index: one hash table of (image, keyword) counts whose
+ * entries are also chained per image, and the tags agreed per image. The
+ * log is the commit point; the index is written back a few seconds later
+ * and on flush, and stays marked dirty until then. The index remembers
+ * how much of the log it covers, at startup only the rest of the log is
+ * replayed, or all of it if the index is missing or dirty.
+*/
+
+#ifndef TAG_STORE_H
+#define TAG_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+/** Define the longest keyword stored plus one, NUL padded */
+#define TAG_LENGTH 20
+
+/** Define the # image ids indexed */
+#define TAG_IMAGES (1 << 18)
+
+/** Define the # distinct (image, keyword) pairs indexed, a power of two */
+#define TAG_SLOTS (1 << 20)
+
+/** An agreed keyword as it is written to the log
+ *  @param uint32_t check The hash of the rest of the record
+ *  @param uint32_t time The unix time of the agreement
+ *  @param uint32_t image The image id
+ *  @param uint32_t players[2] The ids of the pair, the node above
+ *         COOKIE_BITS and the slot * num_shards + shard of that node below
+ *  @param uint8_t length The length of the keyword
+ *  @param char keyword[TAG_LENGTH - 1] The keyword, NUL padded
+ */
+typedef struct {
+    uint32_t check;
+    uint32_t time;
+    uint32_t image;
+    uint32_t players[2];
+    uint8_t length;
+    char keyword[TAG_LENGTH - 1];
+} Tag_record;
+
+/** A keyword of an image and how often it was agreed on
+ *  @param char keyword[TAG_LENGTH] The keyword, NUL padded
+ *  @param uint32_t image The image id
+ *  @param uint32_t count The number of agreements, 0 if the slot is unused
+ *  @param uint32_t next The slot of the next keyword of the image plus one,
+ *  0 at the end
+ */
+typedef struct {
+    char keyword[TAG_LENGTH];
+    uint32_t image;
+    uint32_t count;
+    uint32_t next;
+} Tag_count;
+
+/** The head of the index file
+ *  @param uint32_t magic Identifies the file
+ *  @param uint32_t version The layout version
+ *  @param uint64_t log_length The bytes of the log counted in the index
+ *  @param uint32_t dirty Set while a batch is being counted
+ *  @param uint32_t slots TAG_SLOTS of the writer
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t log_length;
+    uint32_t dirty;
+    uint32_t slots;
+} Tag_index_header;
+
+/** The mapped index file
+ *  @param Tag_index_header header The head, alone in the first page
+ *  @param uint32_t totals[TAG_IMAGES] The agreements of each image
+ *  @param uint32_t first[TAG_IMAGES] The slot of the first keyword of each
+ *  image plus one, 0 if none
+ *  @param Tag_count slots[TAG_SLOTS] The (image, keyword) counts
+ */
+typedef struct {
+    union {
+        Tag_index_header header;
+        char page[4096];
+    } head;
+    uint32_t totals[TAG_IMAGES];
+    uint32_t first[TAG_IMAGES];
+    Tag_count slots[TAG_SLOTS];
+} Tag_index;
+
+/** The tag store shared by every shard
+ *  @param int log_fd The log file
+ *  @param Tag_index *index The mapped index file
+ *  @param pthread_mutex_t lock Guards the pending records
+ *  @param pthread_cond_t ready Signalled when records are pending
+ *  @param pthread_cond_t idle Signalled when a batch is written
+ *  @param bool writing A batch is being written
+ *  @param bool sync_wanted A flush waits for the index file to be synced
+ *  @param Tag_record *pending The records not written yet
+ *  @param int num_pending The number of pending records
+ *  @param int max_pending The capacity of pending
+ *  @param pthread_rwlock_t index_lock Guards the tables of the index
+ *  @param pthread_t writer The group-commit thread
+ *  @param uint64_t commits The number of batches written
+ *  @param uint64_t records The number of records written
+ *  @param uint64_t failures The number of batches that failed to be written
+ *  @param uint64_t lost The number of records given up after TAG_RETRIES
+ *  @param int error The errno of the last failure
+ */
+typedef struct {
+    int log_fd;
+    Tag_index *index;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t idle;
+    bool writing;
+    bool sync_wanted;
+    Tag_record *pending;
+    int num_pending;
+    int max_pending;
+    pthread_rwlock_t index_lock;
+    pthread_t writer;
+    uint64_t commits;
+    uint64_t records;
+    uint64_t failures;
+    uint64_t lost;
+    int error;
+} Tag_store;
+
+/** Prototypes */
+int tag_store_open(Tag_store *store, char const *log_path,
+                   char const *index_path);
+int tag_store_append(Tag_store *store, uint32_t image, char const *keyword,
+                     size_t length, uint32_t player, uint32_t partner);
+int tag_store_top(Tag_store *store, uint32_t image, Tag_count *top, int k);
+uint32_t tag_store_total(Tag_store *store, uint32_t image);
+int tag_store_scan(Tag_store *store, uint32_t *cursor, Tag_count *out,
+                   int max);
+void tag_store_flush(Tag_store *store);
+
+#endif
@@ -0,0 +1,532 @@
+/*
+** Page templates of image-tagger
+ * A slot is written {{name}} in the html, unknown names stay literal text.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "template.h"
+
+/** Define the buffer size of inotify events */
+#define INOTIFY_SIZE 4096
+
+/** Define the shortest slot value deflated per response, shorter ones are
+ *  sent as stored blocks */
+#define DEFLATE_MIN 256
+
+/** Define the longest stored deflate block */
+#define STORED_MAX 65535
+
+/** Define the bytes after the last piece of a gzip body: an empty final
+ *  block, the CRC-32 and the length */
+#define GZIP_TRAILER 10
+
+/** A gzip member header: deflate, no flags, no time, unix */
+static unsigned char const GZIP_HEADER[10] = {
+    0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+};
+
+/** The file of each page, indexed by PAGE */
+static char const * const PAGE_FILES[NUM_PAGES] = {
+    "1_intro.html",
+    "2_start.html",
+    "3_first_turn.html",
+    "4_accepted.html",
+    "5_discarded.html",
+    "6_endgame.html",
+    "7_gameover.html"
+};
+
+/** The name of each slot, indexed by SLOT */
+static char const * const SLOT_NAMES[NUM_SLOTS] = {
+    "text",
+    "image"
+};
+
+/** Bumped by the watcher when a page changes on disk */
+static int generation = 0;
+
+/**
+ * Read a whole file
+ * @param name the file name
+ * @param size set to the number of bytes read
+ * @return char* the NUL terminated content, NULL on failure
+ */
+static char* read_file(char const *name, size_t *size){
+    int filefd = open(name, O_RDONLY);
+    if (filefd < 0){ return NULL; }
+    struct stat st;
+    if (fstat(filefd, &st) < 0){
+        close(filefd);
+        return NULL;
+    }
+    char *content = malloc(st.st_size + 1);
+    size_t n = 0;
+    while (content != NULL && n < (size_t)st.st_size){
+        ssize_t r = read(filefd, content + n, st.st_size - n);
+        if (r <= 0){
+            free(content);
+            content = NULL;
+            break;
+        }
+        n += r;
+    }
+    close(filefd);
+    if (content == NULL){ return NULL; }
+    content[n] = '\0';
+    *size = n;
+    return content;
+}
+
+/**
+ * Append one segment to a template being compiled
+ * @param page the template
+ * @param text the static text, ignored for a slot
+ * @param length the length of text
+ * @param slot the slot, -1 for static text
+ */
+static void add_segment(Template *page, char const *text, size_t length,
+                        int slot){
+    if (slot < 0 && length == 0){ return; }
+    Segment *segment = &page->segments[page->num_segments++];
+    segment->text.text = text;
+    segment->text.length = slot < 0 ? length : 0;
+    segment->slot = slot;
+    if (slot < 0){
+        page->static_length += length;
+    }
+}
+
+/**
+ * Compile the content of a page into segments
+ * @param page the template, takes ownership of source
+ * @param source the NUL terminated html
+ * @param size the length of source
+ * @return int 0 on success, -1 otherwise
+ */
+static int compile(Template *page, char *source, size_t size){
+    // a page has at most one more static segment than slots
+    int max_segments = 1;
+    for (char *p = strstr(source, "{{"); p != NULL; p = strstr(p + 2, "{{")){
+        max_segments += 2;
+    }
+    memset(page, 0, sizeof(Template));
+    page->segments = malloc(max_segments * sizeof(Segment));
+    if (page->segments == NULL){ return -1; }
+    page->source = source;
+
+    char *start = source;
+    char *p = source;
+    while ((p = strstr(p, "{{")) != NULL){
+        char *end = strstr(p + 2, "}}");
+        if (end == NULL){ break; }
+        int slot = -1;
+        for (int i = 0; i < NUM_SLOTS; i++){
+            if ((size_t)(end - p - 2) == strlen(SLOT_NAMES[i]) &&
+                !strncmp(p + 2, SLOT_NAMES[i], end - p - 2)){
+                slot = i;
+            }
+        }
+        if (slot < 0){
+            // not a slot, keep it as text
+            p += 2;
+            continue;
+        }
+        add_segment(page, start, p - start, -1);
+        add_segment(page, NULL, 0, slot);
+        start = end + 2;
+        p = start;
+    }
+    add_segment(page, start, source + size - start, -1);
+    return 0;
+}
+
+/**
+ * Deflate a text into raw deflate blocks ending on a byte boundary, they
+ * can be followed by any other blocks
+ * @param stream the stream, reset
+ * @param text the text
+ * @param length the length of text
+ * @param out the output
+ * @param capacity the size of out
+ * @return long the bytes written, -1 if they do not fit
+ */
+static long deflate_text(z_stream *stream, char const *text, size_t length,
+                         char *out, size_t capacity){
+    stream->next_in = (Bytef *)text;
+    stream->avail_in = length;
+    stream->next_out = (Bytef *)out;
+    stream->avail_out = capacity;
+    // a full output buffer may hide an unfinished flush
+    if (deflate(stream, Z_SYNC_FLUSH) != Z_OK || stream->avail_in > 0 ||
+        stream->avail_out == 0){
+        return -1;
+    }
+    return capacity - stream->avail_out;
+}
+
+/**
+ * Deflate every static segment of a compiled page, each on its own so no
+ * block refers to another
+ * @param page the template
+ * @return int 0 on success, -1 otherwise
+ */
+static int precompress(Template *page){
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                     MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK){
+        return -1;
+    }
+    size_t capacity = 1;
+    for (int i = 0; i < page->num_segments; i++){
+        capacity += deflateBound(&stream, page->segments[i].text.length) + 16;
+    }
+    page->deflated = malloc(capacity);
+    size_t used = 0;
+    for (int i = 0; i < page->num_segments && page->deflated != NULL; i++){
+        Segment *segment = &page->segments[i];
+        if (segment->slot >= 0){ continue; }
+        deflateReset(&stream);
+        long n = deflate_text(&stream, segment->text.text,
+                              segment->text.length, page->deflated + used,
+                              capacity - used);
+        if (n < 0){
+            deflateEnd(&stream);
+            return -1;
+        }
+        segment->deflated.text = page->deflated + used;
+        segment->deflated.length = n;
+        segment->crc = crc32_z(0, (Bytef const *)segment->text.text,
+                               segment->text.length);
+        segment->crc_op = crc32_combine_gen(segment->text.length);
+        used += n;
+    }
+    deflateEnd(&stream);
+    return page->deflated != NULL ? 0 : -1;
+}
+
+/**
+ * Release a compiled page
+ * @param page the template
+ */
+static void release(Template *page){
+    free(page->segments);
+    free(page->source);
+    free(page->deflated);
+    memset(page, 0, sizeof(Template));
+}
+
+/**
+ * Read and compile one page, the old version is kept on failure
+ * @param page the template
+ * @param name the file name
+ * @return int 0 on success, -1 otherwise
+ */
+static int load_page(Template *page, char const *name){
+    size_t size;
+    char *source = read_file(name, &size);
+    Template compiled;
+    if (source == NULL){ return -1; }
+    if (compile(&compiled, source, size) < 0){
+        free(source);
+        return -1;
+    }
+    if (precompress(&compiled) < 0){
+        release(&compiled);
+        return -1;
+    }
+    release(page);
+    *page = compiled;
+    return 0;
+}
+
+/**
+ * Compile every page
+ * @param set the template set
+ * @return int 0 on success, -1 if a page can not be read
+ */
+int templates_load(Template_set *set){
+    set->generation = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < NUM_PAGES; i++){
+        if (load_page(&set->pages[i], PAGE_FILES[i]) < 0){
+            perror(PAGE_FILES[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Recompile the pages if the watcher saw a change, one atomic load
+ * otherwise
+ * @param set the template set
+ */
+void templates_refresh(Template_set *set){
+    int current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    if (current == set->generation){ return; }
+    set->generation = current;
+    for (int i = 0; i < NUM_PAGES; i++){
+        if (load_page(&set->pages[i], PAGE_FILES[i]) < 0){
+            perror(PAGE_FILES[i]);
+        }
+    }
+}
+
+/**
+ * Event handler of the inotify fd
+ * @param loop the event loop
+ * @param fd the inotify fd
+ * @param events the events that fired
+ * @param data unused
+ */
+static void handle_inotify(Event_loop *loop, int fd, unsigned events,
+                           void *data){
+    char buff[INOTIFY_SIZE]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    bool changed = false;
+    while ((n = read(fd, buff, sizeof(buff))) > 0){
+        for (char *p = buff; p < buff + n;
+             p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && page_lookup(event->name) >= 0){
+                changed = true;
+            }
+        }
+    }
+    if (changed){
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Watch the page directory for edits
+ * @param loop the event loop that reads the notifications
+ * @return int 0 on success, -1 otherwise
+ */
+int templates_watch(Event_loop *loop){
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0){ return -1; }
+    // editors often write a new file and rename it over the old one
+    if (inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        event_loop_add(loop, fd, EVENT_READ, handle_inotify, NULL) < 0){
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the page of an html file name
+ * @param html_name the file name
+ * @return int the PAGE, -1 if unknown
+ */
+int page_lookup(char const *html_name){
+    for (int i = 0; i < NUM_PAGES; i++){
+        if (!strcmp(html_name, PAGE_FILES[i])){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * The html file name of a page
+ * @param page the page
+ * @return char const* the file name
+ */
+char const* page_name(PAGE page){
+    return PAGE_FILES[page];
+}
+
+/**
+ * The length a page renders to
+ * @param page the template
+ * @param values the value of each slot, indexed by SLOT
+ * @return size_t the number of bytes
+ */
+size_t template_size(Template const *page, Slice const *values){
+    size_t size = page->static_length;
+    for (int i = 0; i < page->num_segments; i++){
+        if (page->segments[i].slot >= 0){
+            size += values[page->segments[i].slot].length;
+        }
+    }
+    return size;
+}
+
+/**
+ * Render a page
+ * @param page the template
+ * @param values the value of each slot, indexed by SLOT
+ * @param out the buffer, at least template_size bytes
+ * @return size_t the number of bytes written
+ */
+size_t template_render(Template const *page, Slice const *values, char *out){
+    size_t n = 0;
+    for (int i = 0; i < page->num_segments; i++){
+        Slice const *text = page->segments[i].slot < 0 ?
+                            &page->segments[i].text :
+                            &values[page->segments[i].slot];
+        if (text->length > 0){
+            memcpy(out + n, text->text, text->length);
+            n += text->length;
+        }
+    }
+    return n;
+}
+
+/**
+ * Describe a rendered page as an iovec list without copying it
+ * @param page the template
+ * @param values the value of each slot, indexed by SLOT
+ * @param iov at least num_segments entries
+ * @return int the number of entries used
+ */
+int template_iovec(Template const *page, Slice const *values,
+                   struct iovec *iov){
+    int n = 0;
+    for (int i = 0; i < page->num_segments; i++){
+        Slice const *text = page->segments[i].slot < 0 ?
+                            &page->segments[i].text :
+                            &values[page->segments[i].slot];
+        if (text->length > 0){
+            iov[n].iov_base = (void *)text->text;
+            iov[n].iov_len = text->length;
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * The scratch memory template_gzip needs for the slot values and the
+ * trailer of a page
+ * @param page the template
+ * @param values the value of each slot, indexed by SLOT
+ * @return size_t the number of bytes
+ */
+size_t template_gzip_size(Template const *page, Slice const *values){
+    size_t size = GZIP_TRAILER;
+    for (int i = 0; i < page->num_segments; i++){
+        if (page->segments[i].slot >= 0){
+            size_t length = values[page->segments[i].slot].length;
+            size += compressBound(length) + 5 * (length / STORED_MAX + 1) + 16;
+        }
+    }
+    return size;
+}
+
+/**
+ * Pack a slot value as stored blocks
+ * @param value the value
+ * @param out room for the value and 5 bytes per STORED_MAX bytes of it
+ * @return size_t the bytes written
+ */
+static size_t store_value(Slice value, char *out){
+    size_t n = 0;
+    for (size_t done = 0; done < value.length; done += STORED_MAX){
+        size_t length = value.length - done < STORED_MAX ?
+                        value.length - done : STORED_MAX;
+        out[n++] = 0;
+        out[n++] = length & 0xff;
+        out[n++] = length >> 8;
+        out[n++] = ~length & 0xff;
+        out[n++] = (~length >> 8) & 0xff;
+        memcpy(out + n, value.text + done, length);
+        n += length;
+    }
+    return n;
+}
+
+/**
+ * Pack a slot value as deflate blocks, deflated if it is long enough to be
+ * worth it and stored otherwise
+ * @param set the template set, owns the stream
+ * @param value the value
+ * @param out room as counted by template_gzip_size
+ * @return size_t the bytes written
+ */
+static size_t pack_value(Template_set *set, Slice value, char *out){
+    if (value.length >= DEFLATE_MIN && set->stream == NULL){
+        z_stream *stream = calloc(1, sizeof(z_stream));
+        if (stream != NULL &&
+            deflateInit2(stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS,
+                         MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK){
+            set->stream = stream;
+        }else{
+            free(stream);
+        }
+    }
+    if (value.length >= DEFLATE_MIN && set->stream != NULL){
+        deflateReset(set->stream);
+        size_t capacity = compressBound(value.length) + 16;
+        long n = deflate_text(set->stream, value.text, value.length, out,
+                              capacity);
+        if (n >= 0 && (size_t)n < value.length){ return n; }
+    }
+    return store_value(value, out);
+}
+
+/**
+ * Describe a page as the iovec list of a gzip body, the static segments go
+ * out precompressed, the slot values and the trailer are written to scratch
+ * @param set the template set of the page
+ * @param page the template
+ * @param values the value of each slot, indexed by SLOT
+ * @param scratch at least template_gzip_size bytes
+ * @param iov at least num_segments + 2 entries
+ * @return int the number of entries used
+ */
+int template_gzip(Template_set *set, Template const *page,
+                  Slice const *values, char *scratch, struct iovec *iov){
+    int n = 0;
+    size_t used = 0;
+    uLong crc = crc32_z(0, NULL, 0);
+    size_t total = 0;
+    iov[n].iov_base = (void *)GZIP_HEADER;
+    iov[n].iov_len = sizeof(GZIP_HEADER);
+    n++;
+    for (int i = 0; i < page->num_segments; i++){
+        Segment const *segment = &page->segments[i];
+        if (segment->slot < 0){
+            crc = crc32_combine_op(crc, segment->crc, segment->crc_op);
+            total += segment->text.length;
+            iov[n].iov_base = (void *)segment->deflated.text;
+            iov[n].iov_len = segment->deflated.length;
+            n++;
+            continue;
+        }
+        Slice value = values[segment->slot];
+        if (value.length == 0){ continue; }
+        crc = crc32_z(crc, (Bytef const *)value.text, value.length);
+        total += value.length;
+        size_t length = pack_value(set, value, scratch + used);
+        iov[n].iov_base = scratch + used;
+        iov[n].iov_len = length;
+        used += length;
+        n++;
+    }
+    unsigned char *trailer = (unsigned char *)scratch + used;
+    trailer[0] = 0x03;
+    trailer[1] = 0x00;
+    for (int i = 0; i < 4; i++){
+        trailer[2 + i] = (crc >> (8 * i)) & 0xff;
+        trailer[6 + i] = (total >> (8 * i)) & 0xff;
+    }
+    iov[n].iov_base = trailer;
+    iov[n].iov_len = GZIP_TRAILER;
+    return n + 1;
+}
@@ -0,0 +1,102 @@
+/*
+** Page templates of image-tagger
+ * Every html page is read once and compiled into static segments and named
+ * slots ({{text}}, {{image}}), rendering only copies segments and slot
+ * values. An inotify watch on the page directory bumps a generation
+ * counter, every shard recompiles its own copy when it sees a new one.
+ * Every static segment is also deflated once when it is compiled, ending on
+ * a byte boundary, so a gzip response is the precompressed segments with
+ * the slot values packed between them and a trailer, the CRC of the whole
+ * page being combined from the CRC of each piece.
+*/
+
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+#include "event.h"
+#include "slice.h"
+
+/** Represents the named slots a page can contain */
+typedef enum
+{
+    SLOT_TEXT,
+    SLOT_IMAGE,
+    NUM_SLOTS
+} SLOT;
+
+/** Represents the pages of the game */
+typedef enum
+{
+    PAGE_INTRO,
+    PAGE_START,
+    PAGE_FIRST_TURN,
+    PAGE_ACCEPTED,
+    PAGE_DISCARDED,
+    PAGE_ENDGAME,
+    PAGE_GAMEOVER,
+    NUM_PAGES
+} PAGE;
+
+/** A static segment of a page or a slot
+ *  @param Slice text The static text, empty for a slot
+ *  @param int slot The SLOT filled in here, -1 for static text
+ *  @param Slice deflated The static text as raw deflate blocks
+ *  @param uint32_t crc The CRC-32 of the static text
+ *  @param unsigned long crc_op Appends the CRC of the static text to
+ *  another CRC, from crc32_combine_gen
+ */
+typedef struct {
+    Slice text;
+    int slot;
+    Slice deflated;
+    uint32_t crc;
+    unsigned long crc_op;
+} Segment;
+
+/** A compiled page
+ *  @param char *source The content of the file, segments point into it
+ *  @param Segment *segments The segments in order
+ *  @param int num_segments The number of segments
+ *  @param size_t static_length The length of all static segments
+ *  @param char *deflated The buffer of the deflated segments
+ */
+typedef struct {
+    char *source;
+    Segment *segments;
+    int num_segments;
+    size_t static_length;
+    char *deflated;
+} Template;
+
+/** The compiled pages of one shard
+ *  @param Template pages[NUM_PAGES] The pages indexed by PAGE
+ *  @param int generation The reload generation the pages were compiled at
+ *  @param void *stream The z_stream deflating long slot values, NULL until
+ *  first needed
+ */
+typedef struct {
+    Template pages[NUM_PAGES];
+    int generation;
+    void *stream;
+} Template_set;
+
+/** Prototypes */
+int templates_load(Template_set *set);
+void templates_refresh(Template_set *set);
+int templates_watch(Event_loop *loop);
+int page_lookup(char const *html_name);
+char const* page_name(PAGE page);
+size_t template_size(Template const *page, Slice const *values);
+size_t template_render(Template const *page, Slice const *values, char *out);
+int template_iovec(Template const *page, Slice const *values,
+                   struct iovec *iov);
+size_t template_gzip_size(Template const *page, Slice const *values);
+int template_gzip(Template_set *set, Template const *page,
+                  Slice const *values, char *scratch, struct iovec *iov);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+** Timer wheel of image-tagger
+*/
+
+#include "timer_wheel.h"
+
+/**
+ * Link a timer at the tail of a list
+ * @param head the list head
+ * @param timer the timer, not linked
+ */
+static void link_timer(Timer *head, Timer *timer){
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * Initialise a wheel with no timer
+ * @param wheel the wheel
+ * @param now the current second
+ * @param handler called for every expired timer
+ * @param data passed to handler
+ */
+void timer_wheel_init(Timer_wheel *wheel, uint32_t now, Timer_handler handler,
+                      void *data){
+    for (int i = 0; i < WHEEL_SLOTS; i++){
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->now = now;
+    wheel->handler = handler;
+    wheel->data = data;
+}
+
+/**
+ * Arm a timer, or move it if it is armed already
+ * @param wheel the wheel
+ * @param timer the timer
+ * @param expires the second it fires, the next tick if already past
+ */
+void timer_arm(Timer_wheel *wheel, Timer *timer, uint32_t expires){
+    timer_cancel(timer);
+    if ((int32_t)(expires - wheel->now) <= 0){
+        expires = wheel->now + 1;
+    }
+    timer->expires = expires;
+    link_timer(&wheel->slots[expires & (WHEEL_SLOTS - 1)], timer);
+}
+
+/**
+ * Disarm a timer, nothing happens if it is not armed
+ * @param timer the timer
+ */
+void timer_cancel(Timer *timer){
+    if (timer->next == NULL){ return; }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/**
+ * Fire every timer due up to a second, the slots passed since the last
+ * advance are walked once each
+ * @param wheel the wheel
+ * @param now the current second
+ */
+void timer_wheel_advance(Timer_wheel *wheel, uint32_t now){
+    if ((int32_t)(now - wheel->now) <= 0){ return; }
+    uint32_t steps = now - wheel->now;
+    // after a long stall every slot is walked once
+    if (steps > WHEEL_SLOTS){ steps = WHEEL_SLOTS; }
+    uint32_t first = wheel->now + 1;
+    wheel->now = now;
+    for (uint32_t i = 0; i < steps; i++){
+        Timer *slot = &wheel->slots[(first + i) & (WHEEL_SLOTS - 1)];
+        if (slot->next == slot){ continue; }
+        // detach the slot, a handler may arm or cancel any timer meanwhile
+        Timer due;
+        due.next = slot->next;
+        due.prev = slot->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        slot->next = slot;
+        slot->prev = slot;
+        while (due.next != &due){
+            Timer *timer = due.next;
+            timer_cancel(timer);
+            if ((int32_t)(timer->expires - now) <= 0){
+                wheel->handler(wheel, timer, wheel->data);
+            }else{
+                link_timer(slot, timer);
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+** Timer wheel of image-tagger
+ * A hashed timing wheel of one second ticks. A timer is an intrusive node
+ * linked into the slot of its expiry second modulo the wheel size, so arming
+ * and cancelling are O(1) and need no allocation. A tick walks one slot,
+ * timers due in a later turn of the wheel are left in it. Owners usually
+ * arm a timer once and decide when it fires whether the deadline moved.
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Define the # slots of a wheel, a power of two */
+#define WHEEL_SLOTS 512
+
+/** A timer, embedded in what it times
+ *  @param Timer *prev The previous timer of the slot
+ *  @param Timer *next The next timer of the slot, NULL if not armed
+ *  @param uint32_t expires The second the timer fires
+ *  @param int id Identifies what the timer times to its handler
+ */
+typedef struct Timer {
+    struct Timer *prev;
+    struct Timer *next;
+    uint32_t expires;
+    int id;
+} Timer;
+
+typedef struct Timer_wheel Timer_wheel;
+
+/** Callback of an expired timer, which is no longer armed
+ *  @param wheel the wheel the timer was armed on
+ *  @param timer the timer
+ *  @param data the pointer given to timer_wheel_init
+ */
+typedef void (*Timer_handler)(Timer_wheel *wheel, Timer *timer, void *data);
+
+/** A wheel and the handler of its timers
+ *  @param Timer slots[WHEEL_SLOTS] The list heads of the slots
+ *  @param uint32_t now The last second the wheel was advanced to
+ *  @param Timer_handler handler Called for every expired timer
+ *  @param void *data Passed to handler
+ */
+struct Timer_wheel {
+    Timer slots[WHEEL_SLOTS];
+    uint32_t now;
+    Timer_handler handler;
+    void *data;
+};
+
+/** Prototypes */
+void timer_wheel_init(Timer_wheel *wheel, uint32_t now, Timer_handler handler,
+                      void *data);
+void timer_arm(Timer_wheel *wheel, Timer *timer, uint32_t expires);
+void timer_cancel(Timer *timer);
+void timer_wheel_advance(Timer_wheel *wheel, uint32_t now);
+
+/**
+ * Check whether a timer is armed
+ * @param timer the timer
+ * @return Boolean true if it is linked into a wheel
+ */
+static inline bool timer_armed(Timer const *timer){
+    return timer->next != NULL;
+}
+
+#endif